@@ -0,0 +1,308 @@
+// AllocCollector - 汇总多个插装进程的 malloc/free 事件
+// 插装程序通过 allocring.h 把事件写进 /dev/shm/lc_alloc.<pid>,
+// 这里定期扫描 /dev/shm, 把每个环分给一个工作线程去读, 实时统计存活和泄漏的内存.
+//
+// 使用的格式:  ./AllocCollector [-j 线程数] [-n 每线程最多跟踪的存活块数] [-i 打印间隔(ms)]
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "allocring.h"
+
+struct liveEntry{
+    uint64_t addr;          // 0 表示空槽
+    int32_t  pid;
+    uint32_t row;
+    uint16_t col;
+};
+
+// 每个工作线程自己的存活块表, 开放定址+线性探测, 容量固定
+class liveTable{
+public:
+    explicit liveTable(unsigned capLog2) : mask((1u << capLog2) - 1), used(0), tab(1u << capLog2) { }
+
+    bool insert(int32_t pid, uint64_t addr, uint32_t row, uint16_t col){
+        if (used * 4 >= (mask + 1) * 3)         // 超过3/4就不再收了, 保证内存有界
+            return false;
+        for (unsigned i = slot(pid, addr);; i = (i + 1) & mask){
+            liveEntry &e = tab[i];
+            if (e.addr == 0 || (e.addr == addr && e.pid == pid)){
+                if (e.addr == 0) used++;
+                e.addr = addr; e.pid = pid; e.row = row; e.col = col;
+                return true;
+            }
+        }
+    }
+
+    bool erase(int32_t pid, uint64_t addr){
+        unsigned i = slot(pid, addr);
+        for (;; i = (i + 1) & mask){
+            if (tab[i].addr == 0) return false;
+            if (tab[i].addr == addr && tab[i].pid == pid) break;
+        }
+        // backward shift, 不留墓碑
+        unsigned j = i;
+        for (;;){
+            j = (j + 1) & mask;
+            if (tab[j].addr == 0) break;
+            unsigned home = slot(tab[j].pid, tab[j].addr);
+            if (((j - home) & mask) >= ((j - i) & mask)){
+                tab[i] = tab[j];
+                i = j;
+            }
+        }
+        tab[i].addr = 0;
+        used--;
+        return true;
+    }
+
+    // 进程结束后把它剩下的块当作泄漏取出来, 按插装点合并
+    void takeProcess(int32_t pid, std::map<std::pair<uint32_t,uint16_t>, unsigned> &leaks){
+        std::vector<uint64_t> addrs;
+        for (unsigned i = 0; i <= mask; ++i){
+            if (tab[i].addr != 0 && tab[i].pid == pid){
+                leaks[std::make_pair(tab[i].row, tab[i].col)]++;
+                addrs.push_back(tab[i].addr);
+            }
+        }
+        for (unsigned i = 0; i < addrs.size(); ++i)
+            erase(pid, addrs[i]);
+    }
+
+private:
+    unsigned slot(int32_t pid, uint64_t addr) const {
+        uint64_t h = (addr ^ ((uint64_t)pid << 40)) * 0x9e3779b97f4a7c15ull;
+        return (unsigned)(h >> 32) & mask;
+    }
+    unsigned mask;
+    unsigned used;
+    std::vector<liveEntry> tab;
+};
+
+struct ringHandle{
+    struct lc_ring *ring;
+    int32_t pid;
+    std::string shmName;
+};
+
+struct worker{
+    std::mutex lock;                    // 只保护 incoming
+    std::vector<ringHandle> incoming;   // 主线程新发现的环
+    std::vector<ringHandle> rings;
+    std::atomic<uint64_t> mallocs{0}, frees{0}, live{0}, leaked{0}, unmatched{0}, overflow{0}, dropped{0};
+};
+
+static std::atomic<bool> stopFlag(false);
+static std::mutex printLock;
+
+static void onSignal(int){
+    stopFlag = true;
+}
+
+static bool processGone(int32_t pid){
+    return kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+// 读完一个环里当前可读的事件, 返回读到的个数
+static unsigned drainRing(worker &w, liveTable &table, ringHandle &h){
+    struct lc_ring *r = h.ring;
+    uint64_t t = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    unsigned n = 0;
+    for (;;){
+        struct lc_event *e = &r->ev[t & (LC_RING_SLOTS - 1)];
+        if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != t + 1)
+            break;
+        if (e->kind == 'm'){
+            w.mallocs++;
+            if (e->addr != 0){
+                if (table.insert(h.pid, e->addr, e->row, e->col)) w.live++;
+                else w.overflow++;
+            }
+        }else if (e->kind == 'f'){
+            w.frees++;
+            if (e->addr != 0){
+                if (table.erase(h.pid, e->addr)) w.live--;
+                else w.unmatched++;
+            }
+        }
+        ++t;
+        ++n;
+        // 每读一批就把 tail 还给生产者
+        if ((n & 255) == 0) __atomic_store_n(&r->tail, t, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&r->tail, t, __ATOMIC_RELEASE);
+    return n;
+}
+
+static void reportLeaks(worker &w, liveTable &table, ringHandle &h){
+    std::map<std::pair<uint32_t,uint16_t>, unsigned> leaks;
+    table.takeProcess(h.pid, leaks);
+    uint64_t total = 0;
+    std::lock_guard<std::mutex> g(printLock);
+    for (std::map<std::pair<uint32_t,uint16_t>, unsigned>::iterator it = leaks.begin(); it != leaks.end(); ++it){
+        printf("leak pid %d at %u:%u  %u block(s)\n", h.pid, it->first.first, it->first.second, it->second);
+        total += it->second;
+    }
+    uint64_t dropped = __atomic_load_n(&h.ring->dropped, __ATOMIC_RELAXED);
+    printf("pid %d exited: %llu leaked block(s), %llu event(s) dropped\n",
+           h.pid, (unsigned long long)total, (unsigned long long)dropped);
+    fflush(stdout);
+    w.live -= total;
+    w.leaked += total;
+    w.dropped += dropped;
+}
+
+static void workerLoop(worker *w, unsigned capLog2){
+    liveTable table(capLog2);
+    while (!stopFlag){
+        {
+            std::lock_guard<std::mutex> g(w->lock);
+            for (unsigned i = 0; i < w->incoming.size(); ++i)
+                w->rings.push_back(w->incoming[i]);
+            w->incoming.clear();
+        }
+        unsigned got = 0;
+        for (unsigned i = 0; i < w->rings.size();){
+            ringHandle &h = w->rings[i];
+            got += drainRing(*w, table, h);
+            // 进程已经退出: 再读一遍(它退出前可能又写了), 剩下的就是泄漏
+            if (processGone(h.pid)){
+                drainRing(*w, table, h);
+                reportLeaks(*w, table, h);
+                munmap(h.ring, sizeof(struct lc_ring));
+                shm_unlink(h.shmName.c_str());
+                w->rings[i] = w->rings.back();
+                w->rings.pop_back();
+                continue;
+            }
+            ++i;
+        }
+        if (got == 0)
+            usleep(1000);
+    }
+}
+
+static ringHandle *mapRing(const char *fileName){
+    std::string shmName = std::string("/") + fileName;
+    int fd = shm_open(shmName.c_str(), O_RDWR, 0);
+    if (fd == -1)
+        return NULL;
+    struct stat sb;
+    if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(struct lc_ring)){
+        close(fd);          // 生产者还没 ftruncate 完, 下次再来
+        return NULL;
+    }
+    void *p = mmap(NULL, sizeof(struct lc_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    struct lc_ring *r = (struct lc_ring *)p;
+    if (__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != LC_RING_MAGIC || r->slots != LC_RING_SLOTS){
+        munmap(p, sizeof(struct lc_ring));
+        return NULL;
+    }
+    ringHandle *h = new ringHandle;
+    h->ring = r;
+    h->pid = r->pid;
+    h->shmName = shmName;
+    return h;
+}
+
+int main(int argc, char **argv){
+    unsigned nworkers = std::thread::hardware_concurrency();
+    unsigned capLog2 = 20;
+    unsigned intervalMs = 1000;
+    int c;
+    while ((c = getopt(argc, argv, "j:n:i:")) != -1){
+        switch (c){
+        case 'j': nworkers = atoi(optarg); break;
+        case 'n': capLog2 = atoi(optarg); break;
+        case 'i': intervalMs = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-j threads] [-n log2 live blocks per thread] [-i interval ms]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nworkers == 0) nworkers = 1;
+    if (capLog2 < 10 || capLog2 > 28) capLog2 = 20;
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    std::vector<worker *> workers;
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < nworkers; ++i){
+        workers.push_back(new worker);
+        threads.push_back(std::thread(workerLoop, workers[i], capLog2));
+    }
+
+    std::set<std::string> known;
+    unsigned next = 0;
+    unsigned elapsed = 0;
+    while (!stopFlag){
+        // 扫 /dev/shm 找新的环
+        DIR *dir = opendir("/dev/shm");
+        if (dir != NULL){
+            struct dirent *ent;
+            std::set<std::string> seen;
+            while ((ent = readdir(dir)) != NULL){
+                if (strncmp(ent->d_name, LC_RING_PREFIX, strlen(LC_RING_PREFIX)) != 0)
+                    continue;
+                seen.insert(ent->d_name);
+                if (known.count(ent->d_name))
+                    continue;
+                ringHandle *h = mapRing(ent->d_name);
+                if (h == NULL)
+                    continue;
+                known.insert(ent->d_name);
+                worker *w = workers[next++ % nworkers];
+                std::lock_guard<std::mutex> g(w->lock);
+                w->incoming.push_back(*h);
+                delete h;
+            }
+            closedir(dir);
+            // 工作线程 unlink 掉的名字可以忘了, 同一个 pid 以后还可能再出现
+            for (std::set<std::string>::iterator it = known.begin(); it != known.end();){
+                if (!seen.count(*it)) known.erase(it++);
+                else ++it;
+            }
+        }
+
+        usleep(100 * 1000);
+        elapsed += 100;
+        if (elapsed >= intervalMs){
+            elapsed = 0;
+            uint64_t m = 0, f = 0, live = 0, leaked = 0, unmatched = 0, overflow = 0, dropped = 0;
+            for (unsigned i = 0; i < nworkers; ++i){
+                m += workers[i]->mallocs; f += workers[i]->frees;
+                live += workers[i]->live; leaked += workers[i]->leaked;
+                unmatched += workers[i]->unmatched; overflow += workers[i]->overflow;
+                dropped += workers[i]->dropped;
+            }
+            std::lock_guard<std::mutex> g(printLock);
+            printf("procs %zu  malloc %llu  free %llu  live %llu  leaked %llu  unmatched free %llu  untracked %llu  dropped %llu\n",
+                   known.size(), (unsigned long long)m, (unsigned long long)f, (unsigned long long)live,
+                   (unsigned long long)leaked, (unsigned long long)unmatched, (unsigned long long)overflow,
+                   (unsigned long long)dropped);
+            fflush(stdout);
+        }
+    }
+
+    for (unsigned i = 0; i < nworkers; ++i)
+        threads[i].join();
+    return 0;
+}
@@ -0,0 +1,330 @@
+// CGMerge - merge the per-file call graph summaries of LoopConvert -summary into one
+// whole-program graph and answer reachability queries on it.
+// Files are read by -j threads; USRs are interned in a sharded table so a declaration
+// in one file and the definition in another become one node. The merged graph is
+// kept as CSR (offset + target arrays) and can be written back in the same format.
+//
+// Usage: CGMerge [-j threads] [-o merged.lcsg] [-r function]... [-v] file.lcsg... | @list
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "lcsummary.h"
+
+#define SHARD_BITS 8
+#define NSHARDS    (1u << SHARD_BITS)
+
+struct nodeInfo{
+  std::string usr;
+  std::string name;
+  uint32_t flags;
+};
+
+// node ref before compaction: local index << SHARD_BITS | shard
+struct shard{
+  std::mutex lock;
+  std::unordered_map<std::string, uint32_t> index;
+  std::vector<nodeInfo> nodes;
+};
+
+shard shards[NSHARDS];
+std::vector<std::string> files;
+std::atomic<unsigned> nextFile(0);
+std::atomic<unsigned> badFiles(0);
+
+uint32_t Intern(const char *usr, const char *name, uint32_t flags)
+{
+  uint32_t h = 2166136261u;                     // FNV-1a
+  for (const char *p = usr; *p; p++)
+    h = (h ^ (unsigned char)*p) * 16777619u;
+  uint32_t s = h & (NSHARDS - 1);
+  shard &sh = shards[s];
+  std::lock_guard<std::mutex> g(sh.lock);
+  std::unordered_map<std::string, uint32_t>::iterator it = sh.index.find(usr);
+  uint32_t local;
+  if (it == sh.index.end()){
+    local = sh.nodes.size();
+    sh.index.emplace(usr, local);
+    nodeInfo ni;
+    ni.usr = usr;
+    ni.name = name;
+    ni.flags = flags;
+    sh.nodes.push_back(ni);
+  }
+  else{
+    local = it->second;
+    sh.nodes[local].flags |= flags;
+  }
+  return local << SHARD_BITS | s;
+}
+
+// ReadSummary - intern the functions of one file and append its edges
+bool ReadSummary(const std::string &name, std::vector<uint32_t> &edges)
+{
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd == -1){
+    perror(name.c_str());
+    return false;
+  }
+  struct stat sb;
+  if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(lc_sg_header)){
+    fprintf(stderr, "%s: too short\n", name.c_str());
+    close(fd);
+    return false;
+  }
+  const char *base = (const char *)mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED){
+    perror(name.c_str());
+    return false;
+  }
+  const lc_sg_header *h = (const lc_sg_header *)base;
+  size_t need = sizeof(*h) + (size_t)h->nstrings * 4 + h->strbytes
+              + (size_t)h->nfuncs * sizeof(lc_sg_func) + (size_t)h->nedges * sizeof(lc_sg_edge);
+  bool ok = h->magic == LC_SG_MAGIC && h->version == LC_SG_VERSION && need <= (size_t)sb.st_size
+            && h->strbytes % 4 == 0;
+  const uint32_t *off = (const uint32_t *)(h + 1);
+  const char *pool = (const char *)(off + h->nstrings);
+  // every string starts inside the pool and the pool ends with a NUL, so none runs past it
+  if (ok && h->nstrings)
+    ok = h->strbytes > 0 && pool[h->strbytes - 1] == '\0';
+  for (uint32_t i = 0; i < h->nstrings && ok; i++)
+    ok = off[i] < h->strbytes;
+  if (ok){
+    const lc_sg_func *funcs = (const lc_sg_func *)(pool + h->strbytes);
+    const lc_sg_edge *e = (const lc_sg_edge *)(funcs + h->nfuncs);
+    std::vector<uint32_t> ref(h->nfuncs);
+    for (uint32_t i = 0; i < h->nfuncs && ok; i++){
+      if (funcs[i].usr >= h->nstrings || funcs[i].name >= h->nstrings){
+        ok = false;
+        break;
+      }
+      ref[i] = Intern(pool + off[funcs[i].usr], pool + off[funcs[i].name], funcs[i].flags);
+    }
+    for (uint32_t i = 0; i < h->nedges && ok; i++){
+      if (e[i].from >= h->nfuncs || e[i].to >= h->nfuncs){
+        ok = false;
+        break;
+      }
+      edges.push_back(ref[e[i].from]);
+      edges.push_back(ref[e[i].to]);
+    }
+  }
+  if (!ok)
+    fprintf(stderr, "%s: not a valid summary\n", name.c_str());
+  munmap((void *)base, sb.st_size);
+  return ok;
+}
+
+void Worker(std::vector<uint32_t> *edges)
+{
+  unsigned i;
+  while ((i = nextFile++) < files.size())
+    if (!ReadSummary(files[i], *edges))
+      badFiles++;
+}
+
+double Since(std::chrono::steady_clock::time_point t)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+int main(int argc, char **argv)
+{
+  unsigned nthreads = std::thread::hardware_concurrency();
+  const char *outName = NULL;
+  std::vector<std::string> roots;
+  int verbose = 0;
+  int c;
+
+  while ((c = getopt(argc, argv, "j:o:r:v")) != -1){
+    switch (c){
+    case 'j': nthreads = atoi(optarg); break;
+    case 'o': outName = optarg; break;
+    case 'r': roots.push_back(optarg); break;
+    case 'v': verbose = 1; break;
+    default:
+      fprintf(stderr, "Usage: %s [-j threads] [-o merged.lcsg] [-r function]... [-v] file.lcsg... | @list\n", argv[0]);
+      return 1;
+    }
+  }
+  for (int i = optind; i < argc; i++){
+    if (argv[i][0] == '@'){
+      std::ifstream list(argv[i] + 1);
+      std::string line;
+      while (std::getline(list, line))
+        if (!line.empty()) files.push_back(line);
+    }
+    else
+      files.push_back(argv[i]);
+  }
+  if (files.empty()){
+    fprintf(stderr, "no summaries given\n");
+    return 1;
+  }
+  if (nthreads == 0) nthreads = 1;
+  if (nthreads > files.size()) nthreads = files.size();
+
+  // 1. read and intern in parallel
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  std::vector<std::vector<uint32_t> > tedges(nthreads);
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < nthreads; t++)
+    workers.push_back(std::thread(Worker, &tedges[t]));
+  for (unsigned t = 0; t < nthreads; t++)
+    workers[t].join();
+  double tread = Since(t0);
+
+  // 2. dense ids: shard bases
+  t0 = std::chrono::steady_clock::now();
+  uint32_t base[NSHARDS], n = 0;
+  for (unsigned s = 0; s < NSHARDS; s++){
+    base[s] = n;
+    n += shards[s].nodes.size();
+  }
+  std::vector<const nodeInfo *> nodes(n);
+  for (unsigned s = 0; s < NSHARDS; s++)
+    for (uint32_t i = 0; i < shards[s].nodes.size(); i++)
+      nodes[base[s] + i] = &shards[s].nodes[i];
+
+  // 3. CSR, duplicate edges from different files removed
+  std::vector<uint32_t> offs(n + 1, 0);
+  size_t total = 0;
+  for (unsigned t = 0; t < nthreads; t++){
+    std::vector<uint32_t> &te = tedges[t];
+    for (size_t k = 0; k < te.size(); k++)
+      te[k] = base[te[k] & (NSHARDS - 1)] + (te[k] >> SHARD_BITS);
+    for (size_t k = 0; k < te.size(); k += 2)
+      offs[te[k] + 1]++;
+    total += te.size() / 2;
+  }
+  for (uint32_t i = 0; i < n; i++)
+    offs[i + 1] += offs[i];
+  std::vector<uint32_t> adj(total);
+  std::vector<uint32_t> fill(offs.begin(), offs.end() - 1);
+  for (unsigned t = 0; t < nthreads; t++){
+    std::vector<uint32_t> &te = tedges[t];
+    for (size_t k = 0; k < te.size(); k += 2)
+      adj[fill[te[k]]++] = te[k + 1];
+    std::vector<uint32_t>().swap(te);
+  }
+  size_t m = 0;
+  for (uint32_t i = 0; i < n; i++){
+    uint32_t b = offs[i], e = offs[i + 1];
+    std::sort(adj.begin() + b, adj.begin() + e);
+    offs[i] = m;
+    for (uint32_t k = b; k < e; k++)
+      if (k == b || adj[k] != adj[k - 1])
+        adj[m++] = adj[k];
+  }
+  offs[n] = m;
+  adj.resize(m);
+  double tbuild = Since(t0);
+
+  uint32_t undefined = 0;
+  for (uint32_t i = 0; i < n; i++)
+    if (!(nodes[i]->flags & LC_SG_DEFINED)) undefined++;
+  printf("%u file(s) (%u bad), %u function(s), %zu edge(s), %u without a definition\n",
+         (unsigned)files.size(), badFiles.load(), n, m, undefined);
+  printf("read %.3fs with %u thread(s), build %.3fs\n", tread, nthreads, tbuild);
+
+  // 4. reachability from -r functions (name, or USR if it has a ':')
+  if (!roots.empty()){
+    t0 = std::chrono::steady_clock::now();
+    std::vector<char> seen(n, 0);
+    std::vector<uint32_t> work;
+    for (size_t r = 0; r < roots.size(); r++){
+      bool isUsr = roots[r].find(':') != std::string::npos;
+      bool found = false;
+      for (uint32_t i = 0; i < n; i++){
+        if ((isUsr ? nodes[i]->usr : nodes[i]->name) != roots[r]) continue;
+        found = true;
+        if (!seen[i]){
+          seen[i] = 1;
+          work.push_back(i);
+        }
+      }
+      if (!found)
+        fprintf(stderr, "root %s not found\n", roots[r].c_str());
+    }
+    uint32_t count = 0;
+    while (!work.empty()){
+      uint32_t v = work.back();
+      work.pop_back();
+      count++;
+      for (uint32_t k = offs[v]; k < offs[v + 1]; k++)
+        if (!seen[adj[k]]){
+          seen[adj[k]] = 1;
+          work.push_back(adj[k]);
+        }
+    }
+    printf("%u of %u function(s) reachable (%.3fs)\n", count, n, Since(t0));
+    if (verbose)
+      for (uint32_t i = 0; i < n; i++)
+        if (seen[i])
+          printf("  %s%s\t%s\n", nodes[i]->name.c_str(),
+                 nodes[i]->flags & LC_SG_DEFINED ? "" : " (no body)", nodes[i]->usr.c_str());
+  }
+
+  // 5. merged graph in the summary format, can be merged again
+  if (outName){
+    FILE *fp = fopen(outName, "wb");
+    if (fp == NULL){
+      perror(outName);
+      return 1;
+    }
+    lc_sg_header h;
+    h.magic = LC_SG_MAGIC;
+    h.version = LC_SG_VERSION;
+    h.nstrings = 2 * n;
+    h.strbytes = 0;
+    std::vector<uint32_t> off(2 * n);
+    for (uint32_t i = 0; i < n; i++){
+      off[2 * i] = h.strbytes;
+      h.strbytes += nodes[i]->usr.size() + 1;
+      off[2 * i + 1] = h.strbytes;
+      h.strbytes += nodes[i]->name.size() + 1;
+    }
+    unsigned pad = -h.strbytes & 3;
+    h.strbytes += pad;
+    h.nfuncs = n;
+    h.nedges = m;
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(off.data(), sizeof(uint32_t), off.size(), fp);
+    for (uint32_t i = 0; i < n; i++){
+      fwrite(nodes[i]->usr.c_str(), 1, nodes[i]->usr.size() + 1, fp);
+      fwrite(nodes[i]->name.c_str(), 1, nodes[i]->name.size() + 1, fp);
+    }
+    fwrite("\0\0\0", 1, pad, fp);
+    for (uint32_t i = 0; i < n; i++){
+      lc_sg_func f;
+      f.usr = 2 * i;
+      f.name = 2 * i + 1;
+      f.flags = nodes[i]->flags;
+      fwrite(&f, sizeof(f), 1, fp);
+    }
+    for (uint32_t i = 0; i < n; i++)
+      for (uint32_t k = offs[i]; k < offs[i + 1]; k++){
+        lc_sg_edge e;
+        e.from = i;
+        e.to = adj[k];
+        fwrite(&e, sizeof(e), 1, fp);
+      }
+    fclose(fp);
+    printf("merged graph written to %s\n", outName);
+  }
+  return 0;
+}
@@ -0,0 +1,191 @@
+// EditApply - apply the edit scripts of LoopConvert -edits: rebuild every <file>_out from its
+// source and the edits, and leave the _out file alone when it already has that content, so its
+// mtime stays and the build does not redo what depends on it.
+// Scripts are handled by -j threads. A script whose source no longer has the recorded size and
+// hash is refused; run LoopConvert on that file again. The opts, ids, gen, funcs and deps lines
+// are LoopConvert's, it keeps a script whose source, options, counters, profiles and headers are
+// still current instead of making a new one.
+//
+// Usage: EditApply [-j threads] [-v] file.edits... | @list
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+std::vector<std::string> files;
+std::atomic<unsigned> nextFile(0);
+std::atomic<unsigned> written(0), unchanged(0), badFiles(0);
+int verbose = 0;
+
+bool ReadWhole(const std::string &name, std::string &data)
+{
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+  struct stat sb;
+  if (fstat(fd, &sb) == -1){
+    close(fd);
+    return false;
+  }
+  data.resize(sb.st_size);
+  size_t got = 0;
+  while (got < data.size()){
+    ssize_t n = read(fd, &data[got], data.size() - got);
+    if (n <= 0) break;
+    got += n;
+  }
+  close(fd);
+  data.resize(got);
+  return got == (size_t)sb.st_size;
+}
+
+// Line - the text up to the next newline, pos moves past it
+std::string Line(const std::string &s, size_t &pos)
+{
+  size_t e = s.find('\n', pos);
+  if (e == std::string::npos) e = s.size();
+  std::string l = s.substr(pos, e - pos);
+  pos = e + 1;
+  return l;
+}
+
+unsigned long long Fnv1a(const std::string &s)
+{
+  unsigned long long h = 14695981039346656037ull;
+  for (size_t i = 0; i < s.size(); i++)
+    h = (h ^ (unsigned char)s[i]) * 1099511628211ull;
+  return h;
+}
+
+// Apply - 1 written, 0 unchanged, -1 bad script or changed source
+int Apply(const std::string &name)
+{
+  std::string s, src, old, out;
+  if (!ReadWhole(name, s)){
+    perror(name.c_str());
+    return -1;
+  }
+  size_t pos = 0;
+  unsigned long long size = 0, hash = 0;
+  unsigned ndeps = 0;
+  if (Line(s, pos) != "LCEDITS 3"){
+    fprintf(stderr, "%s: not an edit script\n", name.c_str());
+    return -1;
+  }
+  std::string srcName = Line(s, pos), outName = Line(s, pos);
+  if (srcName.compare(0, 4, "src ") || outName.compare(0, 4, "out ")
+      || sscanf(Line(s, pos).c_str(), "size %llu", &size) != 1
+      || sscanf(Line(s, pos).c_str(), "hash %llx", &hash) != 1
+      || Line(s, pos).compare(0, 5, "opts ") || Line(s, pos).compare(0, 4, "ids ")
+      || Line(s, pos).compare(0, 4, "gen ") || Line(s, pos).compare(0, 6, "funcs ")
+      || sscanf(Line(s, pos).c_str(), "deps %u", &ndeps) != 1){
+    fprintf(stderr, "%s: bad header\n", name.c_str());
+    return -1;
+  }
+  while (ndeps-- && pos < s.size())
+    Line(s, pos);
+  srcName.erase(0, 4);
+  outName.erase(0, 4);
+  if (!ReadWhole(srcName, src)){
+    perror(srcName.c_str());
+    return -1;
+  }
+  if (src.size() != size || Fnv1a(src) != hash){
+    fprintf(stderr, "%s: %s changed since the script was made\n", name.c_str(), srcName.c_str());
+    return -1;
+  }
+
+  out.reserve(src.size() + s.size());
+  size_t cur = 0;
+  while (pos < s.size()){
+    unsigned long long off, removed, len;
+    if (sscanf(Line(s, pos).c_str(), "%llu %llu %llu", &off, &removed, &len) != 3
+        || off < cur || off + removed > src.size() || pos + len >= s.size() || s[pos + len] != '\n'){
+      fprintf(stderr, "%s: bad edit\n", name.c_str());
+      return -1;
+    }
+    out.append(src, cur, off - cur);
+    out.append(s, pos, len);
+    pos += len + 1;
+    cur = off + removed;
+  }
+  out.append(src, cur, std::string::npos);
+
+  if (ReadWhole(outName, old) && old == out){
+    if (verbose) printf("  %s unchanged\n", outName.c_str());
+    return 0;
+  }
+  std::string tmp = outName + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "wb");
+  if (fp == NULL || fwrite(out.data(), 1, out.size(), fp) != out.size()){
+    perror(tmp.c_str());
+    if (fp) fclose(fp);
+    return -1;
+  }
+  if (fclose(fp) != 0 || rename(tmp.c_str(), outName.c_str()) == -1){
+    perror(outName.c_str());
+    return -1;
+  }
+  if (verbose) printf("  %s written\n", outName.c_str());
+  return 1;
+}
+
+void Worker()
+{
+  unsigned i;
+  while ((i = nextFile++) < files.size()){
+    int r = Apply(files[i]);
+    if (r > 0) written++;
+    else if (r == 0) unchanged++;
+    else badFiles++;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  unsigned nthreads = std::thread::hardware_concurrency();
+  int c;
+
+  while ((c = getopt(argc, argv, "j:v")) != -1){
+    switch (c){
+    case 'j': nthreads = atoi(optarg); break;
+    case 'v': verbose = 1; break;
+    default:
+      fprintf(stderr, "Usage: %s [-j threads] [-v] file.edits... | @list\n", argv[0]);
+      return 1;
+    }
+  }
+  for (int i = optind; i < argc; i++){
+    if (argv[i][0] == '@'){
+      std::ifstream list(argv[i] + 1);
+      std::string line;
+      while (std::getline(list, line))
+        if (!line.empty()) files.push_back(line);
+    }
+    else
+      files.push_back(argv[i]);
+  }
+  if (files.empty()){
+    fprintf(stderr, "no edit scripts given\n");
+    return 1;
+  }
+  if (nthreads == 0) nthreads = 1;
+  if (nthreads > files.size()) nthreads = files.size();
+
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < nthreads; t++)
+    workers.push_back(std::thread(Worker));
+  for (unsigned t = 0; t < nthreads; t++)
+    workers[t].join();
+  printf("%u script(s): %u written, %u unchanged, %u bad\n",
+         (unsigned)files.size(), written.load(), unchanged.load(), badFiles.load());
+  return badFiles ? 1 : 0;
+}
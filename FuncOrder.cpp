@@ -0,0 +1,240 @@
+// FuncOrder - hot-first function order for the release link, from instrumented runs
+// Inputs (function ids are line numbers of func_blocks.txt):
+//   func_blocks.txt  "name lastblock", the block count of a function is its size estimate
+//   lcprof.out       -profile output, self cycles per function id (hotness)
+//   lccg.out         -callgraph output, weighted caller -> callee edges
+// Functions are clustered with C3 (call-chain clustering): in order of hotness each
+// function is appended to the cluster of its heaviest caller while the cluster stays
+// under the size limit; clusters are then laid out by density (samples / size).
+// Without lcprof.out the number of incoming calls is used as hotness.
+//
+// Output: the symbol order (one name per line, for lld --symbol-ordering-file or,
+// with -t, .text.<name> sections for gold --section-ordering-file) and a hot/cold list.
+//
+// Usage: FuncOrder [-b func_blocks.txt] [-p lcprof.out] [-g lccg.out] [-o order.txt]
+//                  [-c hotcold.txt] [-s max cluster blocks] [-t]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct funcNode{
+  std::string name;
+  int size;                     // blocks, at least 1
+  uint64_t samples;             // self cycles or incoming calls
+  int bestCaller;               // heaviest caller, -1 if none
+  uint64_t bestWeight;
+  int cluster;
+};
+
+struct cluster{
+  std::vector<int> funcs;
+  int size;
+  uint64_t samples;
+};
+
+std::vector<funcNode> funcs;
+std::vector<cluster> clusters;
+
+bool LoadFuncBlocks(const char *name)
+{
+  std::ifstream infile(name);
+  std::string line;
+  int last = -1;
+  if (!infile){
+    fprintf(stderr, "cannot open %s\n", name);
+    return false;
+  }
+  while (std::getline(infile, line)){
+    std::istringstream ss(line);
+    funcNode fn;
+    int lastBlock = last;
+    ss >> fn.name >> lastBlock;
+    // blocks ids wrap at 100000
+    int n = lastBlock >= last ? lastBlock - last : lastBlock + 100000 - last;
+    fn.size = n > 0 ? n : 1;
+    fn.samples = 0;
+    fn.bestCaller = -1;
+    fn.bestWeight = 0;
+    fn.cluster = -1;
+    funcs.push_back(fn);
+    last = lastBlock;
+  }
+  return true;
+}
+
+// lines: %self self total calls id name
+bool LoadProfile(const char *name)
+{
+  std::ifstream infile(name);
+  std::string line;
+  if (!infile) return false;
+  while (std::getline(infile, line)){
+    if (line.empty() || line[0] == '#') continue;
+    std::istringstream ss(line);
+    double pct;
+    unsigned long long self, total, calls;
+    unsigned id;
+    if (!(ss >> pct >> self >> total >> calls >> id)) continue;
+    if (id < funcs.size()) funcs[id].samples += self;
+  }
+  return true;
+}
+
+// lines: caller callee count caller_name callee_name
+bool LoadCallGraph(const char *name, bool useCalls)
+{
+  std::ifstream infile(name);
+  std::string line;
+  if (!infile) return false;
+  while (std::getline(infile, line)){
+    if (line.empty() || line[0] == '#') continue;
+    std::istringstream ss(line);
+    int caller, callee;
+    unsigned long long count;
+    if (!(ss >> caller >> callee >> count)) continue;
+    if (callee < 0 || callee >= (int)funcs.size() || caller < 0 || caller >= (int)funcs.size())
+      continue;
+    if (useCalls){
+      funcs[callee].samples += count;
+      // a caller ran even if nothing calls it (main, thread functions)
+      if (funcs[caller].samples == 0) funcs[caller].samples = 1;
+    }
+    if (caller != callee && count > funcs[callee].bestWeight){
+      funcs[callee].bestWeight = count;
+      funcs[callee].bestCaller = caller;
+    }
+  }
+  return true;
+}
+
+bool HotterFunc(int a, int b)
+{
+  if (funcs[a].samples != funcs[b].samples) return funcs[a].samples > funcs[b].samples;
+  return a < b;
+}
+
+// density = samples / size, compared without division
+bool DenserCluster(int a, int b)
+{
+  const cluster &x = clusters[a], &y = clusters[b];
+  double dx = (double)x.samples * y.size, dy = (double)y.samples * x.size;
+  if (dx != dy) return dx > dy;
+  return x.funcs[0] < y.funcs[0];
+}
+
+void C3(int maxSize)
+{
+  std::vector<int> order;
+  for (int i = 0; i < (int)funcs.size(); i++){
+    cluster c;
+    c.funcs.push_back(i);
+    c.size = funcs[i].size;
+    c.samples = funcs[i].samples;
+    clusters.push_back(c);
+    funcs[i].cluster = i;
+    if (funcs[i].samples) order.push_back(i);
+  }
+  std::sort(order.begin(), order.end(), HotterFunc);
+
+  for (unsigned k = 0; k < order.size(); k++){
+    funcNode &f = funcs[order[k]];
+    if (f.bestCaller < 0) continue;
+    int to = funcs[f.bestCaller].cluster, from = f.cluster;
+    if (to == from) continue;
+    cluster &ct = clusters[to], &cf = clusters[from];
+    if (ct.size + cf.size > maxSize) continue;
+    // the callee's cluster goes right after the caller's
+    for (unsigned j = 0; j < cf.funcs.size(); j++){
+      ct.funcs.push_back(cf.funcs[j]);
+      funcs[cf.funcs[j]].cluster = to;
+    }
+    ct.size += cf.size;
+    ct.samples += cf.samples;
+    cf.funcs.clear();
+    cf.size = 0;
+    cf.samples = 0;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *blocksName = "/root/func_blocks.txt";
+  const char *profName = "lcprof.out";
+  const char *cgName = "lccg.out";
+  const char *orderName = "order.txt";
+  const char *hotName = "hotcold.txt";
+  int maxSize = 64;             // ~4KB page at 64 bytes per block
+  int sections = 0;
+  int c;
+
+  while ((c = getopt(argc, argv, "b:p:g:o:c:s:t")) != -1){
+    switch (c){
+    case 'b': blocksName = optarg; break;
+    case 'p': profName = optarg; break;
+    case 'g': cgName = optarg; break;
+    case 'o': orderName = optarg; break;
+    case 'c': hotName = optarg; break;
+    case 's': maxSize = atoi(optarg); break;
+    case 't': sections = 1; break;
+    default:
+      fprintf(stderr, "Usage: %s [-b func_blocks.txt] [-p lcprof.out] [-g lccg.out] [-o order.txt]"
+              " [-c hotcold.txt] [-s max cluster blocks] [-t]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (!LoadFuncBlocks(blocksName)) return 1;
+  bool haveProf = LoadProfile(profName);
+  bool haveCg = LoadCallGraph(cgName, !haveProf);
+  if (!haveProf && !haveCg){
+    fprintf(stderr, "neither %s nor %s found, nothing to order by\n", profName, cgName);
+    return 1;
+  }
+  if (!haveCg)
+    fprintf(stderr, "no %s, functions are only sorted by hotness\n", cgName);
+
+  C3(maxSize);
+
+  std::vector<int> live;
+  for (int i = 0; i < (int)clusters.size(); i++)
+    if (!clusters[i].funcs.empty() && clusters[i].samples) live.push_back(i);
+  std::sort(live.begin(), live.end(), DenserCluster);
+
+  FILE *ofp = fopen(orderName, "w");
+  FILE *hfp = fopen(hotName, "w");
+  if (ofp == NULL || hfp == NULL){
+    perror(ofp == NULL ? orderName : hotName);
+    return 1;
+  }
+  // a name can appear in several files (static functions); the linker takes the first
+  std::set<std::string> seen;
+  int hot = 0, cold = 0;
+  for (unsigned k = 0; k < live.size(); k++){
+    const cluster &cl = clusters[live[k]];
+    for (unsigned j = 0; j < cl.funcs.size(); j++){
+      const funcNode &f = funcs[cl.funcs[j]];
+      if (!seen.insert(f.name).second) continue;
+      fprintf(ofp, "%s%s\n", sections ? ".text." : "", f.name.c_str());
+      fprintf(hfp, "%s %s\n", f.samples ? "hot" : "warm", f.name.c_str());
+      hot++;
+    }
+  }
+  for (unsigned i = 0; i < funcs.size(); i++){
+    if (funcs[i].samples || funcs[i].cluster != (int)i || clusters[i].samples) continue;
+    fprintf(hfp, "cold %s\n", funcs[i].name.c_str());
+    cold++;
+  }
+  fclose(ofp);
+  fclose(hfp);
+  printf("%d function(s) ordered in %u cluster(s), %d cold, written to %s and %s\n",
+         hot, (unsigned)live.size(), cold, orderName, hotName);
+  return 0;
+}
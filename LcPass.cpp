@@ -0,0 +1,149 @@
+// LcPass - LLVM pass plugin with the probes of LoopConvert and LoopConvert3 put in at the IR level,
+// after optimization, so macros need no special care and the optimizer has already run on the
+// code the probes see.
+//   lc-blocks  blocks[id] = '1' at the start of every basic block. ids continue the counter in
+//              loopconvert.txt and every function gets its "name lastblock" line in
+//              /root/func_blocks.txt, like the source probes.
+//   lc-alloc   __lc_alloc_event('m', row, col, p) after p = malloc(...) and
+//              __lc_alloc_event('f', row, col, p) before free(p), row/col from the debug location
+//              (0 without -g), so AllocCollector reads the same ring events.
+// The runtime is the same: link an object that includes allocring.h for lc-alloc; blocks[] is
+// a common symbol, so a file instrumented by LoopConvert may define it as before. Both size it
+// LC_BLOCKS; a module whose blocks is smaller is left alone.
+//
+// Build:   g++ -shared -fPIC $(llvm-config --cxxflags) LcPass.cpp -o LcPass.so
+// Use:     clang -O2 -g -fpass-plugin=./LcPass.so -c foo.c      (both passes at the end of the pipeline,
+//                                                              LC_PASS=blocks or LC_PASS=alloc for one)
+//          opt -load-pass-plugin=./LcPass.so -passes=lc-blocks,lc-alloc foo.ll
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <string>
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+#define LC_BLOCKS 100000                  // ids are taken modulo this, as in LoopConvert
+
+static bool IsRuntime(const Function &F)
+{
+  return F.getName().startswith("__lc_");
+}
+
+struct LcBlocksPass : PassInfoMixin<LcBlocksPass>
+{
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &)
+  {
+    int pos = -1;
+    std::string gen;                      // LoopConvert's generation of the counter, kept as it is
+    std::ifstream posfile("loopconvert.txt");
+    posfile >> pos >> gen;
+    posfile.close();
+    std::ofstream funcBlocks("/root/func_blocks.txt", std::ios::app);
+
+    LLVMContext &C = M.getContext();
+    ArrayType *AT = ArrayType::get(Type::getInt8Ty(C), LC_BLOCKS);
+    GlobalVariable *blocks = M.getGlobalVariable("blocks");
+    if (blocks == NULL) {
+      blocks = new GlobalVariable(M, AT, false, GlobalValue::CommonLinkage,
+                                  ConstantAggregateZero::get(AT), "blocks");
+      blocks->setAlignment(MaybeAlign(1));
+    }
+    Type *BT = blocks->getValueType();
+    ArrayType *have = dyn_cast<ArrayType>(BT);
+    if (have == NULL || have->getNumElements() < LC_BLOCKS) {
+      errs() << "lc-blocks: " << M.getName() << ": blocks is " << *BT << ", smaller than "
+             << LC_BLOCKS << " bytes; not instrumented\n";
+      return PreservedAnalyses::all();
+    }
+
+    unsigned count = 0;
+    for (Function &F : M) {
+      if (F.isDeclaration() || IsRuntime(F)) continue;
+      for (BasicBlock &BB : F) {
+        BasicBlock::iterator IP = BB.getFirstInsertionPt();
+        if (IP == BB.end()) continue;
+        pos++;
+        IRBuilder<> B(&BB, IP);
+        Value *slot = B.CreateConstInBoundsGEP2_64(BT, blocks, 0, pos % LC_BLOCKS);
+        B.CreateStore(B.getInt8('1'), slot);
+        count++;
+      }
+      funcBlocks << F.getName().str() << " " << pos % LC_BLOCKS << "\n";
+    }
+
+    std::ofstream outfile("loopconvert.txt");
+    outfile << pos;
+    if (!gen.empty()) outfile << " " << gen;
+    errs() << "lc-blocks: " << M.getName() << ": " << count << " block(s)\n";
+    return count ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+};
+
+struct LcAllocPass : PassInfoMixin<LcAllocPass>
+{
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &)
+  {
+    LLVMContext &C = M.getContext();
+    Type *I32 = Type::getInt32Ty(C);
+    Type *I8P = Type::getInt8PtrTy(C);
+    FunctionCallee event = M.getOrInsertFunction("__lc_alloc_event", Type::getVoidTy(C), I32, I32, I32, I8P);
+
+    std::vector<CallInst*> calls;
+    for (Function &F : M) {
+      if (F.isDeclaration() || IsRuntime(F)) continue;
+      for (BasicBlock &BB : F)
+        for (Instruction &I : BB)
+          if (CallInst *CI = dyn_cast<CallInst>(&I))
+            if (Function *callee = CI->getCalledFunction())
+              if ((callee->getName() == "malloc" && !CI->getType()->isVoidTy())
+                  || (callee->getName() == "free" && CI->arg_size() == 1))
+                calls.push_back(CI);
+    }
+
+    unsigned mallocs = 0, frees = 0;
+    for (CallInst *CI : calls) {
+      bool isFree = CI->getCalledFunction()->getName() == "free";
+      const DebugLoc &DL = CI->getDebugLoc();
+      unsigned row = DL ? DL.getLine() : 0, col = DL ? DL.getCol() : 0;
+      // free: before the call, the pointer is still valid; malloc: right after it
+      IRBuilder<> B(isFree ? CI : CI->getNextNode());
+      B.SetCurrentDebugLocation(DL);
+      Value *p = B.CreatePointerCast(isFree ? CI->getArgOperand(0) : (Value*)CI, I8P);
+      B.CreateCall(event, {B.getInt32(isFree ? 'f' : 'm'), B.getInt32(row), B.getInt32(col), p});
+      (isFree ? frees : mallocs)++;
+    }
+    errs() << "lc-alloc: " << M.getName() << ": " << mallocs << " malloc(s), " << frees << " free(s)\n";
+    return calls.empty() ? PreservedAnalyses::all() : PreservedAnalyses::none();
+  }
+};
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo()
+{
+  return {LLVM_PLUGIN_API_VERSION, "LcPass", "1", [](PassBuilder &PB) {
+    PB.registerPipelineParsingCallback(
+      [](StringRef name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+        if (name == "lc-blocks") {
+          MPM.addPass(LcBlocksPass());
+          return true;
+        }
+        if (name == "lc-alloc") {
+          MPM.addPass(LcAllocPass());
+          return true;
+        }
+        return false;
+      });
+    PB.registerOptimizerLastEPCallback([](ModulePassManager &MPM, OptimizationLevel) {
+      const char *which = getenv("LC_PASS");
+      if (which == NULL || strstr(which, "blocks")) MPM.addPass(LcBlocksPass());
+      if (which == NULL || strstr(which, "alloc")) MPM.addPass(LcAllocPass());
+    });
+  }};
+}
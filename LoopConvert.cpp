@@ -1,10 +1,21 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <vector>
 #include <system_error>
 #include <fstream>
+#include <sstream>
 #include <algorithm>
+#include <map>
+#include <set>
 #include "iostream"
 #include <cstdio>
 #include <cstdlib>
@@ -13,6 +24,7 @@
 #include "llvm/ADT/IntrusiveRefCntPtr.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Analysis/MemoryBuiltins.h"
 #include "clang/Basic/DiagnosticOptions.h"
 #include "clang/Frontend/TextDiagnosticPrinter.h"
@@ -51,15 +63,24 @@
 #include "clang/Rewrite/Frontend/Rewriters.h"
 #include "clang/Rewrite/Core/Rewriter.h"
 #include "clang/AST/ASTContext.h"
+#include "clang/AST/RecordLayout.h"
+#include "clang/Analysis/CallGraph.h"
+#include "clang/Index/USRGeneration.h"
+#include "llvm/ADT/SmallString.h"
 #include "clang-c/Index.h"
 #include "clang/ASTMatchers/ASTMatchers.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
 // Declares clang::SyntaxOnlyAction.
 #include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/Utils.h"
+#include "clang/FrontendTool/Utils.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetSelect.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
 // Declares llvm::cl::extrahelp.
 #include "llvm/Support/CommandLine.h"
+#include "lcsummary.h"
 
 
 
@@ -78,8 +99,8 @@ using namespace clang;
 
 
 int           stmtsum=0;
-std::ofstream out("/root/result.txt",std::ios::app);	
-std::ofstream func_blocks("/root/func_blocks.txt",std::ios::app);
+std::ofstream out;                                            // /root/result.txt, opened by RunMain
+std::ofstream func_blocks;                                    // /root/func_blocks.txt, opened by RunMain
 int           ThinPathSum=0;
 //address disinfect
 int           pos = -1;
@@ -93,6 +114,7 @@ int           varstrategy=0;
 //static analysis
 SourceLocation  FuncEnd;
 SourceLocation  FuncEND1;
+FunctionDecl    *cur_func=NULL;                                // function being instrumented, type of the return temporaries
 bool            func_call[_funcsum][_funcsum]={0};            // func sum 20,[x][x] = 1,shows vul
 char            func_name[_funcsum][_funcnamelen]={0};
 int             func_declare[_funcsum]={0};
@@ -101,6 +123,117 @@ int             func_now=0;
 int             func_main=0;
 int             danger_func_path[2*_funcsum][_funcsum]={0};
 int             func_buf[_funcsum]={0};
+//function ids shared with the runtime probes: line number in func_blocks.txt
+int             func_gid_base=0;                               // lines already in func_blocks.txt
+int             func_gid=-1;                                   // id of the current function, -1 before the first
+std::vector<std::pair<int,std::string> > func_gids;             // (id,name) of the functions in this file
+//modes
+int             profmode=0;                                    // -profile: enter/exit cycle probes instead of print2
+int             tracemode=0;                                   // -trace: flight recorder events instead of print2
+int             cgmode=0;                                      // -callgraph: count caller->callee edges per call site
+//call sites for -callgraph, ids continue across runs like pos
+struct cgSite{
+  int site;
+  int caller;                                                  // func_gid of the calling function
+  std::string callee;                                          // "?" for calls through a pointer
+};
+int             cg_next=0;
+std::vector<cgSite> cg_sites;
+//-entry: only functions reachable from these are instrumented
+std::vector<std::string> entry_funcs;
+std::set<const Decl*> reach_funcs;                             // canonical decls
+int             funcs_skipped=0;
+int             probes_skipped=0;
+//-summary: call graph summary of this file for CGMerge
+std::string     summary_name;
+//-branchprof / -branchopt: branch direction profile, then __builtin_expect from it
+int             brmode=0;                                      // count taken/not taken of every condition
+int             brhint=0;                                      // rewrite biased conditions
+int             brattr=0;                                      // -likely-attr: C++20 [[likely]] on if branches
+int             rewriteonly=0;                                 // annotations only, no probes or prelude
+int             br_next=0;
+std::vector<std::pair<int,std::string> > br_sites;             // (id,"kind file:line:col") for lcbranch_sites.txt
+std::map<std::string,int> br_ids;                              // file:line:col -> id, from lcbranch_sites.txt
+std::map<int,std::pair<unsigned long long,unsigned long long> > br_counts;  // id -> (not taken, taken)
+int             br_hints=0;
+#define BR_MIN_COUNT 100                                       // fewer executions are not trusted
+#define BR_BIAS      0.9                                       // one direction at least this often
+//-loopprof / -loopopt: trip count histograms per loop, then #pragma clang loop hints
+#define LOOP_BUCKETS   33                                      // 0, then 1+log2(trips), same as lcloop.h
+#define LOOP_MIN_TRIPS 10000                                   // hot enough to be worth a hint
+#define LOOP_STABLE    0.9                                     // share of entries in the main bucket
+struct loopStat{
+  unsigned long long entries;
+  unsigned long long trips;
+  unsigned long long hist[LOOP_BUCKETS];
+};
+int             loopmode=0;
+int             loophint=0;
+int             loop_next=0;
+std::string     loop_trip;                                     // trip counter increment for the next body probe
+std::vector<std::pair<int,std::string> > loop_sites;           // (id,"kind file:line:col") for lcloop_sites.txt
+std::map<std::string,int> loop_ids;
+std::map<int,loopStat> loop_stats;
+int             loop_hints=0;
+//-omp: #pragma omp parallel for on loops without loop-carried dependences
+int             ompmode=0;
+int             omp_loops=0;
+int             omp_rejected=0;
+SourceLocation  omp_end;                                       // end of the last parallelized loop
+//-interchange / -tile N: loop nests walking arrays against their layout
+int             nestmode=0;
+int             nest_tile=0;                                   // block size, 0 = no tiling
+int             nest_id=0;
+SourceLocation  nest_end;                                      // end of the last rewritten nest
+Stmt           *nest_body=NULL;                                // body of the function being rewritten
+//-hoist: invariant const/pure calls of for/while loops into locals
+int             hoistmode=0;
+int             hoist_next=0;
+int             hoist_count=0;
+std::set<const CallExpr*> hoisted_calls;
+//-layout / -layout-apply: padding of the structs of this file, fields reordered by alignment
+int             layoutmode=0;                                  // 1 report, 2 also rewrite the definitions
+int             layout_records=0;
+int             layout_applied=0;
+#define LAYOUT_LINE 64                                         // cache line bytes
+#define LAYOUT_COLD 0.01                                       // cold: under this share of the hottest field
+//-soa: arrays of structs into one array per field
+int             soamode=0;
+int             soa_converted=0;
+//lc-cc: the invocation of the compile command, also used for the instrumentation parse, and
+//its options without the output names for the preamble key
+std::shared_ptr<CompilerInvocation> cc_inv;
+std::string     cc_key;
+//-server: requests run in forked children that share the FileManager warmed by the server
+IntrusiveRefCntPtr<FileManager> server_files;
+int             server_child=0;
+#define SERVER_LOCK "/root/loopconvert.lock"                   // serializes the runs that assign ids
+//-preamble: the #includes at the top of the file are parsed from a PCH built once per preamble and configuration
+int             preamblemode=0;
+#define PREAMBLE_DIR "/root/lcpch"                             // <hash>.h, <hash>.pch, <hash>.deps
+//-stream: the rewritten main file is written out and dropped from the rope after every top-level declaration
+int             streammode=0;
+llvm::raw_ostream *stream_out=NULL;
+unsigned        stream_done=0;                                 // offset in the main file written so far
+unsigned        stream_head=0;                                 // text inserted at offset 0, written but still in the rope
+//-edits: <file>_out.edits instead of <file>_out, the output as byte edits of the source for EditApply
+int             editsmode=0;
+struct lcEdit{
+  unsigned offset, removed;
+  std::string text;
+};
+std::vector<lcEdit> edits;
+const char     *edits_orig=NULL;                               // the source text inside the rewrite rope
+uint64_t        edits_split=0;                                 // prelude | tail in the text RewriteFile writes
+unsigned        edits_size=0;
+unsigned long long edits_hash=0;                               // size and hash of the source the edits are for
+std::string     edits_opts;                                    // the options of this run, a script is reused only with the same
+std::string     pos_gen, block_gen, cg_gen, br_gen, loop_gen;  // generations of the counter files, new after a reset
+std::vector<std::string> edits_inputs;                         // profile files this run read
+std::vector<std::string> edits_deps;                           // "f mtime size path" of the headers the parse read
+//only declarations of the main file and of -userpath directories are traversed
+std::vector<std::string> user_paths;
+int             decls_pruned=0;
 
 
 
@@ -124,10 +257,19 @@ class MyRecursiveASTVisitor
   bool VisitDecl(Decl* d);
   void InstrumentStmt(Stmt *s,int flag);
   bool GetFuncCallGraph(Stmt *s);
+  void CallEdgeProbe(CallExpr *c);
+  void BranchProbe(Stmt *s);
+  void BranchHint(Stmt *s);
+  void LoopProbe(Stmt *loop, Stmt *body);
+  void LoopHint(Stmt *s);
+  void OmpLoop(ForStmt *F);
+  void NestLoop(ForStmt *F1);
+  void HoistCalls(Stmt *loop);
   void AddrDisinfect(Stmt *s);
   void VisitThinPath(Stmt *s,int flag);
   bool VisitStmt(Stmt *s);
   bool VisitFunctionDecl(FunctionDecl *f);
+  bool TraverseFunctionDecl(FunctionDecl *f);
   Expr *VisitBinaryOperator(BinaryOperator *op);
   bool VisitVarDecl(VarDecl *v);
   //int 	visitGlobalVariable (GlobalVariable &GV);
@@ -137,6 +279,34 @@ class MyRecursiveASTVisitor
   Rewriter &Rewrite;
 };
 
+// FuncProbe - text injected at function entry (enter=1) and before each exit
+std::string FuncProbe(int enter, const char *Funcname)
+{
+  char temp[256];
+  std::string probe;
+  if (profmode){
+    sprintf(temp, enter ? "\n\t__lc_prof_enter(%d);" : "\n\t__lc_prof_exit(%d);", func_gid);
+    probe += temp;
+  }
+  if (tracemode){
+    sprintf(temp, enter ? "\n\t__lc_trace_enter(%d);" : "\n\t__lc_trace_exit(%d);", func_gid);
+    probe += temp;
+  }
+  if (probe.empty()){
+    sprintf(temp, "\n\tprint2(\"%s %s,\");", Funcname, enter ? "start" : "end");
+    probe += temp;
+  }
+  return probe + "\n";
+}
+
+// BlockTrace - flight recorder event appended to a block probe
+std::string BlockTrace(int id)
+{
+  char temp[64] = "";
+  if (tracemode) sprintf(temp, " __lc_trace_block(%d);", id);
+  return temp + loop_trip;
+}
+
 bool MyRecursiveASTVisitor::VisitVarDecl(VarDecl* v){
   if( v->hasGlobalStorage()){
     if(v->hasInit()){
@@ -163,6 +333,7 @@ bool MyRecursiveASTVisitor::VisitGlobalDecl(GlobalDecl *gd){
 
 // Decl instrument 把声明部分的注释做一个处理，和我们要做的关系不大
 bool MyRecursiveASTVisitor::VisitDecl(Decl* d){    
+    if (rewriteonly) return true;
     ASTContext& ctx = d->getASTContext();
     SourceManager& sm = ctx.getSourceManager();
     
@@ -208,6 +379,7 @@ bool MyRecursiveASTVisitor::VisitDecl(Decl* d){
 // Override Binary Operator expressions，原始的一些东西，关系也不大
 Expr *MyRecursiveASTVisitor::VisitBinaryOperator(BinaryOperator *E){
   // Determine type of binary operator
+  if (rewriteonly) return E;
   if (E->isLogicalOp())
   {
     // Insert function call at start of first expression.
@@ -452,266 +624,1504 @@ bool MyRecursiveASTVisitor::GetFuncCallGraph(Stmt *s){
     }
 }
 
-// Stmt Instrument
-void MyRecursiveASTVisitor::InstrumentStmt(Stmt *s, int flag)
+// CallEdgeProbe - -callgraph: call becomes (__lc_cg_edge(site), call)
+void MyRecursiveASTVisitor::CallEdgeProbe(CallExpr *c)
 {
-  char temp[256]={0};
-  std::ifstream infile("loopconvert.txt");
-  infile>>pos;
-  pos++;
-  infile.close();
-  char char_pos[15]={0}; 
-  sprintf(char_pos,"%d",pos%100000);
-  SourceLocation STT = s->getBeginLoc();
-
-  llvm::errs()<<STT.getRawEncoding()<<"\n";
-  if(STT.getRawEncoding()==0)
-  {
-    llvm::errs()<<"LocStart == 0, ret\n";
+  SourceManager& sr = Rewrite.getSourceMgr();
+  SourceLocation ST = c->getBeginLoc();
+  SourceLocation END = c->getEndLoc();
+  // calls outside a function body, in macros or in headers are not counted
+  if (func_gid<0 || ST.isMacroID() || END.isMacroID() || !sr.isInMainFile(ST))
     return;
-  }
+  if (hoisted_calls.count(c))                                  // now runs once before the loop
+    return;
+  cgSite cs;
+  cs.site = cg_next++;
+  cs.caller = func_gid;
+  cs.callee = "?";
+  if (FunctionDecl *fd = c->getDirectCallee())
+    cs.callee = fd->getNameAsString();
+  cg_sites.push_back(cs);
+
+  char temp[64];
+  sprintf(temp,"(__lc_cg_edge(%d),",cs.site);
+  Rewrite.InsertText(ST,temp,true);
+  Rewrite.InsertTextAfterToken(END,")");
+}
 
-  if(STT.isMacroID())
-  {
-  	llvm::errs() << "isMacroID exists, but what's this\n";
-  }
+// BranchCond - condition of an if or a loop, NULL for anything else
+Expr *BranchCond(Stmt *s, const char **kind)
+{
+  if (IfStmt *If = dyn_cast<IfStmt>(s)) { *kind = "if"; return If->getCond(); }
+  if (WhileStmt *W = dyn_cast<WhileStmt>(s)) { *kind = "while"; return W->getCond(); }
+  if (ForStmt *F = dyn_cast<ForStmt>(s)) { *kind = "for"; return F->getCond(); }
+  if (DoStmt *D = dyn_cast<DoStmt>(s)) { *kind = "do"; return D->getCond(); }
+  return NULL;
+}
 
-  
-  // Only perform if statement is not compound
-  if (flag==2){
-    SourceLocation ST = s->getBeginLoc();
-    SourceLocation ENDD = s->getEndLoc();
-    SourceManager& sr = Rewrite.getSourceMgr();
-    int offset = Lexer::MeasureTokenLength(ST,
-                                           Rewrite.getSourceMgr(),
-                                           Rewrite.getLangOpts()) + 1;
-    int STgre = ST.getRawEncoding();
-    const char *endCharPtr2 = sr.getCharacterData(ST);
-    int stroffset = 0;
-    int i=0,j=0;
-   
-    char getstrData[100];//all the line
-    char getvarName[100];//var name
+// BranchKey - file:line:col of a condition, the same in the counting and the rewriting run
+std::string BranchKey(SourceManager &SM, SourceLocation loc)
+{
+  llvm::SmallString<256> path(SM.getFilename(loc));
+  llvm::sys::fs::make_absolute(path);
+  char temp[32];
+  sprintf(temp, ":%u:%u", SM.getSpellingLineNumber(loc), SM.getSpellingColumnNumber(loc));
+  return path.str().str() + temp;
+}
 
-    while(endCharPtr2[stroffset]!=':'){
-    	stroffset++;
-    	if (stroffset>80) {
-    		llvm::errs() << "too long switchcase;default"<<"\n";
-    		break;
-    	}
-    }
-    stroffset++;
-    SourceLocation ST1 = ST.getLocWithOffset(stroffset);
-    sprintf(temp,"\nblocks[%d] = '1';//%d %d!\n",pos%100000,ST,ENDD);
-    Rewrite.InsertText(ST1, temp, true, true);
-  }
-  else if(flag==1)
-  {
-    // sprintf(temp,"\n  int seq_out_byte = %s/8;\
-                \n  int seq_in_byte =1<<(%s%8);\
-                \n  blocks[seq_out_byte]=blocks[seq_out_byte]|seq_in_byte;\n",char_pos,char_pos);
-    
-    SourceLocation ST = s->getBeginLoc();
-    SourceLocation ENDD = s->getEndLoc();
+// BranchProbe - -branchprof: cond becomes __lc_br(id,(cond))
+void MyRecursiveASTVisitor::BranchProbe(Stmt *s)
+{
+  const char *kind;
+  Expr *cond = BranchCond(s, &kind);
+  SourceManager& sr = Rewrite.getSourceMgr();
+  if (cond == NULL) return;
+  SourceLocation ST = cond->getBeginLoc();
+  SourceLocation END = cond->getEndLoc();
+  if (ST.isMacroID() || END.isMacroID() || !sr.isInMainFile(ST)) return;
+
+  int id = br_next++;
+  br_sites.push_back(std::make_pair(id, std::string(kind) + " " + BranchKey(sr, ST)));
+  char temp[64];
+  sprintf(temp,"__lc_br(%d,(",id);
+  Rewrite.InsertText(ST,temp,true);
+  Rewrite.InsertTextAfterToken(END,"))");
+}
 
-    sprintf(temp,"\nblocks[%d] = '1';//%d %d!\n",pos%100000,ST,ENDD);
-    llvm::errs() << "Found SwitchStmt!!! \n";
-    // Insert opening brace.  Note the second true parameter to InsertText()
-    // says to indent.  Sadly, it will indent to the line after the if, giving:
-    // if (expr)
-    //   {
-    //   stmt;
-    //   }
-    
-    Rewrite.InsertText(ST, temp, true, true); 
+// BranchHint - -branchopt: wrap conditions that went one way at least BR_BIAS of the time
+void MyRecursiveASTVisitor::BranchHint(Stmt *s)
+{
+  const char *kind;
+  Expr *cond = BranchCond(s, &kind);
+  SourceManager& sr = Rewrite.getSourceMgr();
+  if (cond == NULL) return;
+  SourceLocation ST = cond->getBeginLoc();
+  SourceLocation END = cond->getEndLoc();
+  if (ST.isMacroID() || END.isMacroID() || !sr.isInMainFile(ST)) return;
+
+  std::map<std::string,int>::iterator it = br_ids.find(BranchKey(sr, ST));
+  if (it == br_ids.end() || !br_counts.count(it->second)) return;
+  unsigned long long no = br_counts[it->second].first, yes = br_counts[it->second].second;
+  if (no + yes < BR_MIN_COUNT) return;
+  int likely;
+  if (yes >= BR_BIAS * (no + yes)) likely = 1;
+  else if (no >= BR_BIAS * (no + yes)) likely = 0;
+  else return;
+
+  IfStmt *If = dyn_cast<IfStmt>(s);
+  if (brattr && If && !If->getThen()->getBeginLoc().isMacroID()){
+    Rewrite.InsertText(If->getThen()->getBeginLoc(), likely ? "[[likely]] " : "[[unlikely]] ", true);
+    if (If->getElse() && !isa<IfStmt>(If->getElse()) && !If->getElse()->getBeginLoc().isMacroID())
+      Rewrite.InsertText(If->getElse()->getBeginLoc(), likely ? "[[unlikely]] " : "[[likely]] ", true);
   }
-  else if (!isa<CompoundStmt>(s))
-  {
-    // sprintf(temp,"{\n  int seq_out_byte = %s/8;\
-                \n  int seq_in_byte =1<<(%s%8);\
-                \n  blocks[seq_out_byte]=blocks[seq_out_byte]|seq_in_byte;\n",char_pos,char_pos);
-    SourceLocation ST = s->getBeginLoc();
-    SourceLocation ENDD = s->getEndLoc();
-    sprintf(temp,"{\nblocks[%d] = '1';//%d %d@\n",pos%100000,ST,ENDD);
-    llvm::errs() << "Found not CompoundStmt!!! \n";
-    
-
-    // Insert opening brace.  Note the second true parameter to InsertText()
-    // says to indent.  Sadly, it will indent to the line after the if, giving:
-    // if (expr)
-    //   {
-    //   stmt;
-    //   }
-    
-    Rewrite.InsertText(ST, temp, true, true);
-
-    // Note Stmt::getEndLoc() returns the source location prior to the
-    // token at the end of the line.  For instance, for:
-    // var = 123;
-    //      ^---- getEndLoc() points here.
-
-    SourceLocation END = s->getEndLoc();
-    SourceManager& sr = Rewrite.getSourceMgr();
+  else{
+    Rewrite.InsertText(ST,"__builtin_expect(!!(",true);
+    Rewrite.InsertTextAfterToken(END, likely ? "),1)" : "),0)");
+  }
+  br_hints++;
+  llvm::errs() << kind << " at " << it->first << ": " << yes << " taken, " << no
+               << " not taken, marked " << (likely ? "likely" : "unlikely") << "\n";
+}
 
-    // const char *endCharPtr = sr.getCharacterData(END);
-    // 	Lexer::MeasureTokenLength();
-    // MeasureTokenLength gets us past the last token, and adding 1 gets
-    // us past the ';'.
-    int offset = Lexer::MeasureTokenLength(END,
-                                           Rewrite.getSourceMgr(),
-                                           Rewrite.getLangOpts()) + 1;
+// LoadSites - "id kind file:line:col" lines of a sites file
+void LoadSites(const char *name, std::map<std::string,int> &ids)
+{
+  std::ifstream sites(name);
+  std::string line;
+  while (std::getline(sites, line)){
+    std::istringstream ss(line);
+    int id;
+    std::string kind, key;
+    if (!(ss >> id >> kind)) continue;
+    std::getline(ss >> std::ws, key);
+    ids[key] = id;
+  }
+}
 
-    SourceLocation END1 = END.getLocWithOffset(offset);
-    if(END1.getRawEncoding()-ST.getRawEncoding()>1000)
-    {
-	    const char *endCharPtr2 = sr.getCharacterData(ST);
-    	size_t offsentSemicolon = 0;
-    	while(endCharPtr2[offsentSemicolon++]!=';');
-		END1 = ST.getLocWithOffset(offsentSemicolon);
-	}
+// LoadBranchProfile - lcbranch_sites.txt and the lcbranch.out counts
+void LoadBranchProfile(const char *counts)
+{
+  std::string line;
+  LoadSites("/root/lcbranch_sites.txt", br_ids);
+  edits_inputs.push_back("/root/lcbranch_sites.txt");
+  edits_inputs.push_back(counts);
+  std::ifstream infile(counts);
+  if (!infile)
+    llvm::errs() << "Cannot open " << counts << "\n";
+  while (std::getline(infile, line)){
+    std::istringstream ss(line);
+    int id;
+    unsigned long long no, yes;
+    if (ss >> id >> no >> yes)
+      br_counts[id] = std::make_pair(no, yes);
+  }
+}
 
-    llvm::errs()<<"CompoundStmt LocEnd "<<END1.getRawEncoding()<<"\n";
+// LoopEnd - right after a loop, behind the brace InstrumentStmt adds to a single statement body
+SourceLocation LoopEnd(Rewriter &Rewrite, Stmt *body)
+{
+  SourceLocation END = body->getEndLoc();
+  if (isa<CompoundStmt>(body))
+    return END.getLocWithOffset(1);
+  return END.getLocWithOffset(Lexer::MeasureTokenLength(END,Rewrite.getSourceMgr(),Rewrite.getLangOpts()) + 1);
+}
 
-    Rewrite.InsertText(END1, "\n}", true, true);
+// LoopProbe - -loopprof: {unsigned long __lc_tripN=0; loop __lc_loop_done(N,__lc_tripN);}
+// the body probe also counts the iteration
+void MyRecursiveASTVisitor::LoopProbe(Stmt *loop, Stmt *body)
+{
+  SourceManager& sr = Rewrite.getSourceMgr();
+  SourceLocation ST = loop->getBeginLoc();
+  SourceLocation END = body->getEndLoc();
+  if (ST.isMacroID() || END.isMacroID() || !sr.isInMainFile(ST)){
+    InstrumentStmt(body,0);
+    return;
   }
-  else{
-    // sprintf(temp,"\n  int seq_out_byte = %s/8;\n  int seq_in_byte =1<<(%s%8);\n  blocks[seq_out_byte]=blocks[eq_out_byte]|seq_in_bye;\n",char_pos,char_pos);
-    SourceLocation ENDD = s->getEndLoc();
-    SourceLocation ST = ((CompoundStmt *)s)->getLBracLoc().getLocWithOffset(1);
-    sprintf(temp,"\nblocks[%d] = '1';//%d %d#\n",pos%100000,ST,ENDD);
-    llvm::errs() << "Found CompoundStmt \n";
-    
-    Rewrite.InsertText(ST, temp, true, true);
-    /*
-    SourceLocation END = s->getEndLoc();
-    int offset = Lexer::MeasureTokenLength(END,
-        z                                   Rewrite.getSourceMgr(),
-                                           Rewrite.getLangOpts()) + 1;
+  int id = loop_next++;
+  char temp[96];
+  loop_sites.push_back(std::make_pair(id, std::string(isa<ForStmt>(loop) ? "for " : "while ") + BranchKey(sr, ST)));
+  // the loop end goes in front of the "}" of an enclosing unbraced statement that ends here as
+  // well, and the body's own "}" then goes in front of it
+  sprintf(temp,"\n__lc_loop_done(%d,__lc_trip%d);}",id,id);
+  Rewrite.InsertText(LoopEnd(Rewrite,body),temp,false,true);
+  sprintf(temp," __lc_trip%d++;",id);
+  loop_trip = temp;
+  InstrumentStmt(body,0);
+  loop_trip.clear();
+
+  sprintf(temp,"{unsigned long __lc_trip%d=0; ",id);
+  Rewrite.InsertText(ST,temp,true);
+}
 
-    SourceLocation END1 = END.getLocWithOffset(offset);
-    Rewrite.InsertText(END1, "\n}", true, true);
-    */
-  }
+// LoopHint - -loopopt: #pragma clang loop before hot loops with a stable trip count
+void MyRecursiveASTVisitor::LoopHint(Stmt *s)
+{
+  SourceManager& sr = Rewrite.getSourceMgr();
+  if (!isa<ForStmt>(s) && !isa<WhileStmt>(s)) return;
+  SourceLocation ST = s->getBeginLoc();
+  if (ST.isMacroID() || !sr.isInMainFile(ST)) return;
+  std::map<std::string,int>::iterator it = loop_ids.find(BranchKey(sr, ST));
+  if (it == loop_ids.end() || !loop_stats.count(it->second)) return;
+  const loopStat &ls = loop_stats[it->second];
+  if (ls.trips < LOOP_MIN_TRIPS || ls.entries == 0) return;
+
+  int b = 0;
+  for (int i = 1; i < LOOP_BUCKETS; i++)
+    if (ls.hist[i] > ls.hist[b]) b = i;
+  if (ls.hist[b] < LOOP_STABLE * ls.entries) return;
+  unsigned long long lo = b ? 1ull << (b - 1) : 0;            // smallest trip count of the bucket
+  if (lo < 4) return;
+
+  std::string hint = "\n#pragma clang loop";
+  if (lo >= 16) hint += " vectorize(enable) interleave(enable)";
+  char temp[32];
+  sprintf(temp," unroll_count(%llu)\n", lo < 8 ? lo : 8);
+  hint += temp;
+  Rewrite.InsertText(ST,hint,true);
+  loop_hints++;
+  llvm::errs() << "loop at " << it->first << ": " << ls.entries << " entries, " << ls.trips
+               << " iterations, mostly " << lo << ".." << 2 * lo - 1 << ":" << hint;
+}
 
-  // Also note getEndLoc() on a CompoundStmt points ahead of the '}'.
-  // Use getEndLoc().getLocWithOffset(1) to point past it.
-  //end of function ,blockpos write back
-  std::ofstream outfile("loopconvert.txt");
-  outfile<<pos;
-  outfile.close();
+// LoadLoopProfile - lcloop_sites.txt and lcloop.out ("id entries trips hist[0..32]")
+void LoadLoopProfile(const char *counts)
+{
+  std::string line;
+  LoadSites("/root/lcloop_sites.txt", loop_ids);
+  edits_inputs.push_back("/root/lcloop_sites.txt");
+  edits_inputs.push_back(counts);
+  std::ifstream infile(counts);
+  if (!infile)
+    llvm::errs() << "Cannot open " << counts << "\n";
+  while (std::getline(infile, line)){
+    std::istringstream ss(line);
+    int id;
+    loopStat ls;
+    if (!(ss >> id >> ls.entries >> ls.trips)) continue;
+    for (int i = 0; i < LOOP_BUCKETS; i++)
+      if (!(ss >> ls.hist[i])) ls.hist[i] = 0;
+    loop_stats[id] = ls;
+  }
 }
 
-// Override Statements which includes expressions and more
-bool MyRecursiveASTVisitor::VisitStmt(Stmt *s){
-  int flag = 0;
-  llvm::errs() << "Stmt Name :: " << s->getStmtClassName()<<"\n";
-  stmtsum++;
-  //llvm::errs() << "0000\n";
-  if(isa<DeclStmt>(s))
-  {
-    stack++;  
-    llvm::errs() << "DeclStmt Found------------- \n";
-    AddrDisinfect(s);
-  } 
-  else if (isa<IfStmt>(s))
-  {
-    llvm::errs() << "Found if\n";
-    if (isa<CallExpr>(s)) llvm::errs() << "Found if&call\n";
-    // Cast s to IfStmt to access the then and else clauses
-    IfStmt *If = cast<IfStmt>(s);
-    Stmt *TH = If->getThen();
+// RefVar - the variable an expression names, NULL if it is not a plain variable
+const VarDecl *RefVar(const Expr *e)
+{
+  if (e == NULL) return NULL;
+  if (const DeclRefExpr *d = dyn_cast<DeclRefExpr>(e->IgnoreParenImpCasts()))
+    return dyn_cast<VarDecl>(d->getDecl());
+  return NULL;
+}
 
-    // Add braces if needed to then clause
-    //InstrumentStmt(TH,flag);// if has else if ,broken
-    Stmt *EL = If->getElse();
-    if (EL)
-    {
-      llvm::errs() << "Found else\n"; 
-      
+// ExprRefs - does e name v anywhere
+bool ExprRefs(const Stmt *e, const VarDecl *v)
+{
+  if (e == NULL) return false;
+  if (const DeclRefExpr *d = dyn_cast<DeclRefExpr>(e))
+    if (d->getDecl() == v) return true;
+  for (Stmt::const_child_iterator I = e->child_begin(), E = e->child_end(); I != E; ++I)
+    if (ExprRefs(*I, v)) return true;
+  return false;
+}
 
-      if(!isa<IfStmt>(EL))
-      {
-        llvm::errs() << "found if in else\n";
-        InstrumentStmt(TH,flag);
-        InstrumentStmt(EL,flag);
-	      //VisitThinPath(TH,3);
-        //VisitThinPath(EL,4);
-      }
-      else
-      {
-          InstrumentStmt(TH,flag);
-          //VisitThinPath(TH,2);
-      }
-      // Add braces if needed to else clause
-    }
-    else{
-    	//VisitThinPath(TH,2);
-    	InstrumentStmt(TH,flag);
+// CanonicalLoop - for (i = lb; i <,<=,>,>= ub; i++,i--,i+=c,i-=c): the loop variable, or NULL and why
+const VarDecl *CanonicalLoop(ForStmt *F, std::string &why, bool &ivOutside)
+{
+  const VarDecl *iv = NULL;
+  Stmt *init = F->getInit();
+  ivOutside = false;
+  if (DeclStmt *DS = dyn_cast_or_null<DeclStmt>(init)){
+    if (DS->isSingleDecl())
+      if (const VarDecl *vd = dyn_cast<VarDecl>(DS->getSingleDecl()))
+        if (vd->hasInit()) iv = vd;
+  }
+  else if (BinaryOperator *BO = dyn_cast_or_null<BinaryOperator>(init)){
+    if (BO->getOpcode() == BO_Assign){
+      iv = RefVar(BO->getLHS());
+      ivOutside = true;
     }
   }
-  else
-  if (isa<WhileStmt>(s))
-  {
-    llvm::errs() << "Found while\n";
-    WhileStmt *While = cast<WhileStmt>(s);
-    Stmt *BODY = While->getBody();
-    InstrumentStmt(BODY,flag);
-    //VisitThinPath(BODY,5);
+  if (iv == NULL || !iv->getType()->isIntegerType()){
+    why = "init is not 'i = start' with an integer i";
+    return NULL;
   }
-  else
-  if (isa<ForStmt>(s))
-  {
-    llvm::errs() << "Found for\n";
 
-    ForStmt *For = cast<ForStmt>(s);
-    Stmt *BODY = For->getBody();
-    InstrumentStmt(BODY,flag);
-    //VisitThinPath(BODY,5);
+  BinaryOperator *C = dyn_cast_or_null<BinaryOperator>(F->getCond());
+  if (C == NULL || !(C->getOpcode() == BO_LT || C->getOpcode() == BO_LE ||
+                     C->getOpcode() == BO_GT || C->getOpcode() == BO_GE)){
+    why = "condition is not a <, <=, > or >= comparison";
+    return NULL;
   }
-  else if(isa<CaseStmt>(s))
-  {
-      llvm::errs() << "Found CaseStmt\n";
-      InstrumentStmt(s,2);
+  const Expr *bound = RefVar(C->getLHS()) == iv ? C->getRHS() : RefVar(C->getRHS()) == iv ? C->getLHS() : NULL;
+  if (bound == NULL || ExprRefs(bound, iv) || bound->HasSideEffects(iv->getASTContext())){
+    why = "condition does not compare " + iv->getNameAsString() + " with a bound";
+    return NULL;
   }
-  else if(isa<DefaultStmt>(s))
-  {
-      llvm::errs() << "Found DefaultStmt\n";
-      InstrumentStmt(s,2);
 
+  Expr *inc = F->getInc();
+  bool incOk = false;
+  if (UnaryOperator *U = dyn_cast_or_null<UnaryOperator>(inc))
+    incOk = U->isIncrementDecrementOp() && RefVar(U->getSubExpr()) == iv;
+  else if (BinaryOperator *BO = dyn_cast_or_null<BinaryOperator>(inc)){
+    if ((BO->getOpcode() == BO_AddAssign || BO->getOpcode() == BO_SubAssign) && RefVar(BO->getLHS()) == iv)
+      incOk = !ExprRefs(BO->getRHS(), iv) && !BO->getRHS()->HasSideEffects(iv->getASTContext());
+    else if (BO->getOpcode() == BO_Assign && RefVar(BO->getLHS()) == iv)
+      if (BinaryOperator *R = dyn_cast<BinaryOperator>(BO->getRHS()->IgnoreParenImpCasts()))
+        incOk = (R->getOpcode() == BO_Add || R->getOpcode() == BO_Sub) && RefVar(R->getLHS()) == iv &&
+                !ExprRefs(R->getRHS(), iv);
   }
-  else if (isa<CallExpr>(s))
-  {
-  	llvm::errs() << "Found Call\n";
-  	GetFuncCallGraph(s);
-  }
-  else if (isa<ReturnStmt>(s)){
-  	llvm::errs() << "Found Return\n";
-  	SourceLocation ST = s->getBeginLoc();
-    SourceManager& sr = Rewrite.getSourceMgr();
-    int offset = Lexer::MeasureTokenLength(ST,
-                                           Rewrite.getSourceMgr(),
-                                           Rewrite.getLangOpts()) + 1;
-    char ss[100]="";
-    sprintf(ss,"\n\tprint2(\"%s end,\");\n\t",func_name[func_now]);
-    Rewrite.InsertText(ST,checkleak,true,true);
-    Rewrite.InsertText(ST,ss,true,true);
-
+  if (!incOk){
+    why = "increment is not " + iv->getNameAsString() + "++, --, += or -= a constant";
+    return NULL;
   }
-  //llvm::errs() << "Found Null\n";
-  return true; // returning false aborts the traversal
+  return iv;
 }
 
-bool MyRecursiveASTVisitor::VisitFunctionDecl(FunctionDecl *f)
+// StmtLevel - add the children of s whose value is thrown away: statements of a block, loop and
+// if bodies, the init and increment of a for, labelled statements, the left side of a comma and
+// what a discarded comma, parenthesis or (void) cast holds
+void StmtLevel(Stmt *s, std::set<const Stmt*> &out)
 {
-  if (f->hasBody())
+  if (CompoundStmt *CS = dyn_cast<CompoundStmt>(s))
+    out.insert(CS->body_begin(), CS->body_end());
+  else if (ForStmt *F = dyn_cast<ForStmt>(s)){
+    out.insert(F->getInit());
+    out.insert(F->getInc());
+    out.insert(F->getBody());
+  }
+  else if (WhileStmt *W = dyn_cast<WhileStmt>(s)) out.insert(W->getBody());
+  else if (DoStmt *D = dyn_cast<DoStmt>(s)) out.insert(D->getBody());
+  else if (IfStmt *I = dyn_cast<IfStmt>(s)){
+    out.insert(I->getThen());
+    out.insert(I->getElse());
+  }
+  else if (SwitchCase *C = dyn_cast<SwitchCase>(s)) out.insert(C->getSubStmt());
+  else if (LabelStmt *L = dyn_cast<LabelStmt>(s)) out.insert(L->getSubStmt());
+  else if (BinaryOperator *B = dyn_cast<BinaryOperator>(s)){
+    if (B->getOpcode() == BO_Comma){
+      out.insert(B->getLHS());
+      if (out.count(B)) out.insert(B->getRHS());
+    }
+  }
+  else if (!out.count(s)) return;
+  else if (ParenExpr *P = dyn_cast<ParenExpr>(s)) out.insert(P->getSubExpr());
+  else if (CStyleCastExpr *V = dyn_cast<CStyleCastExpr>(s)){
+    if (V->getType()->isVoidType()) out.insert(V->getSubExpr());
+  }
+}
+
+// functions without side effects that may be called from a parallel loop
+const char *ompPureFuncs[] = {"sqrt","sqrtf","sin","sinf","cos","cosf","tan","exp","expf","log","logf",
+  "log10","pow","powf","fabs","fabsf","abs","labs","floor","floorf","ceil","ceilf","fmin","fmax",
+  "atan","atan2","tanh","hypot","fmod",NULL};
+
+// ompArray - accesses of one array (or pointer) base in the loop body
+struct ompArray{
+  bool written = false;
+  bool nonAffine = false;                                      // an index that is not i+k
+  bool pointer = false;                                        // not restrict qualified
+  std::set<long> offsets;                                      // k of every i+k first index
+};
+
+// OmpAnalyzer - loop-carried dependences of one loop body
+class OmpAnalyzer : public RecursiveASTVisitor<OmpAnalyzer>
+{
+ public:
+  OmpAnalyzer(const VarDecl *IV, Stmt *Body) : iv(IV), body(Body), depth(0), deref(false) {
+    discarded.insert(Body);
+    // unconditional assignments: statements of the body and inits of its loops
+    CompoundStmt *CS = dyn_cast<CompoundStmt>(Body);
+    Stmt *single[1] = {Body};
+    Stmt **b = CS ? CS->body_begin() : single, **e = CS ? CS->body_end() : single + 1;
+    for (; b != e; ++b){
+      Stmt *s = *b;
+      if (ForStmt *F = dyn_cast<ForStmt>(s)) s = F->getInit();
+      if (BinaryOperator *BO = dyn_cast_or_null<BinaryOperator>(s))
+        if (BO->getOpcode() == BO_Assign) topAssigns.insert(BO);
+    }
+  }
+
+  const VarDecl *iv;
+  Stmt *body;
+  int depth;                                                   // loops and switches inside the body
+  bool deref;                                                  // reads through *p or p->f
+  std::vector<std::string> reasons;
+  std::set<const VarDecl*> locals;
+  std::set<const DeclRefExpr*> special;                        // write targets, reduction updates, array bases
+  std::set<const ArraySubscriptExpr*> writeASE, innerASE;
+  std::map<const VarDecl*, std::string> redOp;                 // "" after a write that is no reduction
+  std::map<const VarDecl*, int> firstKind;                     // 1 unconditional write first, 2 anything else
+  std::set<const VarDecl*> readPlain;
+  std::set<const BinaryOperator*> topAssigns;
+  std::map<const VarDecl*, ompArray> arrays;
+  std::set<const Stmt*> discarded;                             // statements whose value nobody uses
+
+  bool VisitStmt(Stmt *s) { StmtLevel(s, discarded); return true; }
+
+  bool TraverseForStmt(ForStmt *s) { depth++; bool r = RecursiveASTVisitor<OmpAnalyzer>::TraverseForStmt(s); depth--; return r; }
+  bool TraverseWhileStmt(WhileStmt *s) { depth++; bool r = RecursiveASTVisitor<OmpAnalyzer>::TraverseWhileStmt(s); depth--; return r; }
+  bool TraverseDoStmt(DoStmt *s) { depth++; bool r = RecursiveASTVisitor<OmpAnalyzer>::TraverseDoStmt(s); depth--; return r; }
+  bool TraverseSwitchStmt(SwitchStmt *s) { depth++; bool r = RecursiveASTVisitor<OmpAnalyzer>::TraverseSwitchStmt(s); depth--; return r; }
+
+  bool VisitBreakStmt(BreakStmt *s) { if (depth == 0) reasons.push_back("break leaves the loop"); return true; }
+  bool VisitReturnStmt(ReturnStmt *s) { reasons.push_back("return inside the loop"); return true; }
+  bool VisitGotoStmt(GotoStmt *s) { reasons.push_back("goto inside the loop"); return true; }
+  bool VisitVarDecl(VarDecl *v) {
+    locals.insert(v);
+    if (v->isStaticLocal()) reasons.push_back("static local " + v->getNameAsString());
+    return true;
+  }
+  bool VisitCallExpr(CallExpr *c) {
+    const FunctionDecl *fd = c->getDirectCallee();
+    std::string name = fd ? fd->getNameAsString() : "a function pointer";
+    for (int i = 0; ompPureFuncs[i]; i++)
+      if (name == ompPureFuncs[i]) return true;
+    reasons.push_back("calls " + name + "()");
+    return true;
+  }
+  bool VisitMemberExpr(MemberExpr *m) { if (m->isArrow()) deref = true; return true; }
+
+  // Write - e is assigned by update; op is the reduction operator if this write is one, which it
+  // is not when the updated value is used, as in b[i] = (s += a[i]) or b[i] = n++
+  void Write(Expr *e, const Expr *update, const BinaryOperator *assign, const char *op) {
+    if (!discarded.count(update)) op = NULL;
+    e = e->IgnoreParenImpCasts();
+    while (MemberExpr *m = dyn_cast<MemberExpr>(e)){
+      if (m->isArrow()){
+        reasons.push_back("writes through a pointer (->)");
+        return;
+      }
+      e = m->getBase()->IgnoreParenImpCasts();
+      if (!isa<ArraySubscriptExpr>(e)){
+        reasons.push_back("writes a member of a shared struct");
+        return;
+      }
+    }
+    if (ArraySubscriptExpr *A = dyn_cast<ArraySubscriptExpr>(e)){
+      writeASE.insert(A);
+      return;
+    }
+    if (UnaryOperator *U = dyn_cast<UnaryOperator>(e))
+      if (U->getOpcode() == UO_Deref){
+        reasons.push_back("writes through a pointer (*)");
+        return;
+      }
+    DeclRefExpr *d = dyn_cast<DeclRefExpr>(e);
+    const VarDecl *v = d ? dyn_cast<VarDecl>(d->getDecl()) : NULL;
+    if (v == NULL){
+      reasons.push_back("writes an expression it cannot follow");
+      return;
+    }
+    special.insert(d);
+    if (v == iv){
+      reasons.push_back("loop variable " + v->getNameAsString() + " changed in the body");
+      return;
+    }
+    if (locals.count(v)) return;
+    if (op && v->getType()->isArithmeticType()){
+      if (!redOp.count(v)) redOp[v] = op;
+      else if (redOp[v] != op) redOp[v] = "";
+    }
+    else
+      redOp[v] = "";
+    if (!firstKind.count(v))
+      firstKind[v] = assign && topAssigns.count(assign) && !ExprRefs(assign->getRHS(), v) ? 1 : 2;
+  }
+
+  bool VisitUnaryOperator(UnaryOperator *u) {
+    if (u->isIncrementDecrementOp())
+      Write(u->getSubExpr(), u, NULL, "+");
+    else if (u->getOpcode() == UO_AddrOf)
+      reasons.push_back("takes an address (&)");
+    else if (u->getOpcode() == UO_Deref)
+      deref = true;
+    return true;
+  }
+
+  bool VisitBinaryOperator(BinaryOperator *b) {
+    const char *op = NULL;
+    switch (b->getOpcode()){
+    case BO_AddAssign: case BO_SubAssign: op = "+"; break;
+    case BO_MulAssign: op = "*"; break;
+    case BO_AndAssign: op = "&"; break;
+    case BO_OrAssign:  op = "|"; break;
+    case BO_XorAssign: op = "^"; break;
+    case BO_Assign: {
+      // s = s + e, s = e + s, s = s - e, s = s * e, s = e * s
+      const VarDecl *v = RefVar(b->getLHS());
+      BinaryOperator *R = dyn_cast<BinaryOperator>(b->getRHS()->IgnoreParenImpCasts());
+      if (v && R){
+        Expr *other = NULL;
+        DeclRefExpr *self = NULL;
+        if (RefVar(R->getLHS()) == v){ self = cast<DeclRefExpr>(R->getLHS()->IgnoreParenImpCasts()); other = R->getRHS(); }
+        else if (R->getOpcode() != BO_Sub && RefVar(R->getRHS()) == v){ self = cast<DeclRefExpr>(R->getRHS()->IgnoreParenImpCasts()); other = R->getLHS(); }
+        if (self && !ExprRefs(other, v) && discarded.count(b)){
+          if (R->getOpcode() == BO_Add || R->getOpcode() == BO_Sub) op = "+";
+          else if (R->getOpcode() == BO_Mul) op = "*";
+          if (op) special.insert(self);
+        }
+      }
+      Write(b->getLHS(), b, b, op);
+      return true;
+    }
+    default:
+      return true;
+    }
+    Write(b->getLHS(), b, b, op);
+    return true;
+  }
+
+  bool VisitArraySubscriptExpr(ArraySubscriptExpr *a) {
+    if (innerASE.count(a)) return true;
+    // a[x][y]: only the first index decides which iteration owns the element
+    ArraySubscriptExpr *first = a;
+    while (ArraySubscriptExpr *in = dyn_cast<ArraySubscriptExpr>(first->getBase()->IgnoreParenImpCasts())){
+      innerASE.insert(in);
+      first = in;
+    }
+    DeclRefExpr *d = dyn_cast<DeclRefExpr>(first->getBase()->IgnoreParenImpCasts());
+    const VarDecl *v = d ? dyn_cast<VarDecl>(d->getDecl()) : NULL;
+    if (v == NULL){
+      deref = true;
+      if (writeASE.count(a)) reasons.push_back("writes an array it cannot name");
+      return true;
+    }
+    special.insert(d);
+    // a local array is private to the iteration, a local pointer still points at shared data
+    if (locals.count(v)){
+      if (v->getType()->isArrayType()) return true;
+      if (writeASE.count(a)) reasons.push_back("writes through a pointer (" + v->getNameAsString() + "[])");
+      else deref = true;
+      return true;
+    }
+    ompArray &ar = arrays[v];
+    ar.pointer = v->getType()->isPointerType() && !v->getType().isRestrictQualified();
+    if (writeASE.count(a)) ar.written = true;
+    long k;
+    if (IvOffset(first->getIdx(), k)) ar.offsets.insert(k);
+    else ar.nonAffine = true;
+    return true;
+  }
+
+  bool VisitDeclRefExpr(DeclRefExpr *d) {
+    const VarDecl *v = dyn_cast<VarDecl>(d->getDecl());
+    if (v == NULL || v == iv || special.count(d) || locals.count(v)) return true;
+    readPlain.insert(v);
+    if (!firstKind.count(v)) firstKind[v] = 2;
+    return true;
+  }
+
+  // IvOffset - index is i, i+k, k+i or i-k
+  bool IvOffset(Expr *idx, long &k) {
+    idx = idx->IgnoreParenImpCasts();
+    if (RefVar(idx) == iv){ k = 0; return true; }
+    BinaryOperator *B = dyn_cast<BinaryOperator>(idx);
+    if (B == NULL || (B->getOpcode() != BO_Add && B->getOpcode() != BO_Sub)) return false;
+    Expr *c = RefVar(B->getLHS()) == iv ? B->getRHS() :
+              B->getOpcode() == BO_Add && RefVar(B->getRHS()) == iv ? B->getLHS() : NULL;
+    Expr::EvalResult R;
+    if (c == NULL || !c->EvaluateAsInt(R, iv->getASTContext())) return false;
+    k = R.Val.getInt().getExtValue();
+    if (B->getOpcode() == BO_Sub) k = -k;
+    return true;
+  }
+
+  // Clauses - the pragma clauses, or false with the reasons filled in
+  bool Clauses(std::string &clauses) {
+    std::map<std::string, std::string> red;                    // op -> "a,b"
+    std::string last;
+    for (std::map<const VarDecl*, std::string>::iterator it = redOp.begin(); it != redOp.end(); ++it){
+      const VarDecl *v = it->first;
+      std::string name = v->getNameAsString();
+      if (!it->second.empty() && !readPlain.count(v))
+        red[it->second] += (red[it->second].empty() ? "" : ",") + name;
+      else if (firstKind[v] == 1)
+        last += (last.empty() ? "" : ",") + name;
+      else
+        reasons.push_back(name + " is carried from one iteration to the next");
+    }
+    bool anyPointerWrite = false;
+    for (std::map<const VarDecl*, ompArray>::iterator it = arrays.begin(); it != arrays.end(); ++it){
+      ompArray &ar = it->second;
+      std::string name = it->first->getNameAsString();
+      if (!ar.written) continue;
+      if (ar.nonAffine)
+        reasons.push_back(name + "[] is written with an index that is not " + iv->getNameAsString() + "+k");
+      else if (ar.offsets.size() > 1)
+        reasons.push_back(name + "[] is accessed at different offsets of " + iv->getNameAsString() +
+                          ", one iteration reads what another writes");
+      if (ar.pointer) anyPointerWrite = true;
+    }
+    if (anyPointerWrite && (arrays.size() > 1 || deref))
+      reasons.push_back("written pointer may alias other data, declare it restrict");
+    else if (deref && !arrays.empty())
+      for (std::map<const VarDecl*, ompArray>::iterator it = arrays.begin(); it != arrays.end(); ++it)
+        if (it->second.written){
+          reasons.push_back("reads through a pointer that may alias a written array");
+          break;
+        }
+    if (!reasons.empty()) return false;
+    for (std::map<std::string, std::string>::iterator it = red.begin(); it != red.end(); ++it)
+      clauses += " reduction(" + it->first + ":" + it->second + ")";
+    if (!last.empty())
+      clauses += " lastprivate(" + last + ")";
+    return true;
+  }
+};
+
+// OmpLoop - -omp: #pragma omp parallel for on a loop without loop-carried dependences, or say why not
+void MyRecursiveASTVisitor::OmpLoop(ForStmt *F)
+{
+  SourceManager& sr = Rewrite.getSourceMgr();
+  SourceLocation ST = F->getBeginLoc();
+  if (ST.isMacroID() || !sr.isInMainFile(ST)) return;
+  // loops inside a parallelized loop stay sequential
+  if (omp_end.isValid() && sr.isBeforeInTranslationUnit(ST, omp_end)) return;
+
+  std::string where = BranchKey(sr, ST), why, clauses;
+  bool ivOutside;
+  const VarDecl *iv = CanonicalLoop(F, why, ivOutside);
+  if (iv == NULL){
+    llvm::errs() << "omp: " << where << " rejected: " << why << "\n";
+    omp_rejected++;
+    return;
+  }
+  OmpAnalyzer oa(iv, F->getBody());
+  oa.TraverseStmt(F->getBody());
+  // the bound must not change inside the loop
+  for (std::map<const VarDecl*, std::string>::iterator it = oa.redOp.begin(); it != oa.redOp.end(); ++it)
+    if (ExprRefs(F->getCond(), it->first))
+      oa.reasons.push_back("bound " + it->first->getNameAsString() + " changes inside the loop");
+  if (!oa.Clauses(clauses)){
+    llvm::errs() << "omp: " << where << " rejected:";
+    for (unsigned i = 0; i < oa.reasons.size(); i++)
+      llvm::errs() << (i ? ";" : "") << " " << oa.reasons[i];
+    llvm::errs() << "\n";
+    omp_rejected++;
+    return;
+  }
+  if (ivOutside)
+    clauses += " lastprivate(" + iv->getNameAsString() + ")";
+  Rewrite.InsertText(ST, "\n#pragma omp parallel for" + clauses + "\n", true);
+  omp_end = F->getEndLoc();
+  omp_loops++;
+  llvm::errs() << "omp: " << where << " parallel for" << clauses << "\n";
+}
+
+// SrcText - original source of a token range
+std::string SrcText(SourceManager &SM, const LangOptions &LO, SourceRange r)
+{
+  return Lexer::getSourceText(CharSourceRange::getTokenRange(r), SM, LO).str();
+}
+
+// loopHdr - for (decl name = lb; name op ub; name++), the only form that is tiled
+struct loopHdr{
+  std::string decl;                                            // "int " when declared in the init
+  std::string name, lb, op, ub;
+};
+
+bool UnitLoop(ForStmt *F, const VarDecl *iv, SourceManager &SM, const LangOptions &LO, loopHdr &h)
+{
+  h.name = iv->getNameAsString();
+  if (isa<DeclStmt>(F->getInit())){
+    h.decl = iv->getType().getAsString() + " ";
+    h.lb = SrcText(SM, LO, iv->getInit()->getSourceRange());
+  }
+  else{
+    h.decl = "";
+    h.lb = SrcText(SM, LO, cast<BinaryOperator>(F->getInit())->getRHS()->getSourceRange());
+  }
+  BinaryOperator *C = cast<BinaryOperator>(F->getCond());
+  if (RefVar(C->getLHS()) != iv || (C->getOpcode() != BO_LT && C->getOpcode() != BO_LE)) return false;
+  h.op = C->getOpcodeStr().str();
+  h.ub = SrcText(SM, LO, C->getRHS()->getSourceRange());
+  if (UnaryOperator *U = dyn_cast<UnaryOperator>(F->getInc()))
+    return U->isIncrementOp();
+  if (BinaryOperator *B = dyn_cast<BinaryOperator>(F->getInc())){
+    Expr::EvalResult R;
+    return B->getOpcode() == BO_AddAssign && B->getRHS()->EvaluateAsInt(R, iv->getASTContext()) &&
+           R.Val.getInt() == 1;
+  }
+  return false;
+}
+
+// nestAccess - one array access of a loop nest body, strides in bytes per step of each loop
+struct nestAccess{
+  const VarDecl *base;
+  std::string text;
+  std::vector<std::string> idx;
+  long elem, strideOuter, strideInner;
+  bool write, ownIndex;                                        // ownIndex: outer and inner each index a dimension of their own
+};
+
+// LoopIndex - index is v, v+k, k+v or v-k
+bool LoopIndex(Expr *idx, const VarDecl *v)
+{
+  idx = idx->IgnoreParenImpCasts();
+  if (RefVar(idx) == v) return true;
+  BinaryOperator *B = dyn_cast<BinaryOperator>(idx);
+  if (B == NULL || (B->getOpcode() != BO_Add && B->getOpcode() != BO_Sub)) return false;
+  Expr *c = RefVar(B->getLHS()) == v ? B->getRHS() :
+            B->getOpcode() == BO_Add && RefVar(B->getRHS()) == v ? B->getLHS() : NULL;
+  return c && c->isIntegerConstantExpr(v->getASTContext());
+}
+
+// NestChecker - can the two loops of a nest run in any order, and how does each walk memory
+class NestChecker : public RecursiveASTVisitor<NestChecker>
+{
+ public:
+  NestChecker(SourceManager &S, const LangOptions &L, const VarDecl *O, const VarDecl *I)
+    : SM(S), LO(L), outer(O), inner(I), depth(0) { }
+
+  SourceManager &SM;
+  const LangOptions &LO;
+  const VarDecl *outer, *inner;
+  int depth;
+  std::vector<std::string> reasons;
+  std::vector<nestAccess> acc;
+  std::set<const VarDecl*> locals;
+  std::set<const VarDecl*> written;                            // arrays written in the body
+  std::set<const ArraySubscriptExpr*> writeASE, innerASE;
+  std::set<const VarDecl*> summed, readPlain;                  // shared integer sums, and shared scalars read in the body
+  std::set<const DeclRefExpr*> special;                        // the s of s += e
+  std::set<const Stmt*> discarded;                             // statements whose value nobody uses
+
+  bool VisitStmt(Stmt *s) { StmtLevel(s, discarded); return true; }
+  bool TraverseForStmt(ForStmt *s) { depth++; bool r = RecursiveASTVisitor<NestChecker>::TraverseForStmt(s); depth--; return r; }
+  bool TraverseWhileStmt(WhileStmt *s) { depth++; bool r = RecursiveASTVisitor<NestChecker>::TraverseWhileStmt(s); depth--; return r; }
+  bool TraverseDoStmt(DoStmt *s) { depth++; bool r = RecursiveASTVisitor<NestChecker>::TraverseDoStmt(s); depth--; return r; }
+  bool TraverseSwitchStmt(SwitchStmt *s) { depth++; bool r = RecursiveASTVisitor<NestChecker>::TraverseSwitchStmt(s); depth--; return r; }
+
+  bool VisitBreakStmt(BreakStmt *s) { if (depth == 0) reasons.push_back("break leaves the loop"); return true; }
+  bool VisitReturnStmt(ReturnStmt *s) { reasons.push_back("return inside the loop"); return true; }
+  bool VisitGotoStmt(GotoStmt *s) { reasons.push_back("goto inside the loop"); return true; }
+  bool VisitVarDecl(VarDecl *v) { locals.insert(v); return true; }
+  bool VisitCallExpr(CallExpr *c) {
+    const FunctionDecl *fd = c->getDirectCallee();
+    std::string name = fd ? fd->getNameAsString() : "a function pointer";
+    for (int i = 0; ompPureFuncs[i]; i++)
+      if (name == ompPureFuncs[i]) return true;
+    reasons.push_back("calls " + name + "()");
+    return true;
+  }
+
+  // Write - reorder is exact for array elements written at one place and integer sums whose
+  // value is not used: a[i][j] = n++ stores a count that depends on the loop order
+  void Write(Expr *e, const Expr *update, bool intReduction) {
+    if (!discarded.count(update)) intReduction = false;
+    e = e->IgnoreParenImpCasts();
+    while (MemberExpr *m = dyn_cast<MemberExpr>(e)){
+      if (m->isArrow()) break;
+      e = m->getBase()->IgnoreParenImpCasts();
+    }
+    if (ArraySubscriptExpr *A = dyn_cast<ArraySubscriptExpr>(e)){
+      writeASE.insert(A);
+      return;
+    }
+    const VarDecl *v = RefVar(e);
+    if (v == NULL){
+      reasons.push_back("writes through a pointer");
+      return;
+    }
+    if (v == outer || v == inner){
+      reasons.push_back("loop variable " + v->getNameAsString() + " changed in the body");
+      return;
+    }
+    if (locals.count(v)) return;
+    if (!intReduction || !v->getType()->isIntegerType())
+      reasons.push_back("shared " + v->getNameAsString() + " is updated in an order that would change");
+    else {
+      special.insert(cast<DeclRefExpr>(e));
+      summed.insert(v);
+    }
+  }
+
+  bool VisitDeclRefExpr(DeclRefExpr *d) {
+    const VarDecl *v = dyn_cast<VarDecl>(d->getDecl());
+    if (v && v != outer && v != inner && !special.count(d) && !locals.count(v)) readPlain.insert(v);
+    return true;
+  }
+
+  bool VisitUnaryOperator(UnaryOperator *u) {
+    if (u->isIncrementDecrementOp()) Write(u->getSubExpr(), u, true);
+    else if (u->getOpcode() == UO_AddrOf) reasons.push_back("takes an address (&)");
+    return true;
+  }
+  bool VisitBinaryOperator(BinaryOperator *b) {
+    switch (b->getOpcode()){
+    case BO_Assign: Write(b->getLHS(), b, false); break;
+    case BO_AddAssign: case BO_SubAssign: case BO_MulAssign:
+    case BO_AndAssign: case BO_OrAssign: case BO_XorAssign: Write(b->getLHS(), b, true); break;
+    default:
+      if (b->isCompoundAssignmentOp()) Write(b->getLHS(), b, false);
+    }
+    return true;
+  }
+
+  bool VisitArraySubscriptExpr(ArraySubscriptExpr *a) {
+    if (innerASE.count(a)) return true;
+    nestAccess na;
+    std::vector<Expr*> idx;
+    ArraySubscriptExpr *first = a;
+    idx.push_back(a->getIdx());
+    while (ArraySubscriptExpr *in = dyn_cast<ArraySubscriptExpr>(first->getBase()->IgnoreParenImpCasts())){
+      innerASE.insert(in);
+      first = in;
+      idx.insert(idx.begin(), in->getIdx());
+    }
+    na.base = RefVar(first->getBase());
+    if (na.base == NULL){
+      if (writeASE.count(a)) reasons.push_back("writes an array it cannot name");
+      return true;
+    }
+    if (locals.count(na.base)) return true;
+    if (writeASE.count(a)) written.insert(na.base);
+    na.text = SrcText(SM, LO, a->getSourceRange());
+
+    // dimension sizes from the type, 0 when unknown (pointer)
+    ASTContext &Ctx = na.base->getASTContext();
+    QualType t = na.base->getType();
+    std::vector<long> dims;
+    for (unsigned d = 0; d < idx.size(); d++){
+      if (const ConstantArrayType *CA = Ctx.getAsConstantArrayType(t)){
+        dims.push_back(CA->getSize().getZExtValue());
+        t = CA->getElementType();
+      }
+      else if (const ArrayType *AT = Ctx.getAsArrayType(t)){
+        dims.push_back(0);
+        t = AT->getElementType();
+      }
+      else if (const PointerType *PT = t->getAs<PointerType>()){
+        dims.push_back(0);
+        t = PT->getPointeeType();
+      }
+      else {
+        if (writeASE.count(a)) reasons.push_back("writes " + na.text + " through an index it cannot follow");
+        return true;
+      }
+    }
+    na.elem = t->isIncompleteType() ? 1 : Ctx.getTypeSizeInChars(t).getQuantity();
+    na.strideOuter = na.strideInner = 0;
+    na.write = writeASE.count(a);
+    int dimOuter = -1, dimInner = -1;
+    for (unsigned d = 0; d < idx.size(); d++){
+      if (dimOuter < 0 && LoopIndex(idx[d], outer)) dimOuter = d;
+      else if (dimInner < 0 && LoopIndex(idx[d], inner)) dimInner = d;
+    }
+    na.ownIndex = dimOuter >= 0 && dimInner >= 0;
+    for (unsigned d = 0; d < idx.size(); d++){
+      long stride = na.elem;
+      for (unsigned k = d + 1; k < dims.size(); k++)
+        stride *= dims[k] ? dims[k] : 1024;                    // unknown extent: assume a long row
+      if (ExprRefs(idx[d], outer)) na.strideOuter += stride;
+      if (ExprRefs(idx[d], inner)) na.strideInner += stride;
+      na.idx.push_back(SrcText(SM, LO, idx[d]->getSourceRange()));
+    }
+    acc.push_back(na);
+    return true;
+  }
+
+  // Legal - every element of a written array is touched by one (outer, inner) pair only
+  bool Legal() {
+    for (std::set<const VarDecl*>::iterator it = summed.begin(); it != summed.end(); ++it)
+      if (readPlain.count(*it))
+        reasons.push_back((*it)->getNameAsString() + " is read while it is being summed");
+    for (unsigned i = 0; i < acc.size(); i++){
+      if (!written.count(acc[i].base)) continue;
+      if (acc[i].write && !acc[i].ownIndex){
+        reasons.push_back(acc[i].text + " is not indexed by " + outer->getNameAsString() + " and " + inner->getNameAsString() + " in separate dimensions");
+        return false;
+      }
+      for (unsigned j = 0; j < acc.size(); j++){
+        if (acc[j].base != acc[i].base) continue;
+        if (acc[j].idx != acc[i].idx){
+          reasons.push_back(acc[i].text + " and " + acc[j].text + " may depend across iterations");
+          return false;
+        }
+      }
+      if (acc[i].base->getType()->isPointerType() && !acc[i].base->getType().isRestrictQualified())
+        for (unsigned j = 0; j < acc.size(); j++)
+          if (acc[j].base != acc[i].base){
+            reasons.push_back(acc[i].base->getNameAsString() + " may alias " + acc[j].base->getNameAsString() + ", declare it restrict");
+            return false;
+          }
+    }
+    return reasons.empty();
+  }
+};
+
+// UsedAfter - is v named in body after loc
+bool UsedAfter(SourceManager &SM, Stmt *body, const VarDecl *v, SourceLocation loc)
+{
+  if (body == NULL) return true;
+  if (DeclRefExpr *d = dyn_cast<DeclRefExpr>(body))
+    if (d->getDecl() == v && SM.isBeforeInTranslationUnit(loc, d->getBeginLoc())) return true;
+  for (Stmt::child_iterator I = body->child_begin(), E = body->child_end(); I != E; ++I)
+    if (*I && UsedAfter(SM, *I, v, loc)) return true;
+  return false;
+}
+
+// NestLoop - -interchange/-tile: swap or tile a perfect nest of two counted loops
+void MyRecursiveASTVisitor::NestLoop(ForStmt *F1)
+{
+  SourceManager& sr = Rewrite.getSourceMgr();
+  const LangOptions &LO = Rewrite.getLangOpts();
+  SourceLocation ST = F1->getBeginLoc();
+  if (ST.isMacroID() || !sr.isInMainFile(ST)) return;
+  if (nest_end.isValid() && sr.isBeforeInTranslationUnit(ST, nest_end)) return;
+
+  // perfect nest: the body is the inner for and nothing else
+  Stmt *b = F1->getBody();
+  if (CompoundStmt *CS = dyn_cast<CompoundStmt>(b))
+    b = CS->size() == 1 ? CS->body_front() : NULL;
+  ForStmt *F2 = dyn_cast_or_null<ForStmt>(b);
+  if (F2 == NULL) return;
+
+  std::string where = BranchKey(sr, ST), why;
+  bool out1, out2;
+  const VarDecl *i = CanonicalLoop(F1, why, out1);
+  const VarDecl *j = i ? CanonicalLoop(F2, why, out2) : NULL;
+  if (j == NULL){
+    llvm::errs() << "nest: " << where << " rejected: " << why << "\n";
+    return;
+  }
+  NestChecker nc(sr, LO, i, j);
+  if (ExprRefs(F2->getInit(), i) || ExprRefs(F2->getCond(), i) || ExprRefs(F2->getInc(), i))
+    nc.reasons.push_back("inner bounds depend on " + i->getNameAsString());
+  if ((out1 && UsedAfter(sr, nest_body, i, F1->getEndLoc())) || (out2 && UsedAfter(sr, nest_body, j, F1->getEndLoc())))
+    nc.reasons.push_back("a loop variable is used after the nest");
+  nc.discarded.insert(F2->getBody());
+  nc.TraverseStmt(F2->getBody());
+  if (!nc.Legal()){
+    llvm::errs() << "nest: " << where << " rejected:";
+    for (unsigned k = 0; k < nc.reasons.size(); k++)
+      llvm::errs() << (k ? ";" : "") << " " << nc.reasons[k];
+    llvm::errs() << "\n";
+    return;
+  }
+
+  long before = 0, after = 0;
+  int badBefore = 0, badAfter = 0;
+  llvm::errs() << "nest: " << where << " bytes per inner step:";
+  for (unsigned k = 0; k < nc.acc.size(); k++){
+    before += nc.acc[k].strideInner;
+    after += nc.acc[k].strideOuter;
+    if (nc.acc[k].strideInner > nc.acc[k].elem) badBefore++;
+    if (nc.acc[k].strideOuter > nc.acc[k].elem) badAfter++;
+    llvm::errs() << " " << nc.acc[k].text << " " << nc.acc[k].strideInner << "->" << nc.acc[k].strideOuter;
+  }
+  llvm::errs() << "; total " << before << " now, " << after << " interchanged\n";
+
+  bool swap = after < before;
+  int bad = swap ? badAfter : badBefore;
+  if (!swap && (nest_tile == 0 || bad == 0)){
+    llvm::errs() << "nest: " << where << " kept\n";
+    return;
+  }
+  ForStmt *P = swap ? F2 : F1, *Q = swap ? F1 : F2;            // new outer and inner loop
+  SourceRange H1(F1->getForLoc(), F1->getRParenLoc()), H2(F2->getForLoc(), F2->getRParenLoc());
+  std::string h1 = SrcText(sr, LO, SourceRange(P->getForLoc(), P->getRParenLoc()));
+  std::string h2 = SrcText(sr, LO, SourceRange(Q->getForLoc(), Q->getRParenLoc()));
+
+  loopHdr hp, hq;
+  if (nest_tile > 0 && bad > 0 &&
+      UnitLoop(P, swap ? j : i, sr, LO, hp) && UnitLoop(Q, swap ? i : j, sr, LO, hq)){
+    char tp[32], tq[32], n[16];
+    sprintf(tp, "__lc_t%d_%s", nest_id, hp.name.c_str());
+    sprintf(tq, "__lc_t%d_%s", nest_id, hq.name.c_str());
+    sprintf(n, "%d", nest_tile);
+    h1 = std::string("for (long ") + tp + " = (" + hp.lb + "); " + tp + " " + hp.op + " (" + hp.ub + "); " + tp + " += " + n + ")\n"
+       + "for (long " + tq + " = (" + hq.lb + "); " + tq + " " + hq.op + " (" + hq.ub + "); " + tq + " += " + n + ")\n"
+       + "for (" + hp.decl + hp.name + " = " + tp + "; " + hp.name + " " + hp.op + " (" + hp.ub + ") && "
+       + hp.name + " < " + tp + " + " + n + "; " + hp.name + "++)";
+    h2 = "for (" + hq.decl + hq.name + " = " + tq + "; " + hq.name + " " + hq.op + " (" + hq.ub + ") && "
+       + hq.name + " < " + tq + " + " + n + "; " + hq.name + "++)";
+    llvm::errs() << "nest: " << where << (swap ? " interchanged and" : "") << " tiled by " << nest_tile << "\n";
+  }
+  else if (swap)
+    llvm::errs() << "nest: " << where << " interchanged\n";
+  else{
+    llvm::errs() << "nest: " << where << " kept, only i++/< loops are tiled\n";
+    return;
+  }
+  Rewrite.ReplaceText(H1, h1);
+  Rewrite.ReplaceText(H2, h2);
+  nest_end = F1->getEndLoc();
+  nest_id++;
+}
+
+// functions that only read memory, hoisted out of a condition when the loop writes no memory
+const char *hoistPureFuncs[] = {"strlen","strcmp","strncmp","strchr","strrchr","strstr","strspn",
+  "strcspn","memcmp","memchr","wcslen",NULL};
+
+// HoistKind - 2: result depends on the arguments only, 1: also reads memory, 0: not hoistable
+int HoistKind(const CallExpr *c)
+{
+  const FunctionDecl *fd = c->getDirectCallee();
+  if (fd == NULL) return 0;
+  std::string name = fd->getNameAsString();
+  if (fd->hasAttr<ConstAttr>()) return 2;
+  for (int i = 0; ompPureFuncs[i]; i++)
+    if (name == ompPureFuncs[i]) return 2;
+  if (fd->hasAttr<PureAttr>()) return 1;
+  for (int i = 0; hoistPureFuncs[i]; i++)
+    if (name == hoistPureFuncs[i]) return 1;
+  return 0;
+}
+
+// LoopWrites - what a loop may change: variables, memory, or anything (opaque calls)
+class LoopWrites : public RecursiveASTVisitor<LoopWrites>
+{
+ public:
+  std::set<const VarDecl*> vars;
+  bool memory = false;
+  bool opaque = false;
+  std::vector<CallExpr*> calls;
+
+  void Write(Expr *e){
+    if (const VarDecl *v = RefVar(e)) vars.insert(v);
+    else memory = true;
+  }
+  bool VisitUnaryOperator(UnaryOperator *u){
+    if (u->isIncrementDecrementOp() || u->getOpcode() == UO_AddrOf) Write(u->getSubExpr());
+    return true;
+  }
+  bool VisitBinaryOperator(BinaryOperator *b){
+    if (b->isAssignmentOp()) Write(b->getLHS());
+    return true;
+  }
+  bool VisitCallExpr(CallExpr *c){
+    calls.push_back(c);
+    if (!HoistKind(c)) opaque = true;
+    return true;
+  }
+};
+
+// Invariant - arguments the loop does not change, none of them declared inside it or read from memory it writes
+bool Invariant(const Stmt *e, const LoopWrites &lw, SourceManager &SM, SourceRange loop)
+{
+  if (e == NULL) return true;
+  if (isa<CallExpr>(e) || isa<StmtExpr>(e)) return false;
+  if (const UnaryOperator *u = dyn_cast<UnaryOperator>(e))
+    if (u->isIncrementDecrementOp()) return false;
+  if (const BinaryOperator *b = dyn_cast<BinaryOperator>(e))
+    if (b->isAssignmentOp()) return false;
+  // a[0], *p, s.x: memory the loop may store to
+  if (lw.memory || lw.opaque){
+    if (isa<ArraySubscriptExpr>(e) || isa<MemberExpr>(e)) return false;
+    if (const UnaryOperator *u = dyn_cast<UnaryOperator>(e))
+      if (u->getOpcode() == UO_Deref) return false;
+  }
+  if (const DeclRefExpr *d = dyn_cast<DeclRefExpr>(e))
+    if (const VarDecl *v = dyn_cast<VarDecl>(d->getDecl())){
+      if (lw.vars.count(v)) return false;
+      if (lw.opaque && v->hasGlobalStorage()) return false;
+      if (!SM.isBeforeInTranslationUnit(v->getLocation(), loop.getBegin()) &&
+          SM.isBeforeInTranslationUnit(v->getLocation(), loop.getEnd())) return false;
+    }
+  for (Stmt::const_child_iterator I = e->child_begin(), E = e->child_end(); I != E; ++I)
+    if (!Invariant(*I, lw, SM, loop)) return false;
+  return true;
+}
+
+// UnconditionalCalls - the calls of a condition that run every time it is evaluated: not on the
+// right of && and ||, not in an arm of ?:
+void UnconditionalCalls(const Stmt *e, std::set<const CallExpr*> &out)
+{
+  if (e == NULL) return;
+  if (const BinaryOperator *b = dyn_cast<BinaryOperator>(e))
+    if (b->getOpcode() == BO_LAnd || b->getOpcode() == BO_LOr){
+      UnconditionalCalls(b->getLHS(), out);
+      return;
+    }
+  if (const AbstractConditionalOperator *c = dyn_cast<AbstractConditionalOperator>(e)){
+    UnconditionalCalls(c->getCond(), out);
+    return;
+  }
+  if (isa<StmtExpr>(e)) return;
+  if (const CallExpr *c = dyn_cast<CallExpr>(e)) out.insert(c);
+  for (Stmt::const_child_iterator I = e->child_begin(), E = e->child_end(); I != E; ++I)
+    UnconditionalCalls(*I, out);
+}
+
+// CannotFault - an argument that is safe to evaluate where the code would not have: no memory
+// read (p[0], *p, p->f) and no integer division
+bool CannotFault(const Stmt *e)
+{
+  if (e == NULL) return true;
+  if (isa<ArraySubscriptExpr>(e)) return false;
+  if (const MemberExpr *m = dyn_cast<MemberExpr>(e))
+    if (m->isArrow()) return false;
+  if (const UnaryOperator *u = dyn_cast<UnaryOperator>(e))
+    if (u->getOpcode() == UO_Deref) return false;
+  if (const BinaryOperator *b = dyn_cast<BinaryOperator>(e))
+    if ((b->getOpcode() == BO_Div || b->getOpcode() == BO_Rem) && b->getType()->isIntegerType()) return false;
+  for (Stmt::const_child_iterator I = e->child_begin(), E = e->child_end(); I != E; ++I)
+    if (!CannotFault(*I)) return false;
+  return true;
+}
+
+// HoistCalls - -hoist: {T __lc_hN = call; loop} for invariant const/pure calls of a for/while loop
+// pure calls (they read memory) only come from the part of the condition that runs every time,
+// and the condition runs at least once; a const call anywhere else is hoisted only if its
+// arguments cannot fault, as the loop may have skipped it: while (p && i < strlen(p)),
+// if (p) y += sqrt(p[0])
+void MyRecursiveASTVisitor::HoistCalls(Stmt *loop)
+{
+  SourceManager& sr = Rewrite.getSourceMgr();
+  const LangOptions &LO = Rewrite.getLangOpts();
+  Expr *cond;
+  Stmt *body;
+  if (ForStmt *F = dyn_cast<ForStmt>(loop)) { cond = F->getCond(); body = F->getBody(); }
+  else if (WhileStmt *W = dyn_cast<WhileStmt>(loop)) { cond = W->getCond(); body = W->getBody(); }
+  else return;
+  SourceLocation ST = loop->getBeginLoc();
+  if (ST.isMacroID() || body->getEndLoc().isMacroID() || !sr.isInMainFile(ST)) return;
+
+  LoopWrites lw;
+  lw.TraverseStmt(loop);
+  std::set<const CallExpr*> condCalls;
+  UnconditionalCalls(cond, condCalls);
+
+  std::map<std::string,std::string> temps;                     // call text -> local
+  std::string decls;
+  for (unsigned i = 0; i < lw.calls.size(); i++){
+    CallExpr *c = lw.calls[i];
+    if (hoisted_calls.count(c) || c->getBeginLoc().isMacroID() || c->getEndLoc().isMacroID()) continue;
+    int kind = HoistKind(c);
+    if (kind == 0 || c->getType()->isVoidType()) continue;
+    if (kind == 1 && (!condCalls.count(c) || lw.memory || lw.opaque)) continue;
+    if (!condCalls.count(c) && !CannotFault(c)) continue;
+    bool inv = true;
+    for (unsigned a = 0; a < c->getNumArgs() && inv; a++)
+      inv = Invariant(c->getArg(a), lw, sr, loop->getSourceRange());
+    if (!inv) continue;
+
+    std::string text = SrcText(sr, LO, c->getSourceRange());
+    if (!temps.count(text)){
+      char name[32];
+      sprintf(name, "__lc_h%d", hoist_next++);
+      temps[text] = name;
+      decls += c->getType().getAsString() + " " + name + " = " + text + "; ";
+      llvm::errs() << "hoist: " << BranchKey(sr, c->getBeginLoc()) << " " << text << "\n";
+    }
+    Rewrite.ReplaceText(c->getSourceRange(), temps[text]);
+    hoisted_calls.insert(c);
+    hoist_count++;
+  }
+  if (decls.empty()) return;
+  // before anything else at the loop start, closed after everything at its end
+  Rewrite.InsertText(ST, "{" + decls, false);
+  Rewrite.InsertText(LoopEnd(Rewrite, body), "}", true);
+}
+
+// ProbeCounter - probes VisitStmt/VisitFunctionDecl would put into a body
+class ProbeCounter : public RecursiveASTVisitor<ProbeCounter>
+{
+ public:
+  int probes = 2;                                              // start and end of the function
+  int decls = 0, returns = 0;
+  bool VisitStmt(Stmt *s){
+    // the same cases as MyRecursiveASTVisitor::VisitStmt
+    if (isa<DeclStmt>(s))
+      decls++;                                                 // AddrDisinfect's guard variable
+    else if (IfStmt *If = dyn_cast<IfStmt>(s))
+      probes += If->getElse() && !isa<IfStmt>(If->getElse()) ? 2 : 1;  // an else if is probed as its own if
+    else if (isa<WhileStmt>(s) || isa<ForStmt>(s) || isa<CaseStmt>(s) || isa<DefaultStmt>(s))
+      probes++;
+    else if (isa<CallExpr>(s) && cgmode)
+      probes++;
+    else if (isa<ReturnStmt>(s)){
+      probes++;
+      returns++;
+    }
+    const char *kind;
+    if (brmode && BranchCond(s, &kind))
+      probes++;
+    if (loopmode && (isa<WhileStmt>(s) || isa<ForStmt>(s)))
+      probes++;
+    return true;
+  }
+  // Count - probes of a body: each guard variable is checked again at every exit
+  int Count(Stmt *body){
+    TraverseStmt(body);
+    CompoundStmt *cs = dyn_cast<CompoundStmt>(body);
+    int exits = returns + (cs && !cs->body_empty() && isa<ReturnStmt>(cs->body_back()) ? 0 : 1);
+    return probes + decls * (1 + exits);
+  }
+};
+
+// TraverseFunctionDecl - with -entry, leave unreachable functions untouched
+bool MyRecursiveASTVisitor::TraverseFunctionDecl(FunctionDecl *f)
+{
+  if (!entry_funcs.empty() && f->hasBody() &&
+      !reach_funcs.count(f->getCanonicalDecl()))
+  {
+    if (f->doesThisDeclarationHaveABody()){
+      ProbeCounter pc;
+      funcs_skipped++;
+      probes_skipped += pc.Count(f->getBody());
+      llvm::errs() << "Skip unreachable function " << f->getNameAsString() << "\n";
+    }
+    return true;
+  }
+  return RecursiveASTVisitor<MyRecursiveASTVisitor>::TraverseFunctionDecl(f);
+}
+
+// Stmt Instrument
+void MyRecursiveASTVisitor::InstrumentStmt(Stmt *s, int flag)
+{
+  char temp[256]={0};
+  std::ifstream infile("loopconvert.txt");
+  infile>>pos;
+  pos++;
+  infile.close();
+  char char_pos[15]={0}; 
+  sprintf(char_pos,"%d",pos%100000);
+  SourceLocation STT = s->getBeginLoc();
+
+  llvm::errs()<<STT.getRawEncoding()<<"\n";
+  if(STT.getRawEncoding()==0)
+  {
+    llvm::errs()<<"LocStart == 0, ret\n";
+    return;
+  }
+
+  if(STT.isMacroID())
+  {
+  	llvm::errs() << "isMacroID exists, but what's this\n";
+  }
+
+  
+  // Only perform if statement is not compound
+  if (flag==2){
+    SourceLocation ST = s->getBeginLoc();
+    SourceLocation ENDD = s->getEndLoc();
+    SourceManager& sr = Rewrite.getSourceMgr();
+    int offset = Lexer::MeasureTokenLength(ST,
+                                           Rewrite.getSourceMgr(),
+                                           Rewrite.getLangOpts()) + 1;
+    int STgre = ST.getRawEncoding();
+    const char *endCharPtr2 = sr.getCharacterData(ST);
+    int stroffset = 0;
+    int i=0,j=0;
+   
+    char getstrData[100];//all the line
+    char getvarName[100];//var name
+
+    while(endCharPtr2[stroffset]!=':'){
+    	stroffset++;
+    	if (stroffset>80) {
+    		llvm::errs() << "too long switchcase;default"<<"\n";
+    		break;
+    	}
+    }
+    stroffset++;
+    SourceLocation ST1 = ST.getLocWithOffset(stroffset);
+    sprintf(temp,"\nblocks[%d] = '1';%s//%d %d!\n",pos%100000,BlockTrace(pos%100000).c_str(),ST,ENDD);
+    Rewrite.InsertText(ST1, temp, true, true);
+  }
+  else if(flag==1)
+  {
+    // sprintf(temp,"\n  int seq_out_byte = %s/8;\
+                \n  int seq_in_byte =1<<(%s%8);\
+                \n  blocks[seq_out_byte]=blocks[seq_out_byte]|seq_in_byte;\n",char_pos,char_pos);
+    
+    SourceLocation ST = s->getBeginLoc();
+    SourceLocation ENDD = s->getEndLoc();
+
+    sprintf(temp,"\nblocks[%d] = '1';%s//%d %d!\n",pos%100000,BlockTrace(pos%100000).c_str(),ST,ENDD);
+    llvm::errs() << "Found SwitchStmt!!! \n";
+    // Insert opening brace.  Note the second true parameter to InsertText()
+    // says to indent.  Sadly, it will indent to the line after the if, giving:
+    // if (expr)
+    //   {
+    //   stmt;
+    //   }
+    
+    Rewrite.InsertText(ST, temp, true, true); 
+  }
+  else if (!isa<CompoundStmt>(s))
+  {
+    // sprintf(temp,"{\n  int seq_out_byte = %s/8;\
+                \n  int seq_in_byte =1<<(%s%8);\
+                \n  blocks[seq_out_byte]=blocks[seq_out_byte]|seq_in_byte;\n",char_pos,char_pos);
+    SourceLocation ST = s->getBeginLoc();
+    SourceLocation ENDD = s->getEndLoc();
+    sprintf(temp,"{\nblocks[%d] = '1';%s//%d %d@\n",pos%100000,BlockTrace(pos%100000).c_str(),ST,ENDD);
+    llvm::errs() << "Found not CompoundStmt!!! \n";
+    
+
+    // Insert opening brace.  Note the second true parameter to InsertText()
+    // says to indent.  Sadly, it will indent to the line after the if, giving:
+    // if (expr)
+    //   {
+    //   stmt;
+    //   }
+    
+    Rewrite.InsertText(ST, temp, true, true);
+
+    // Note Stmt::getEndLoc() returns the source location prior to the
+    // token at the end of the line.  For instance, for:
+    // var = 123;
+    //      ^---- getEndLoc() points here.
+
+    SourceLocation END = s->getEndLoc();
+    SourceManager& sr = Rewrite.getSourceMgr();
+
+    // const char *endCharPtr = sr.getCharacterData(END);
+    // 	Lexer::MeasureTokenLength();
+    // MeasureTokenLength gets us past the last token, and adding 1 gets
+    // us past the ';'.
+    int offset = Lexer::MeasureTokenLength(END,
+                                           Rewrite.getSourceMgr(),
+                                           Rewrite.getLangOpts()) + 1;
+
+    SourceLocation END1 = END.getLocWithOffset(offset);
+    if(END1.getRawEncoding()-ST.getRawEncoding()>1000)
+    {
+	    const char *endCharPtr2 = sr.getCharacterData(ST);
+    	size_t offsentSemicolon = 0;
+    	while(endCharPtr2[offsentSemicolon++]!=';');
+		END1 = ST.getLocWithOffset(offsentSemicolon);
+	}
+
+    llvm::errs()<<"CompoundStmt LocEnd "<<END1.getRawEncoding()<<"\n";
+
+    // in front of what is already there: the "}" of an enclosing unbraced statement that ends
+    // here too, and the text LoopProbe puts after its own body
+    Rewrite.InsertText(END1, "\n}", false, true);
+  }
+  else{
+    // sprintf(temp,"\n  int seq_out_byte = %s/8;\n  int seq_in_byte =1<<(%s%8);\n  blocks[seq_out_byte]=blocks[eq_out_byte]|seq_in_bye;\n",char_pos,char_pos);
+    SourceLocation ENDD = s->getEndLoc();
+    SourceLocation ST = ((CompoundStmt *)s)->getLBracLoc().getLocWithOffset(1);
+    sprintf(temp,"\nblocks[%d] = '1';%s//%d %d#\n",pos%100000,BlockTrace(pos%100000).c_str(),ST,ENDD);
+    llvm::errs() << "Found CompoundStmt \n";
+    
+    Rewrite.InsertText(ST, temp, true, true);
+    /*
+    SourceLocation END = s->getEndLoc();
+    int offset = Lexer::MeasureTokenLength(END,
+        z                                   Rewrite.getSourceMgr(),
+                                           Rewrite.getLangOpts()) + 1;
+
+    SourceLocation END1 = END.getLocWithOffset(offset);
+    Rewrite.InsertText(END1, "\n}", true, true);
+    */
+  }
+
+  // Also note getEndLoc() on a CompoundStmt points ahead of the '}'.
+  // Use getEndLoc().getLocWithOffset(1) to point past it.
+  //end of function ,blockpos write back
+  std::ofstream outfile("loopconvert.txt");
+  outfile<<pos<<" "<<pos_gen;
+  outfile.close();
+}
+
+// Override Statements which includes expressions and more
+bool MyRecursiveASTVisitor::VisitStmt(Stmt *s){
+  int flag = 0;
+  llvm::errs() << "Stmt Name :: " << s->getStmtClassName()<<"\n";
+  stmtsum++;
+  if (rewriteonly){
+    if (brhint) BranchHint(s);
+    if (loophint) LoopHint(s);
+    if (ompmode && isa<ForStmt>(s)) OmpLoop(cast<ForStmt>(s));
+    if (nestmode && isa<ForStmt>(s)) NestLoop(cast<ForStmt>(s));
+    if (hoistmode) HoistCalls(s);
+    return true;
+  }
+  if (brmode) BranchProbe(s);
+  //llvm::errs() << "0000\n";
+  if(isa<DeclStmt>(s))
+  {
+    stack++;  
+    llvm::errs() << "DeclStmt Found------------- \n";
+    AddrDisinfect(s);
+  } 
+  else if (isa<IfStmt>(s))
+  {
+    llvm::errs() << "Found if\n";
+    if (isa<CallExpr>(s)) llvm::errs() << "Found if&call\n";
+    // Cast s to IfStmt to access the then and else clauses
+    IfStmt *If = cast<IfStmt>(s);
+    Stmt *TH = If->getThen();
+
+    // Add braces if needed to then clause
+    //InstrumentStmt(TH,flag);// if has else if ,broken
+    Stmt *EL = If->getElse();
+    if (EL)
+    {
+      llvm::errs() << "Found else\n"; 
+      
+
+      if(!isa<IfStmt>(EL))
+      {
+        llvm::errs() << "found if in else\n";
+        InstrumentStmt(TH,flag);
+        InstrumentStmt(EL,flag);
+	      //VisitThinPath(TH,3);
+        //VisitThinPath(EL,4);
+      }
+      else
+      {
+          InstrumentStmt(TH,flag);
+          //VisitThinPath(TH,2);
+      }
+      // Add braces if needed to else clause
+    }
+    else{
+    	//VisitThinPath(TH,2);
+    	InstrumentStmt(TH,flag);
+    }
+  }
+  else
+  if (isa<WhileStmt>(s))
+  {
+    llvm::errs() << "Found while\n";
+    WhileStmt *While = cast<WhileStmt>(s);
+    Stmt *BODY = While->getBody();
+    if (loopmode) LoopProbe(s,BODY);
+    else InstrumentStmt(BODY,flag);
+    if (hoistmode) HoistCalls(s);
+    //VisitThinPath(BODY,5);
+  }
+  else
+  if (isa<ForStmt>(s))
+  {
+    llvm::errs() << "Found for\n";
+
+    ForStmt *For = cast<ForStmt>(s);
+    Stmt *BODY = For->getBody();
+    if (loopmode) LoopProbe(s,BODY);
+    else InstrumentStmt(BODY,flag);
+    if (hoistmode) HoistCalls(s);
+    //VisitThinPath(BODY,5);
+  }
+  else if(isa<CaseStmt>(s))
+  {
+      llvm::errs() << "Found CaseStmt\n";
+      InstrumentStmt(s,2);
+  }
+  else if(isa<DefaultStmt>(s))
+  {
+      llvm::errs() << "Found DefaultStmt\n";
+      InstrumentStmt(s,2);
+
+  }
+  else if (isa<CallExpr>(s))
+  {
+  	llvm::errs() << "Found Call\n";
+  	GetFuncCallGraph(s);
+  	if (cgmode) CallEdgeProbe(cast<CallExpr>(s));
+  }
+  else if (isa<ReturnStmt>(s)){
+  	llvm::errs() << "Found Return\n";
+  	SourceLocation ST = s->getBeginLoc();
+    SourceManager& sr = Rewrite.getSourceMgr();
+    int offset = Lexer::MeasureTokenLength(ST,
+                                           Rewrite.getSourceMgr(),
+                                           Rewrite.getLangOpts()) + 1;
+    std::string ss = FuncProbe(0,func_name[func_now]) + "\t";
+    // -profile/-trace: return expr; -> { T __lc_ret = expr; <exit probe> return __lc_ret; }, so
+    // the calls in expr still run inside this function's frame; the other modes keep the probe
+    // in front of the return
+    ReturnStmt *r = cast<ReturnStmt>(s);
+    Expr *rv = r->getRetValue();
+    SourceLocation SEMI = (profmode || tracemode) && rv && !ST.isMacroID() && !s->getEndLoc().isMacroID()
+      ? Lexer::findLocationAfterToken(s->getEndLoc(), tok::semi, sr, Rewrite.getLangOpts(), false)
+      : SourceLocation();
+    if (SEMI.isValid() && cur_func){
+      QualType rt = cur_func->getReturnType();
+      std::string decl;
+      llvm::raw_string_ostream os(decl);
+      if (rt->isVoidType())
+        os << "{ ";
+      else{
+        os << "{ ";
+        rt.print(os, PrintingPolicy(Rewrite.getLangOpts()), "__lc_ret");
+        os << " = ";
+      }
+      os.flush();
+      BinaryOperator *comma = dyn_cast<BinaryOperator>(rv->IgnoreImplicit());
+      if (comma && comma->getOpcode() == BO_Comma){
+        decl += "(";
+        Rewrite.InsertText(s->getEndLoc().getLocWithOffset(Lexer::MeasureTokenLength(s->getEndLoc(), sr, Rewrite.getLangOpts())), ")", true);
+      }
+      Rewrite.ReplaceText(ST, 6, decl);
+      // before the "}" InstrumentStmt already put after an unbraced "if (c) return x;"
+      Rewrite.InsertText(SEMI, std::string(checkleak) + ss + (rt->isVoidType() ? "return; }" : "return __lc_ret; }"), false, true);
+    }
+    else{
+      Rewrite.InsertText(ST,checkleak,true,true);
+      Rewrite.InsertText(ST,ss,true,true);
+    }
+
+  }
+  //llvm::errs() << "Found Null\n";
+  return true; // returning false aborts the traversal
+}
+
+bool MyRecursiveASTVisitor::VisitFunctionDecl(FunctionDecl *f)
+{
+  if (rewriteonly){
+    if (f->doesThisDeclarationHaveABody()) nest_body = f->getBody();
+    return true;
+  }
+  if (f->hasBody())
   {
+  	cur_func = f;
   	llvm::errs() << "Found function " << (f->getNameInfo()).getName().getAsString()<<"\n";
   	llvm::errs() <<"stmtsum: "<<stmtsum<<'\n';
   	if (out.is_open()) out<<" \nA Func "<<(f->getNameInfo()).getName().getAsString(); 
   	if (func_blocks.is_open()) {
-  		if (pos>=0) func_blocks<<pos%100000<<"\n";
+  		// close the previous function's line even if no block was instrumented yet
+  		if (func_gid>=0) func_blocks<<pos%100000<<"\n";
   		func_blocks<<(f->getNameInfo()).getName().getAsString()<<" ";
   	}
+  	func_gid = func_gid<0 ? func_gid_base : func_gid+1;
+  	func_gids.push_back(std::make_pair(func_gid,f->getNameAsString()));
     SourceRange sr = f->getSourceRange();
     Stmt *s = f->getBody();
     int i=0;
@@ -789,15 +2199,12 @@ bool MyRecursiveASTVisitor::VisitFunctionDecl(FunctionDecl *f)
 	  */
       // Add 
       SourceLocation INIT = s->getBeginLoc().getLocWithOffset(1);
-      char temp[256]={0};
-      sprintf(temp,"\n\tprint2(\"%s start,\");\n",Funcname);
-      Rewrite.InsertText(INIT, temp, true, true);
+      Rewrite.InsertText(INIT, FuncProbe(1,Funcname), true, true);
 
       // Add 
       SourceLocation END = s->getEndLoc();
       FuncEND1 = END;
-      char temp2[1000]={0};
-      sprintf(temp2,"\n\tprint2(\"%s end,\");\n\t%s\n",Funcname,checkleak);
+      std::string temp2 = FuncProbe(0,Funcname) + "\t" + checkleak + "\n";
       Rewrite.InsertText(END, temp2, true, true);
        
     
@@ -833,6 +2240,454 @@ bool MyRecursiveASTVisitor::VisitFunctionDecl(FunctionDecl *f)
 
 
 
+
+// byte I/O and copy functions: a struct passed to them is seen as bytes in its current order
+const char *layoutByteFuncs[] = {"fwrite","fread","write","read","pwrite","pread","send","recv",
+  "sendto","recvfrom","memcpy","memmove","memcmp","memccpy","bcopy",NULL};
+
+// PointeeRecord - the struct a pointer or array type holds, NULL for anything else
+const RecordDecl *PointeeRecord(QualType t)
+{
+  if (const PointerType *PT = t->getAs<PointerType>()) t = PT->getPointeeType();
+  else if (const ArrayType *AT = t->getAsArrayTypeUnsafe()) t = AT->getElementType();
+  else return NULL;
+  const RecordType *rt = t->getAs<RecordType>();
+  return rt ? rt->getDecl()->getCanonicalDecl() : NULL;
+}
+
+// LayoutScan - struct definitions of the main file, positional initializers, structs seen
+// through another pointer type or as bytes and, with a loop profile, how often each field
+// is touched: iterations of the innermost profiled loop around it
+class LayoutScan : public RecursiveASTVisitor<LayoutScan>
+{
+ public:
+  LayoutScan(SourceManager &S) : SM(S) { weight.push_back(1); }
+  SourceManager &SM;
+  std::vector<RecordDecl*> records;
+  std::set<const RecordDecl*> positional;                      // {1,2,3} depends on the field order
+  std::map<const RecordDecl*,std::string> byteView;            // canonical decl -> why its bytes are seen
+  std::map<const FieldDecl*,unsigned long long> uses;
+  std::vector<unsigned long long> weight;
+
+  bool VisitRecordDecl(RecordDecl *rd){
+    if (rd->isCompleteDefinition() && !rd->isUnion() && !rd->isInvalidDecl() && !rd->isDependentType()
+        && !rd->getBeginLoc().isMacroID() && SM.isInMainFile(rd->getBeginLoc()))
+      records.push_back(rd);
+    return true;
+  }
+  bool VisitInitListExpr(InitListExpr *ile){
+    const RecordType *rt = ile->getType()->getAs<RecordType>();
+    if (rt == NULL) return true;
+    InitListExpr *syn = ile->isSemanticForm() && ile->getSyntacticForm() ? ile->getSyntacticForm() : ile;
+    // {0} zeroes every field whatever the order
+    if (syn->getNumInits() == 1)
+      if (IntegerLiteral *lit = dyn_cast<IntegerLiteral>(syn->getInit(0)->IgnoreParenImpCasts()))
+        if (lit->getValue() == 0) return true;
+    for (unsigned i = 0; i < syn->getNumInits(); i++)
+      if (!isa<DesignatedInitExpr>(syn->getInit(i))){
+        positional.insert(rt->getDecl());
+        break;
+      }
+    return true;
+  }
+  void ByteView(const RecordDecl *rd, SourceLocation loc, const std::string &why){
+    if (rd && !byteView.count(rd))
+      byteView[rd] = BranchKey(SM, loc) + " " + why;
+  }
+  // (char *)p, (struct base *)&d, (struct hdr *)buf: the fields are found by offset
+  bool VisitCastExpr(CastExpr *ce){
+    QualType from = ce->getSubExpr()->IgnoreParenCasts()->getType(), to = ce->getType();
+    if (from->isArrayType()) from = from->getAsArrayTypeUnsafe()->getElementType();
+    else if (from->isPointerType()) from = from->getPointeeType();
+    else return true;
+    if (!to->isPointerType()) return true;
+    const RecordDecl *rt = PointeeRecord(to), *rf = NULL;
+    if (const RecordType *r = from->getAs<RecordType>()) rf = r->getDecl()->getCanonicalDecl();
+    if (rf == rt) return true;
+    if (rf && !to->getPointeeType()->isVoidType())
+      ByteView(rf, ce->getBeginLoc(), "converts it to " + to.getAsString());
+    if (rt && !from->isVoidType())
+      ByteView(rt, ce->getBeginLoc(), "converts " + from.getAsString() + " * to it");
+    return true;
+  }
+  bool VisitCallExpr(CallExpr *c){
+    const FunctionDecl *fd = c->getDirectCallee();
+    if (fd == NULL) return true;
+    std::string name = fd->getNameAsString();
+    for (int i = 0; layoutByteFuncs[i]; i++)
+      if (name == layoutByteFuncs[i]){
+        for (unsigned a = 0; a < c->getNumArgs(); a++)
+          ByteView(PointeeRecord(c->getArg(a)->IgnoreParenCasts()->getType()), c->getBeginLoc(),
+                   "passes it to " + name + "()");
+        break;
+      }
+    return true;
+  }
+  bool VisitMemberExpr(MemberExpr *me){
+    if (FieldDecl *fd = dyn_cast<FieldDecl>(me->getMemberDecl()))
+      uses[fd] += weight.back();
+    return true;
+  }
+  void EnterLoop(Stmt *s){
+    unsigned long long w = weight.back();
+    std::map<std::string,int>::iterator it = loop_ids.find(BranchKey(SM, s->getBeginLoc()));
+    if (it != loop_ids.end() && loop_stats.count(it->second))
+      w = loop_stats[it->second].trips;
+    weight.push_back(w);
+  }
+  bool TraverseForStmt(ForStmt *s){
+    EnterLoop(s);
+    bool r = RecursiveASTVisitor<LayoutScan>::TraverseForStmt(s);
+    weight.pop_back();
+    return r;
+  }
+  bool TraverseWhileStmt(WhileStmt *s){
+    EnterLoop(s);
+    bool r = RecursiveASTVisitor<LayoutScan>::TraverseWhileStmt(s);
+    weight.pop_back();
+    return r;
+  }
+  bool TraverseDoStmt(DoStmt *s){
+    EnterLoop(s);
+    bool r = RecursiveASTVisitor<LayoutScan>::TraverseDoStmt(s);
+    weight.pop_back();
+    return r;
+  }
+};
+
+struct layoutField{
+  FieldDecl *fd;
+  uint64_t size, align;                                        // bytes
+  unsigned long long uses;
+  std::string text;                                            // source of the declaration, comments included
+};
+
+bool ByAlign(const layoutField &x, const layoutField &y)
+{
+  return x.align > y.align;
+}
+
+// PackedSize - size of the fields laid out in this order with natural alignment
+uint64_t PackedSize(const std::vector<layoutField> &fs, uint64_t *align)
+{
+  uint64_t off = 0, a = 1;
+  for (unsigned i = 0; i < fs.size(); i++){
+    off = (off + fs[i].align - 1) / fs[i].align * fs[i].align + fs[i].size;
+    if (fs[i].align > a) a = fs[i].align;
+  }
+  *align = a;
+  return (off + a - 1) / a * a;
+}
+
+// FieldTexts - each field's declaration from the end of the previous one to its ';' and a
+// trailing // comment, "" if the fields cannot be moved as text
+std::string FieldTexts(RecordDecl *rd, std::vector<layoutField> &fs, SourceLocation *begin,
+                       SourceLocation *end, SourceManager &SM, const LangOptions &LO)
+{
+  SourceLocation prev = rd->getBraceRange().getBegin().getLocWithOffset(1);
+  *begin = prev;
+  for (unsigned i = 0; i < fs.size(); i++){
+    FieldDecl *fd = fs[i].fd;
+    if (fd->getBeginLoc().isMacroID() || fd->getEndLoc().isMacroID())
+      return "a field comes from a macro";
+    if (SM.isBeforeInTranslationUnit(fd->getBeginLoc(), prev))
+      return "fields declared together";
+    SourceLocation semi = Lexer::findLocationAfterToken(fd->getEndLoc(), tok::semi, SM, LO, false);
+    if (semi.isInvalid())
+      return "no ';' after a field";
+    const char *b = SM.getCharacterData(prev), *e = SM.getCharacterData(semi);
+    const char *c = e;
+    while (*c == ' ' || *c == '\t') c++;
+    if (c[0] == '/' && c[1] == '/')
+      while (*c != '\n' && *c != '\0') c++;
+    else
+      c = e;
+    fs[i].text.assign(b, c);
+    std::istringstream lines(fs[i].text);
+    std::string line;
+    while (std::getline(lines, line)){
+      size_t p = line.find_first_not_of(" \t");
+      if (p != std::string::npos && line[p] == '#')
+        return "preprocessor lines between the fields";
+    }
+    prev = semi.getLocWithOffset(c - e);
+  }
+  *end = prev;
+  return "";
+}
+
+// LayoutRecords - -layout: padding of every struct, the order by alignment and, with a loop
+// profile, the rarely touched fields of hot structs grouped at the end in an anonymous struct
+// (their names stay valid); -layout-apply rewrites the definitions where that is safe
+void LayoutRecords(ASTContext &Ctx, Rewriter &Rewrite, LayoutScan &scan)
+{
+  SourceManager &SM = Ctx.getSourceManager();
+  for (unsigned r = 0; r < scan.records.size(); r++){
+    RecordDecl *rd = scan.records[r];
+    std::string name = rd->getNameAsString();
+    if (name.empty() && rd->getTypedefNameForAnonDecl())
+      name = rd->getTypedefNameForAnonDecl()->getNameAsString();
+    name = std::string(rd->getKindName()) + " " + (name.empty() ? "(anonymous)" : name);
+
+    std::vector<layoutField> fields;
+    const char *why = NULL;
+    uint64_t sum = 0;
+    unsigned long long hottest = 0;
+    for (RecordDecl::field_iterator I = rd->field_begin(), E = rd->field_end(); I != E; ++I){
+      if (I->isBitField()) why = "bit-fields";
+      else if (I->getType()->isIncompleteArrayType()) why = "flexible array member";
+      else if (I->getType()->isDependentType()) why = "dependent type";
+      if (why) break;
+      layoutField f;
+      f.fd = *I;
+      f.size = Ctx.getTypeSizeInChars(I->getType()).getQuantity();
+      f.align = Ctx.getTypeAlignInChars(I->getType()).getQuantity();
+      f.uses = scan.uses.count(*I) ? scan.uses[*I] : 0;
+      if (f.align == 0) f.align = 1;
+      sum += f.size;
+      if (f.uses > hottest) hottest = f.uses;
+      fields.push_back(f);
+    }
+    if (why || fields.size() < 2) continue;
+
+    const ASTRecordLayout &L = Ctx.getASTRecordLayout(rd);
+    uint64_t size = L.getSize().getQuantity();
+    uint64_t recAlign = L.getAlignment().getQuantity();
+
+    // cold fields only for structs a profiled loop touches often; fields this file never
+    // touches may be hot elsewhere and stay where the alignment puts them
+    std::vector<layoutField> hot, cold;
+    for (unsigned i = 0; i < fields.size(); i++){
+      if (!loop_stats.empty() && hottest >= LOOP_MIN_TRIPS && fields[i].uses
+          && fields[i].uses < LAYOUT_COLD * hottest)
+        cold.push_back(fields[i]);
+      else
+        hot.push_back(fields[i]);
+    }
+    if (hot.empty())
+      hot.swap(cold);
+    std::stable_sort(hot.begin(), hot.end(), ByAlign);
+    std::stable_sort(cold.begin(), cold.end(), ByAlign);
+    std::vector<layoutField> order(hot);
+    uint64_t coldAlign = 1;
+    if (!cold.empty()){
+      layoutField sub;
+      sub.fd = NULL;
+      sub.size = PackedSize(cold, &coldAlign);
+      sub.align = coldAlign;
+      sub.uses = 0;
+      order.push_back(sub);
+    }
+    uint64_t newAlign;
+    uint64_t newSize = PackedSize(order, &newAlign);
+    if (recAlign > newAlign) newSize = (newSize + recAlign - 1) / recAlign * recAlign;
+    if (size == sum && cold.empty()) continue;
+
+    layout_records++;
+    llvm::errs() << "layout: " << name << " at " << BranchKey(SM, rd->getBeginLoc()) << ": "
+                 << size << " bytes, " << size - sum << " padding, "
+                 << (size + LAYOUT_LINE - 1) / LAYOUT_LINE << " cache line(s)";
+    if (newSize >= size && cold.empty()){
+      llvm::errs() << ", no better order\n";
+      continue;
+    }
+    llvm::errs() << " -> " << newSize << " bytes, " << (newSize + LAYOUT_LINE - 1) / LAYOUT_LINE
+                 << " cache line(s)\n  order:";
+    for (unsigned i = 0; i < hot.size(); i++)
+      llvm::errs() << " " << hot[i].fd->getNameAsString();
+    if (!cold.empty()){
+      llvm::errs() << "\n  cold:";
+      for (unsigned i = 0; i < cold.size(); i++)
+        llvm::errs() << " " << cold[i].fd->getNameAsString() << "(" << cold[i].uses << ")";
+      llvm::errs() << " of " << hottest << " for the hottest field";
+    }
+    llvm::errs() << "\n";
+    if (layoutmode < 2) continue;
+
+    // -layout-apply: only where the field order is not observable in this file
+    std::string skip;
+    SourceLocation begin, end;
+    if (rd->hasAttrs()) skip = "attributes";
+    else if (isa<RecordDecl>(rd->getDeclContext())) skip = "nested in another struct";
+    else if (CXXRecordDecl *cxx = dyn_cast<CXXRecordDecl>(rd)){
+      if (!cxx->isCLike()) skip = "not a C struct";
+    }
+    if (skip.empty() && scan.positional.count(rd)) skip = "positional initializer";
+    if (skip.empty() && scan.byteView.count(rd->getCanonicalDecl())) skip = scan.byteView[rd->getCanonicalDecl()];
+    if (skip.empty()) skip = FieldTexts(rd, fields, &begin, &end, SM, Rewrite.getLangOpts());
+    if (!skip.empty()){
+      llvm::errs() << "  not applied: " << skip << "\n";
+      continue;
+    }
+    std::map<const FieldDecl*,std::string> texts;
+    for (unsigned i = 0; i < fields.size(); i++)
+      texts[fields[i].fd] = fields[i].text;
+    std::string indent = "\n";
+    const std::string &first = fields[0].text;
+    size_t nl = first.rfind('\n', first.find_first_not_of(" \t\n"));
+    if (nl != std::string::npos)
+      indent += first.substr(nl + 1, first.find_first_not_of(" \t", nl + 1) - nl - 1);
+    std::string body;
+    for (unsigned i = 0; i < hot.size(); i++)
+      body += texts[hot[i].fd];
+    if (!cold.empty()){
+      body += indent + "struct {  /* cold fields, -layout */";
+      for (unsigned i = 0; i < cold.size(); i++)
+        body += texts[cold[i].fd];
+      body += indent + "};";
+    }
+    Rewrite.ReplaceText(begin, SM.getFileOffset(end) - SM.getFileOffset(begin), body);
+    layout_applied++;
+  }
+}
+
+// soaArray - uses of an array of structs that -soa may split into one array per field
+struct soaArray{
+  std::vector<DeclRefExpr*> refs;                              // every use of the array
+  std::set<const DeclRefExpr*> good;                           // the ones in a[i].f
+  std::vector<MemberExpr*> members;
+  std::map<ForStmt*,std::set<const FieldDecl*> > loops;        // fields each for loop touches
+};
+
+// SoaScan - arrays of structs in the main file and how they are used
+class SoaScan : public RecursiveASTVisitor<SoaScan>
+{
+ public:
+  SoaScan(ASTContext &C) : Ctx(C) { }
+  ASTContext &Ctx;
+  std::vector<VarDecl*> arrays;
+  std::map<const VarDecl*,soaArray> uses;
+  std::set<std::string> names;                                 // for name clashes of the new arrays
+  std::map<unsigned,int> begins;                               // "struct P a[N], b[N];" share a start
+  std::vector<ForStmt*> loops;
+
+  bool VisitNamedDecl(NamedDecl *nd){
+    names.insert(nd->getNameAsString());
+    return true;
+  }
+  bool VisitVarDecl(VarDecl *vd){
+    begins[vd->getBeginLoc().getRawEncoding()]++;
+    const ConstantArrayType *at = Ctx.getAsConstantArrayType(vd->getType());
+    if (at == NULL || isa<ParmVarDecl>(vd) || !at->getElementType()->isStructureType()) return true;
+    if (vd->getLocation().isMacroID() || !Ctx.getSourceManager().isInMainFile(vd->getLocation())) return true;
+    arrays.push_back(vd);
+    uses[vd];
+    return true;
+  }
+  bool VisitDeclRefExpr(DeclRefExpr *e){
+    std::map<const VarDecl*,soaArray>::iterator it = uses.find(dyn_cast<VarDecl>(e->getDecl()));
+    if (it != uses.end()) it->second.refs.push_back(e);
+    return true;
+  }
+  bool VisitMemberExpr(MemberExpr *me){
+    if (me->isArrow()) return true;
+    ArraySubscriptExpr *ase = dyn_cast<ArraySubscriptExpr>(me->getBase()->IgnoreParens());
+    if (ase == NULL) return true;
+    DeclRefExpr *dre = dyn_cast<DeclRefExpr>(ase->getBase()->IgnoreParenImpCasts());
+    FieldDecl *fd = dyn_cast<FieldDecl>(me->getMemberDecl());
+    if (dre == NULL || fd == NULL) return true;
+    std::map<const VarDecl*,soaArray>::iterator it = uses.find(dyn_cast<VarDecl>(dre->getDecl()));
+    if (it == uses.end()) return true;
+    if (dre->getLocation().isMacroID() || me->getOperatorLoc().isMacroID() || me->getMemberLoc().isMacroID())
+      return true;
+    it->second.good.insert(dre);
+    it->second.members.push_back(me);
+    if (!loops.empty())
+      it->second.loops[loops.back()].insert(fd);
+    return true;
+  }
+  bool TraverseForStmt(ForStmt *s){
+    loops.push_back(s);
+    bool r = RecursiveASTVisitor<SoaScan>::TraverseForStmt(s);
+    loops.pop_back();
+    return r;
+  }
+};
+
+// SoaArrays - -soa: an array of structs whose for loops read only some of the fields becomes
+// one array per field, a[i].f -> a_f[i]; every use must be visible here and of that form
+void SoaArrays(ASTContext &Ctx, Rewriter &Rewrite, SoaScan &scan)
+{
+  SourceManager &SM = Ctx.getSourceManager();
+  PrintingPolicy PP(Ctx.getLangOpts());
+  PP.SuppressTagKeyword = false;                                 // "struct Q" also in C
+  for (unsigned a = 0; a < scan.arrays.size(); a++){
+    VarDecl *vd = scan.arrays[a];
+    soaArray &u = scan.uses[vd];
+    if (u.refs.empty()) continue;
+    const ConstantArrayType *at = Ctx.getAsConstantArrayType(vd->getType());
+    QualType elem = at->getElementType();
+    RecordDecl *rd = elem->getAs<RecordType>()->getDecl()->getDefinition();
+    std::string name = vd->getNameAsString();
+    std::string why;
+    char temp[64];
+
+    std::vector<FieldDecl*> fields;
+    if (rd != NULL)
+      for (RecordDecl::field_iterator I = rd->field_begin(), E = rd->field_end(); I != E; ++I)
+        fields.push_back(*I);
+
+    llvm::errs() << "soa: " << name << " at " << BranchKey(SM, vd->getLocation()) << ", "
+                 << at->getSize().getZExtValue() << " x " << elem.getAsString() << ", "
+                 << fields.size() << " field(s)\n";
+    bool subset = false;
+    for (std::map<ForStmt*,std::set<const FieldDecl*> >::iterator I = u.loops.begin(); I != u.loops.end(); ++I){
+      llvm::errs() << "  for at " << BranchKey(SM, I->first->getBeginLoc()) << ":";
+      for (std::set<const FieldDecl*>::iterator F = I->second.begin(); F != I->second.end(); ++F)
+        llvm::errs() << " " << (*F)->getNameAsString();
+      llvm::errs() << "\n";
+      if (I->second.size() < fields.size()) subset = true;
+    }
+
+    if (rd == NULL) why = "incomplete struct";
+    else if (elem.isConstQualified() || elem.isVolatileQualified()) why = "qualified element type";
+    else if (vd->hasExternalStorage() || (vd->isFileVarDecl() && vd->isExternallyVisible()))
+      why = "visible to other files (make it static)";
+    else if (vd->getTLSKind() != VarDecl::TLS_None) why = "thread-local";
+    else if (vd->hasInit()) why = "initializer";
+    else if (scan.begins[vd->getBeginLoc().getRawEncoding()] > 1) why = "declared together with other variables";
+    else if (vd->getBeginLoc().isMacroID() || vd->getEndLoc().isMacroID()) why = "declaration comes from a macro";
+    else if (!SM.isBeforeInTranslationUnit(rd->getBeginLoc(), vd->getBeginLoc()))
+      why = "struct defined in the declaration";
+    else if (isa<CXXRecordDecl>(rd) && !cast<CXXRecordDecl>(rd)->isCLike()) why = "not a C struct";
+    for (unsigned i = 0; i < fields.size() && why.empty(); i++){
+      if (fields[i]->isBitField()) why = "bit-fields";
+      else if (fields[i]->getName().empty()) why = "unnamed field";
+      else if (fields[i]->getType()->isIncompleteArrayType()) why = "flexible array member";
+      else if (scan.names.count(name + "_" + fields[i]->getNameAsString()))
+        why = name + "_" + fields[i]->getNameAsString() + " is already used";
+    }
+    for (unsigned i = 0; i < u.refs.size() && why.empty(); i++)
+      if (!u.good.count(u.refs[i])){
+        sprintf(temp, "line %u: ", SM.getSpellingLineNumber(u.refs[i]->getLocation()));
+        why = std::string(temp) + "used other than " + name + "[i].field";
+      }
+    if (why.empty() && !subset) why = "no for loop uses only some of the fields";
+    if (!why.empty()){
+      llvm::errs() << "  not converted: " << why << "\n";
+      continue;
+    }
+
+    std::string decl;
+    for (unsigned i = 0; i < fields.size(); i++){
+      QualType ft = Ctx.getConstantArrayType(fields[i]->getType(), at->getSize(), ArrayType::Normal, 0);
+      std::string one;
+      llvm::raw_string_ostream os(one);
+      if (vd->getStorageClass() == SC_Static) os << "static ";
+      ft.print(os, PP, name + "_" + fields[i]->getNameAsString());
+      decl += (i ? "; " : "") + os.str();
+    }
+    Rewrite.ReplaceText(vd->getSourceRange(), decl);
+    for (unsigned i = 0; i < u.members.size(); i++){
+      MemberExpr *me = u.members[i];
+      DeclRefExpr *dre = cast<DeclRefExpr>(cast<ArraySubscriptExpr>(me->getBase()->IgnoreParens())->getBase()->IgnoreParenImpCasts());
+      Rewrite.ReplaceText(dre->getLocation(), name.size(), name + "_" + me->getMemberDecl()->getNameAsString());
+      Rewrite.RemoveText(SourceRange(me->getOperatorLoc(), me->getMemberLoc()));
+    }
+    soa_converted++;
+    llvm::errs() << "  converted to " << fields.size() << " array(s), " << u.members.size() << " access(es) rewritten\n";
+  }
+}
 
 // Unchanged from the cirewriter ----- begin
 
@@ -842,22 +2697,249 @@ class MyASTConsumer : public ASTConsumer
 
   MyASTConsumer(Rewriter &Rewrite) : rv(Rewrite) { }
   virtual bool HandleTopLevelDecl(DeclGroupRef d);
+  virtual void HandleTranslationUnit(ASTContext &Ctx);
 
   MyRecursiveASTVisitor rv;
+  std::vector<Decl*> pending;                                  // -entry: traversed once the call graph is known
 };
 
+// UserDecl - d is written in the main file or under a -userpath directory; the declarations of
+// system and other headers are not traversed at all, so the work per file follows the user code
+bool UserDecl(const Decl *d, SourceManager &SM)
+{
+  SourceLocation loc = SM.getExpansionLoc(d->getLocation());
+  if (loc.isInvalid() || SM.isInMainFile(loc)) return true;
+  StringRef file = SM.getFilename(loc);
+  for (unsigned i = 0; i < user_paths.size(); i++)
+    if (file.startswith(user_paths[i])) return true;
+  return false;
+}
+
+// StreamFlush - -stream: write the rewritten main file up to offset end, with the text inserted at
+// end, and remove it from the rewrite buffer; later edits are all after end, so the rope only
+// holds the declaration being rewritten. RemoveText(0, ...) starts after the text inserted at
+// offset 0, so that text stays at the front of the rope and is skipped by the next flush
+void StreamFlush(Rewriter &R, unsigned end)
+{
+  if (end <= stream_done) return;
+  SourceManager &SM = R.getSourceMgr();
+  FileID fid = SM.getMainFileID();
+  SourceLocation start = SM.getLocForStartOfFile(fid);
+  int n = R.getRangeSize(CharSourceRange::getCharRange(start, start.getLocWithOffset(end)));
+  int head = R.getRangeSize(CharSourceRange::getCharRange(start, start));
+  if (n <= 0 || head < 0 || n < head) return;
+  RewriteBuffer &RB = R.getEditBuffer(fid);
+  RewriteBuffer::iterator it = RB.begin();
+  for (int i = 0; i < n; i++, ++it)
+    if (i >= (int)stream_head)
+      *stream_out << *it;
+  RB.RemoveText(0, n - head);
+  stream_head = head;
+  stream_done = end;
+}
+
 bool MyASTConsumer::HandleTopLevelDecl(DeclGroupRef d)
 {
   typedef DeclGroupRef::iterator iter;
 
   for (iter b = d.begin(), e = d.end(); b != e; ++b)
   {
-    rv.TraverseDecl(*b);
+    if (!UserDecl(*b, rv.Rewrite.getSourceMgr())){
+      decls_pruned++;
+      continue;
+    }
+    if (!entry_funcs.empty())
+      pending.push_back(*b);
+    else
+      rv.TraverseDecl(*b);
+  }
+  if (streammode){
+    SourceManager &SM = rv.Rewrite.getSourceMgr();
+    unsigned end = 0;
+    for (iter b = d.begin(), e = d.end(); b != e; ++b){
+      SourceLocation loc = SM.getExpansionLoc((*b)->getEndLoc());
+      if (!SM.isInMainFile(loc)) continue;
+      end = std::max(end, SM.getFileOffset(loc) + Lexer::MeasureTokenLength(loc, SM, rv.Rewrite.getLangOpts()));
+    }
+    StreamFlush(rv.Rewrite, end);
   }
 
   return true; // keep going
 }
 
+// RefCollector - functions named anywhere in a body, covers calls through pointers
+class RefCollector : public RecursiveASTVisitor<RefCollector>
+{
+ public:
+  std::vector<const FunctionDecl*> refs;
+  std::set<const VarDecl*> vars;
+  bool VisitDeclRefExpr(DeclRefExpr *e){
+    if (const FunctionDecl *fd = dyn_cast<FunctionDecl>(e->getDecl()))
+      refs.push_back(fd);
+    // function pointer tables: follow the initializer of a global once
+    else if (const VarDecl *vd = dyn_cast<VarDecl>(e->getDecl()))
+      if (vd->hasGlobalStorage() && vd->getAnyInitializer() && vars.insert(vd).second)
+        TraverseStmt(const_cast<Expr*>(vd->getAnyInitializer()));
+    return true;
+  }
+};
+
+// ComputeReachable - functions reachable from the -entry functions in the static call graph
+void ComputeReachable(ASTContext &Ctx)
+{
+  CallGraph CG;
+  CG.addToCallGraph(Ctx.getTranslationUnitDecl());
+
+  std::vector<const Decl*> work;
+  for (unsigned i = 0; i < entry_funcs.size(); i++){
+    bool found = false;
+    for (CallGraph::const_iterator I = CG.begin(), E = CG.end(); I != E; ++I){
+      const FunctionDecl *fd = dyn_cast_or_null<FunctionDecl>(I->first);
+      if (fd && fd->getNameAsString() == entry_funcs[i]){
+        work.push_back(fd->getCanonicalDecl());
+        found = true;
+      }
+    }
+    if (!found)
+      llvm::errs() << "entry function " << entry_funcs[i] << " not found\n";
+  }
+
+  while (!work.empty()){
+    const Decl *d = work.back();
+    work.pop_back();
+    if (!reach_funcs.insert(d).second) continue;
+    if (CallGraphNode *N = CG.getNode(d))
+      for (CallGraphNode::iterator CI = N->begin(), CE = N->end(); CI != CE; ++CI)
+        if ((*CI)->getDecl())
+          work.push_back((*CI)->getDecl()->getCanonicalDecl());
+    // a function whose address is taken may be called through the pointer
+    const FunctionDecl *fd = dyn_cast<FunctionDecl>(d);
+    const FunctionDecl *def = NULL;
+    if (fd && fd->hasBody(def)){
+      RefCollector rc;
+      rc.TraverseStmt(def->getBody());
+      for (unsigned i = 0; i < rc.refs.size(); i++)
+        work.push_back(rc.refs[i]->getCanonicalDecl());
+    }
+  }
+}
+
+// summaryWriter - functions by USR and their edges, strings stored once
+class summaryWriter
+{
+ public:
+  std::vector<std::string> strs;
+  std::map<std::string,unsigned> strIdx;
+  std::map<const Decl*,unsigned> funcIdx;
+  std::vector<lc_sg_func> funcs;
+  std::vector<lc_sg_edge> edges;
+
+  unsigned Str(const std::string &str){
+    std::map<std::string,unsigned>::iterator it = strIdx.find(str);
+    if (it != strIdx.end()) return it->second;
+    strIdx[str] = strs.size();
+    strs.push_back(str);
+    return strs.size() - 1;
+  }
+  unsigned Func(const FunctionDecl *fd){
+    fd = fd->getCanonicalDecl();
+    std::map<const Decl*,unsigned>::iterator it = funcIdx.find(fd);
+    if (it != funcIdx.end()) return it->second;
+    llvm::SmallString<128> usr;
+    if (index::generateUSRForDecl(fd, usr))
+      usr = "name:" + fd->getNameAsString();
+    lc_sg_func f;
+    f.usr = Str(usr.str());
+    f.name = Str(fd->getNameAsString());
+    f.flags = fd->hasBody() ? LC_SG_DEFINED : 0;
+    if (fd->isExternallyVisible()) f.flags |= LC_SG_EXTERN;
+    funcIdx[fd] = funcs.size();
+    funcs.push_back(f);
+    return funcs.size() - 1;
+  }
+  bool Write(const std::string &name){
+    std::error_code EC;
+    llvm::raw_fd_ostream os(name, EC, llvm::sys::fs::F_None);
+    if (EC) return false;
+    lc_sg_header h;
+    h.magic = LC_SG_MAGIC;
+    h.version = LC_SG_VERSION;
+    h.nstrings = strs.size();
+    h.strbytes = 0;
+    std::vector<uint32_t> off;
+    for (unsigned i = 0; i < strs.size(); i++){
+      off.push_back(h.strbytes);
+      h.strbytes += strs[i].size() + 1;
+    }
+    unsigned pad = -h.strbytes & 3;
+    h.strbytes += pad;
+    h.nfuncs = funcs.size();
+    h.nedges = edges.size();
+    os.write((const char*)&h, sizeof(h));
+    os.write((const char*)off.data(), off.size() * sizeof(uint32_t));
+    for (unsigned i = 0; i < strs.size(); i++)
+      os.write(strs[i].c_str(), strs[i].size() + 1);
+    os.write("\0\0\0", pad);
+    os.write((const char*)funcs.data(), funcs.size() * sizeof(lc_sg_func));
+    os.write((const char*)edges.data(), edges.size() * sizeof(lc_sg_edge));
+    return true;
+  }
+};
+
+// WriteSummary - every function defined here and the functions it names (calls or address taken)
+void WriteSummary(ASTContext &Ctx, const std::string &name)
+{
+  summaryWriter sw;
+  std::set<std::pair<unsigned,unsigned> > seen;
+  SourceManager &SM = Ctx.getSourceManager();
+  for (Decl *d : Ctx.getTranslationUnitDecl()->decls()){
+    FunctionDecl *fd = dyn_cast<FunctionDecl>(d);
+    if (!fd || !fd->doesThisDeclarationHaveABody()) continue;
+    // static inline functions of headers would be one node per includer
+    if (!SM.isInMainFile(fd->getLocation())) continue;
+    unsigned from = sw.Func(fd);
+    RefCollector rc;
+    rc.TraverseStmt(fd->getBody());
+    for (unsigned i = 0; i < rc.refs.size(); i++){
+      unsigned to = sw.Func(rc.refs[i]);
+      if (!seen.insert(std::make_pair(from, to)).second) continue;
+      lc_sg_edge e;
+      e.from = from;
+      e.to = to;
+      sw.edges.push_back(e);
+    }
+  }
+  if (!sw.Write(name))
+    llvm::errs() << "Cannot open " << name << " for writing\n";
+  else
+    llvm::errs() << "summary: " << sw.funcs.size() << " function(s), " << sw.edges.size()
+                 << " edge(s) written to " << name << "\n";
+}
+
+void MyASTConsumer::HandleTranslationUnit(ASTContext &Ctx)
+{
+  if (!summary_name.empty())
+    WriteSummary(Ctx, summary_name);
+  llvm::errs() << "traversal: " << decls_pruned << " header declaration(s) skipped\n";
+  if (layoutmode){
+    LayoutScan scan(Ctx.getSourceManager());
+    for (Decl *d : Ctx.getTranslationUnitDecl()->decls())
+      if (UserDecl(d, Ctx.getSourceManager())) scan.TraverseDecl(d);
+    LayoutRecords(Ctx, rv.Rewrite, scan);
+  }
+  if (soamode){
+    SoaScan scan(Ctx);
+    scan.TraverseDecl(Ctx.getTranslationUnitDecl());
+    SoaArrays(Ctx, rv.Rewrite, scan);
+  }
+  if (entry_funcs.empty()) return;
+  ComputeReachable(Ctx);
+  for (unsigned i = 0; i < pending.size(); i++)
+    rv.TraverseDecl(pending[i]);
+  llvm::errs() << "reachability: " << reach_funcs.size() << " function(s) reachable, "
+               << funcs_skipped << " skipped, " << probes_skipped << " probe(s) not inserted\n";
+}
+
 // Unchanged from the cirewriter ----- end
 
 
@@ -987,54 +3069,174 @@ ast_matchers::StatementMatcher MallocMatcher    =   ast_matchers::binaryOperator
 
 
 
-//
-int main(int argc, char **argv)
+// ReadCounter - a counter file, "value generation"; one without a generation (new, reset, or
+// written by a tool that drops it) gets a new one at once, so that edit scripts made against
+// the old values no longer match
+void ReadCounter(const char *name, int &value, std::string &gen)
 {
+  std::ifstream in(name);
+  in >> value >> gen;
+  in.close();
+  if (!gen.empty()) return;
+  char buf[64];
+  sprintf(buf, "%lx.%x.%x", (long)time(NULL), (unsigned)getpid(), (unsigned)rand());
+  gen = buf;
+  std::ofstream o(name);
+  o << value << " " << gen;
+}
 
+// CountLines - number of lines already in a file, 0 if it does not exist
+int CountLines(const char *name)
+{
+  std::ifstream infile(name);
+  int lines = 0;
+  char c;
+  while (infile.get(c))
+    if (c == '\n') lines++;
+  return lines;
+}
 
+// EmitFuncNames - register this file's function ids with the runtime at startup
+void EmitFuncNames(llvm::raw_ostream &os)
+{
+  if (func_gids.empty()) return;
+  os << "\nstatic void __attribute__((constructor)) __lc_func_names_init(void){\n";
+  for (unsigned i = 0; i < func_gids.size(); i++)
+    os << "\t__lc_func_name(" << func_gids[i].first << ",\"" << func_gids[i].second << "\");\n";
+  os << "}\n";
+}
 
+// EmitCallSites - register this file's call sites (site -> caller, callee) for lccg.h
+void EmitCallSites(llvm::raw_ostream &os)
+{
+  if (cg_sites.empty()) return;
+  os << "\nstatic void __attribute__((constructor)) __lc_cg_sites_init(void){\n";
+  for (unsigned i = 0; i < cg_sites.size(); i++)
+    os << "\t__lc_cg_site(" << cg_sites[i].site << "," << cg_sites[i].caller
+       << ",\"" << cg_sites[i].callee << "\");\n";
+  os << "}\n";
+}
 
-  struct stat sb;
-
-  if (argc < 2)
-  {
-     llvm::errs() << "Here is the Usage: CIrewriter <options> <filename>\n";
-     return 1;
-  }
-
-  fs = rand();
-  // Get filename
-  std::string fileName(argv[argc - 1]);
-
-  // Make sure it exists
-  if (stat(fileName.c_str(), &sb) == -1)
+//
+// ParseOptions - instrumentation options argv[first..last)
+void ParseOptions(int first, int last, char **argv)
+{
+  for (int i = first; i < last; i++)
   {
-    perror(fileName.c_str());
-    exit(EXIT_FAILURE);
+    if (strcmp(argv[i], "-profile") == 0)
+      profmode = 1;
+    else if (strcmp(argv[i], "-trace") == 0)
+      tracemode = 1;
+    else if (strcmp(argv[i], "-callgraph") == 0)
+      cgmode = 1;
+    else if (strcmp(argv[i], "-entry") == 0 && i + 1 < last)
+      entry_funcs.push_back(argv[++i]);
+    else if (strcmp(argv[i], "-summary") == 0 && i + 1 < last)
+      summary_name = argv[++i];
+    else if (strcmp(argv[i], "-preamble") == 0)
+      preamblemode = 1;
+    else if (strcmp(argv[i], "-userpath") == 0 && i + 1 < last)
+      user_paths.push_back(argv[++i]);
+    else if (strcmp(argv[i], "-stream") == 0)
+      streammode = 1;
+    else if (strcmp(argv[i], "-edits") == 0)
+      editsmode = 1;
+    else if (strcmp(argv[i], "-branchprof") == 0)
+      brmode = 1;
+    else if (strcmp(argv[i], "-branchopt") == 0 && i + 1 < last)
+    {
+      LoadBranchProfile(argv[++i]);
+      brhint = 1;
+      rewriteonly = 1;
+    }
+    else if (strcmp(argv[i], "-likely-attr") == 0)
+      brattr = 1;
+    else if (strcmp(argv[i], "-loopprof") == 0)
+      loopmode = 1;
+    else if (strcmp(argv[i], "-loopopt") == 0 && i + 1 < last)
+    {
+      LoadLoopProfile(argv[++i]);
+      loophint = 1;
+      rewriteonly = 1;
+    }
+    else if (strcmp(argv[i], "-omp") == 0)
+    {
+      ompmode = 1;
+      rewriteonly = 1;
+    }
+    else if (strcmp(argv[i], "-hoist") == 0)
+      hoistmode = 1;
+    else if (strcmp(argv[i], "-interchange") == 0)
+    {
+      nestmode = 1;
+      rewriteonly = 1;
+    }
+    else if (strcmp(argv[i], "-layout") == 0 || strcmp(argv[i], "-layout-apply") == 0)
+    {
+      layoutmode = std::max(layoutmode, strcmp(argv[i], "-layout-apply") == 0 ? 2 : 1);
+      rewriteonly = 1;
+    }
+    else if (strcmp(argv[i], "-soa") == 0)
+    {
+      soamode = 1;
+      rewriteonly = 1;
+    }
+    else if (strcmp(argv[i], "-layout-profile") == 0 && i + 1 < last)
+      LoadLoopProfile(argv[++i]);
+    else if (strcmp(argv[i], "-tile") == 0 && i + 1 < last)
+    {
+      nest_tile = atoi(argv[++i]);
+      nestmode = 1;
+      rewriteonly = 1;
+    }
+    else
+      llvm::errs() << "Unknown option " << argv[i] << "\n";
   }
+}
 
-  CompilerInstance compiler;
+// SetupInvocation - options shared by the parse and the preamble PCH build: host target, or
+// for lc-cc a copy of the compile's own invocation (language, target, search paths, macros,
+// -include); they have to be the same for the PCH to be loadable
+void SetupInvocation(CompilerInstance &compiler)
+{
   DiagnosticOptions diagnosticOptions;
   compiler.createDiagnostics();
   //compiler.createDiagnostics(argc, argv);
 
   // Create an invocation that passes any flags to preprocessor
-  auto Invocation = std::make_shared<CompilerInvocation>();
-  Invocation->getFrontendOpts().Inputs.push_back(FrontendInputFile("test.cpp",
-                                                                   clang::InputKind::CXX));
+  std::shared_ptr<CompilerInvocation> Invocation;
+  if (cc_inv){
+    Invocation = std::make_shared<CompilerInvocation>(*cc_inv);
+    Invocation->getDependencyOutputOpts() = DependencyOutputOptions();  // the compile writes the .d
+  }
+  else {
+    Invocation = std::make_shared<CompilerInvocation>();
+    Invocation->getFrontendOpts().Inputs.push_back(FrontendInputFile("test.cpp",
+                                                                     clang::InputKind::CXX));
+    // Set default target triple
+    Invocation->getTargetOpts().Triple = llvm::sys::getDefaultTargetTriple();
+  }
   Invocation->getFrontendOpts().ProgramAction = frontend::ParseSyntaxOnly;
   compiler.setInvocation(std::move(Invocation));
 
-  // Set default target triple
-    std::shared_ptr<clang::TargetOptions> pto = std::make_shared<clang::TargetOptions>();
-  pto->Triple = llvm::sys::getDefaultTargetTriple();
-    TargetInfo *pti = TargetInfo::CreateTargetInfo(compiler.getDiagnostics(), pto);
+  TargetInfo *pti = TargetInfo::CreateTargetInfo(compiler.getDiagnostics(), compiler.getInvocation().TargetOpts);
   compiler.setTarget(pti);
+}
 
-  compiler.createFileManager();
+// SetupCompiler - the parser setup of every run, with fileName as the main file; the FileManager
+// is the server's warm one if there is one, pch is the preamble of PreamblePCH if not empty
+void SetupCompiler(CompilerInstance &compiler, const std::string &fileName, const std::string &pch = "")
+{
+  SetupInvocation(compiler);
+  if (server_files)
+    compiler.setFileManager(server_files.get());
+  else
+    compiler.createFileManager();
   compiler.createSourceManager(compiler.getFileManager());
-
-  HeaderSearchOptions &headerSearchOptions = compiler.getHeaderSearchOpts();
+  if (!pch.empty()){
+    compiler.getPreprocessorOpts().ImplicitPCHInclude = pch;
+    compiler.getPreprocessorOpts().DisablePCHValidation = true;  // PreamblePCH has checked the deps
+  }
 
   // Allow C++ code to get rewritten
   LangOptions langOpts;
@@ -1052,81 +3254,588 @@ int main(int argc, char **argv)
   //---------------compiler.getPreprocessorOpts().UsePredefines = false;
  
   compiler.createASTContext();
-
-  // Initialize rewriter
-  Rewriter Rewrite;
-  Rewrite.setSourceMgr(compiler.getSourceManager(), compiler.getLangOpts());
+  if (!pch.empty())
+    compiler.createPCHExternalASTSource(pch, true, false, nullptr, false);
 
   const FileEntry *pFile = compiler.getFileManager().getFile(fileName);
     compiler.getSourceManager().setMainFileID( compiler.getSourceManager().createFileID( pFile, clang::SourceLocation(), clang::SrcMgr::C_User));
   compiler.getDiagnosticClient().BeginSourceFile(compiler.getLangOpts(),
                                                 &compiler.getPreprocessor());
+}
 
-  MyASTConsumer astConsumer(Rewrite);
+unsigned long long Fnv1a(StringRef s)
+{
+  unsigned long long h = 14695981039346656037ull;
+  for (unsigned i = 0; i < s.size(); i++)
+    h = (h ^ (unsigned char)s[i]) * 1099511628211ull;
+  return h;
+}
+
+// PreambleFresh - every file the PCH was built from still has the size and mtime in deps
+bool PreambleFresh(const std::string &deps, const std::string &pch)
+{
+  struct stat sb;
+  if (stat(pch.c_str(), &sb) == -1)
+    return false;
+  std::ifstream in(deps.c_str());
+  long long mtime, size;
+  std::string path;
+  int n = 0;
+  while (in >> mtime >> size && in.get() == ' ' && std::getline(in, path)){
+    if (stat(path.c_str(), &sb) == -1 || sb.st_mtime != mtime || sb.st_size != size)
+      return false;
+    n++;
+  }
+  return n > 0;
+}
+
+// BuildPreamble - precompile header into pch and list the files it read in deps; dir is the
+// directory of the source, for its #include "..."
+bool BuildPreamble(const std::string &header, const std::string &pch, const std::string &deps,
+                   const std::string &dir)
+{
+  CompilerInstance compiler;
+  SetupInvocation(compiler);
+  compiler.getHeaderSearchOpts().AddPath(dir, frontend::Quoted, false, false);
+  FrontendOptions &fo = compiler.getFrontendOpts();
+  fo.Inputs.clear();
+  fo.Inputs.push_back(FrontendInputFile(header, cc_inv && !cc_inv->getFrontendOpts().Inputs.empty() ?
+                                        cc_inv->getFrontendOpts().Inputs[0].getKind() : clang::InputKind::CXX));
+  fo.OutputFile = pch;
+  fo.ProgramAction = frontend::GeneratePCH;
+  GeneratePCHAction action;
+  if (!compiler.ExecuteAction(action) || compiler.getDiagnostics().hasErrorOccurred())
+    return false;
+
+  // written aside and renamed, concurrent -server requests may build the same preamble
+  std::string tmp = deps + "." + std::to_string(getpid());
+  std::ofstream out(tmp.c_str());
+  SmallVector<const FileEntry*, 256> files;
+  compiler.getFileManager().GetUniqueIDMapping(files);
+  for (unsigned i = 0; i < files.size(); i++)
+    if (files[i])
+      out << (long long)files[i]->getModificationTime() << " " << (long long)files[i]->getSize()
+          << " " << files[i]->getName().str() << "\n";
+  out.close();
+  return rename(tmp.c_str(), deps.c_str()) == 0;
+}
 
+// PreamblePCH - -preamble: the directives at the top of fileName (Lexer::ComputePreamble) go into
+// PREAMBLE_DIR/<hash>.h, guarded so that the copy in the file is skipped after the PCH, and are
+// precompiled once; the hash covers the preamble text, the directory and the lc-cc options, so every
+// instrumentation mode of the same file shares it. "" if there is no preamble or it does not build
+std::string PreamblePCH(const std::string &fileName)
+{
+  std::ifstream in(fileName.c_str());
+  std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  PreambleBounds bounds = Lexer::ComputePreamble(text, LangOptions());
+  if (bounds.Size == 0)
+    return "";
+
+  SmallString<256> abs(fileName);
+  llvm::sys::fs::make_absolute(abs);
+  std::string dir = llvm::sys::path::parent_path(abs).str();
+  std::string key = text.substr(0, bounds.Size) + '\0' + dir + '\0' + llvm::sys::getDefaultTargetTriple();
+  key += cc_key;
+  char hash[32];
+  sprintf(hash, "%016llx", Fnv1a(key));
+  std::string base = std::string(PREAMBLE_DIR) + "/" + hash;
+  std::string pch = base + ".pch", deps = base + ".deps";
+
+  if (PreambleFresh(deps, pch)){
+    llvm::errs() << "preamble: " << bounds.Size << " byte(s) from " << pch << "\n";
+    return pch;
+  }
+  mkdir(PREAMBLE_DIR, 0755);
+  std::ofstream header((base + ".h").c_str());
+  header << "#ifndef __LC_PREAMBLE_" << hash << "\n#define __LC_PREAMBLE_" << hash << "\n"
+         << "#line 1 \"" << fileName << "\"\n" << text.substr(0, bounds.Size) << "\n#endif\n";
+  header.close();
+  if (!BuildPreamble(base + ".h", pch, deps, dir)){
+    llvm::errs() << "preamble: cannot precompile the preamble of " << fileName << ", parsing it all\n";
+    return "";
+  }
+  llvm::errs() << "preamble: " << bounds.Size << " byte(s) precompiled to " << pch << "\n";
+  return pch;
+}
 
-  // Convert <file>.c to <file_out>.c
-  std::string outName (fileName);
-  size_t ext = outName.rfind(".");
-  if (ext == std::string::npos)
-     ext = outName.length();
-  outName.insert(ext, "_out");
+// CollectEdits - the main file's rewrites as edits of the source: pieces of the rope that point into
+// the source copy are kept text, everything between them was inserted, and a gap in the source
+// offsets was removed
+void CollectEdits(Rewriter &R)
+{
+  const RewriteBuffer *RB = R.getRewriteBufferFor(R.getSourceMgr().getMainFileID());
+  edits.clear();
+  if (RB == NULL) return;
+  uintptr_t base = (uintptr_t)edits_orig;
+  unsigned cur = 0;
+  lcEdit e;
+  e.offset = 0;
+  e.removed = 0;
+  for (RewriteBuffer::iterator I = RB->begin(), E = RB->end(); I != E; I.MoveToNextPiece()){
+    StringRef p = I.piece();
+    uintptr_t at = (uintptr_t)p.data();
+    if (edits_orig && at >= base && at + p.size() <= base + edits_size){
+      unsigned off = at - base;
+      if (off != cur || !e.text.empty()){
+        e.offset = cur;
+        e.removed = off - cur;
+        edits.push_back(e);
+        e.text.clear();
+      }
+      cur = off + p.size();
+    }
+    else
+      e.text += p;
+  }
+  if (cur != edits_size || !e.text.empty()){
+    e.offset = cur;
+    e.removed = edits_size - cur;
+    edits.push_back(e);
+  }
+}
 
+// FileHash - Fnv1a of a whole file, of "" if it cannot be read
+unsigned long long FileHash(const std::string &name)
+{
+  std::ifstream in(name.c_str(), std::ios::binary);
+  std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  return Fnv1a(text);
+}
 
-  llvm::errs() << "Output to: " << outName << "\n";
-  std::error_code OutErrorInfo;
-  std::error_code ok;
-  llvm::raw_fd_ostream outFile(llvm::StringRef(outName), OutErrorInfo, llvm::sys::fs::F_None);
+// FuncLines - Fnv1a of the first n lines of func_blocks.txt; the function names of the lines
+// after them go to after
+unsigned long long FuncLines(unsigned n, std::vector<std::string> &after)
+{
+  std::ifstream in("/root/func_blocks.txt", std::ios::binary);
+  std::string prefix, line;
+  for (unsigned i = 0; i < n && std::getline(in, line); i++)
+    prefix += line + "\n";
+  while (std::getline(in, line))
+    after.push_back(line.substr(0, line.find(' ')));
+  return Fnv1a(prefix);
+}
 
+// EditsDeps - the headers the parse read and those of the preamble PCH, "f mtime size path"
+void EditsDeps(SourceManager &SM, const std::string &pch)
+{
+  edits_deps.clear();
+  const FileEntry *mainFile = SM.getFileEntryForID(SM.getMainFileID());
+  for (SourceManager::fileinfo_iterator I = SM.fileinfo_begin(), E = SM.fileinfo_end(); I != E; ++I)
+    if (I->first && I->first != mainFile)
+      edits_deps.push_back("f " + std::to_string((long long)I->first->getModificationTime()) + " "
+                           + std::to_string((long long)I->first->getSize()) + " " + I->first->getName().str());
+  if (!pch.empty()){
+    std::ifstream deps((pch.substr(0, pch.size() - 4) + ".deps").c_str());
+    std::string line;
+    while (std::getline(deps, line))
+      edits_deps.push_back("f " + line);
+  }
+}
 
+// WriteEdits - the edit script: "LCEDITS 3", "src path", "out path", "size n", "hash h", "opts o",
+// "ids pos site branch loop func" (the counters after this file), "gen ..." (the generations of
+// the counter files), "funcs base h name..." (hash of the func_blocks.txt lines before this file
+// and its functions), "deps n" and n lines "h hash path" (profiles) or "f mtime size path"
+// (headers); then per edit "offset removed length" and length bytes of text and a newline; the
+// prelude is an insert at 0 and the function tables one at the end, so the script rebuilds all
+// of <file>_out
+void WriteEdits(const std::string &fileName, const std::string &outName, const std::string &text)
+{
+  SmallString<256> src(fileName), out(outName);
+  llvm::sys::fs::make_absolute(src);
+  llvm::sys::fs::make_absolute(out);
+  std::string name = outName + ".edits";
+  FILE *fp = fopen(name.c_str(), "wb");
+  if (fp == NULL){
+    perror(name.c_str());
+    return;
+  }
+  fprintf(fp, "LCEDITS 3\nsrc %s\nout %s\nsize %u\nhash %016llx\nopts %s\nids %d %d %d %d %d\n", src.c_str(), out.c_str(),
+          edits_size, edits_hash, edits_opts.c_str(), pos, cg_next, br_next, loop_next,
+          func_gid < 0 ? func_gid_base : func_gid + 1);
+  fprintf(fp, "gen %s %s %s %s %s\n", pos_gen.c_str(), block_gen.c_str(), cg_gen.c_str(), br_gen.c_str(), loop_gen.c_str());
+  std::vector<std::string> none;
+  fprintf(fp, "funcs %d %016llx", func_gid_base, FuncLines(func_gid_base, none));
+  for (unsigned i = 0; i < func_gids.size(); i++)
+    fprintf(fp, " %s", func_gids[i].second.c_str());
+  fprintf(fp, "\ndeps %u\n", (unsigned)(edits_inputs.size() + edits_deps.size()));
+  for (unsigned i = 0; i < edits_inputs.size(); i++)
+    fprintf(fp, "h %016llx %s\n", FileHash(edits_inputs[i]), edits_inputs[i].c_str());
+  for (unsigned i = 0; i < edits_deps.size(); i++)
+    fprintf(fp, "%s\n", edits_deps[i].c_str());
+  fprintf(fp, "0 0 %u\n", (unsigned)edits_split);
+  fwrite(text.data(), 1, edits_split, fp);
+  fputc('\n', fp);
+  unsigned bytes = 0;
+  for (unsigned i = 0; i < edits.size(); i++){
+    fprintf(fp, "%u %u %u\n", edits[i].offset, edits[i].removed, (unsigned)edits[i].text.size());
+    fwrite(edits[i].text.data(), 1, edits[i].text.size(), fp);
+    fputc('\n', fp);
+    bytes += edits[i].text.size();
+  }
+  fprintf(fp, "%u 0 %u\n", edits_size, (unsigned)(text.size() - edits_split));
+  fwrite(text.data() + edits_split, 1, text.size() - edits_split, fp);
+  fputc('\n', fp);
+  fclose(fp);
+  llvm::errs() << "edits: " << edits.size() << " edit(s), " << bytes << " byte(s) inserted, written to " << name << "\n";
+}
 
+// EditsKept - is the script of an earlier run still right for fileName: same source, options,
+// profiles and headers, counter files of the same generation, and this file's functions still
+// on their func_blocks.txt lines. Ids continue from run to run, so a new run of an unchanged
+// file would hand out new ones and every _out would change; keeping the script keeps the ids,
+// and EditApply then leaves the _out file alone. A counter file that is removed or reset gets a
+// new generation, which makes every file get a new script
+bool EditsKept(const std::string &fileName, const std::string &outName)
+{
+  std::ifstream in((outName + ".edits").c_str(), std::ios::binary);
+  std::string version, srcLine, outLine, sizeLine, hashLine, optsLine, idsLine, genLine, funcsLine, depsLine;
+  if (!std::getline(in, version) || version != "LCEDITS 3" || !std::getline(in, srcLine)
+      || !std::getline(in, outLine) || !std::getline(in, sizeLine) || !std::getline(in, hashLine)
+      || !std::getline(in, optsLine) || !std::getline(in, idsLine) || !std::getline(in, genLine)
+      || !std::getline(in, funcsLine) || !std::getline(in, depsLine) || optsLine != "opts " + edits_opts
+      || genLine != "gen " + pos_gen + " " + block_gen + " " + cg_gen + " " + br_gen + " " + loop_gen)
+    return false;
+  SmallString<256> src(fileName);
+  llvm::sys::fs::make_absolute(src);
+  if (srcLine != "src " + src.str().str())
+    return false;
+  std::ifstream sf(fileName.c_str(), std::ios::binary);
+  std::string text((std::istreambuf_iterator<char>(sf)), std::istreambuf_iterator<char>());
+  unsigned long long size, hash;
+  int ids[5];
+  unsigned ndeps;
+  if (sscanf(sizeLine.c_str(), "size %llu", &size) != 1 || sscanf(hashLine.c_str(), "hash %llx", &hash) != 1
+      || sscanf(idsLine.c_str(), "ids %d %d %d %d %d", &ids[0], &ids[1], &ids[2], &ids[3], &ids[4]) != 5
+      || sscanf(depsLine.c_str(), "deps %u", &ndeps) != 1)
+    return false;
+  if (size != text.size() || hash != Fnv1a(text) || pos < ids[0] || cg_next < ids[1]
+      || br_next < ids[2] || loop_next < ids[3] || func_gid_base < ids[4])
+    return false;
+
+  // the lines before this file's functions unchanged, and its own lines still its functions
+  std::istringstream funcs(funcsLine);
+  std::string word, name;
+  unsigned base;
+  unsigned long long prefix;
+  if (!(funcs >> word >> base >> std::hex >> prefix))
+    return false;
+  std::vector<std::string> after;
+  if (FuncLines(base, after) != prefix)
+    return false;
+  for (unsigned i = 0; funcs >> name; i++)
+    if (i >= after.size() || after[i] != name)
+      return false;
+
+  for (unsigned i = 0; i < ndeps; i++){
+    std::string line;
+    long long mtime, fsize;
+    unsigned long long h;
+    int at = 0;
+    if (!std::getline(in, line))
+      return false;
+    if (sscanf(line.c_str(), "h %llx %n", &h, &at) == 1 && at){
+      if (FileHash(line.substr(at)) != h)
+        return false;
+    }
+    else if (sscanf(line.c_str(), "f %lld %lld %n", &mtime, &fsize, &at) == 2 && at){
+      struct stat sb;
+      if (stat(line.substr(at).c_str(), &sb) == -1 || sb.st_mtime != mtime || sb.st_size != fsize)
+        return false;
+    }
+    else
+      return false;
+  }
+  return true;
+}
 
+// RewriteFile - parse fileName, instrument it and write the prelude and the rewritten source
+void RewriteFile(const std::string &fileName, llvm::raw_ostream &outFile)
+{
+  std::string pch = preamblemode ? PreamblePCH(fileName) : "";
+  CompilerInstance compiler;
+  SetupCompiler(compiler, fileName, pch);
 
-  //TODO
+  // Initialize rewriter
+  Rewriter Rewrite;
+  Rewrite.setSourceMgr(compiler.getSourceManager(), compiler.getLangOpts());
 
-  if (OutErrorInfo == ok)
-  {
-    // Parse the AST
-    ParseAST(compiler.getPreprocessor(), &astConsumer, compiler.getASTContext());
-    compiler.getDiagnosticClient().EndSourceFile();
+  MyASTConsumer astConsumer(Rewrite);
 
+  // Output some #ifdefs and block information
+  if (!rewriteonly) {
+  outFile << "#define L_AND(a, b) a && b\n";
+  outFile << "#define L_OR(a, b) a || b\n";
+  outFile << "#ifndef STDIO_H\n";
+  outFile << "#define STDIO_H\n";
+  outFile << "#endif\n";
+  if (profmode)
+    outFile << "#include \"lcprof.h\"\n";
+  if (tracemode)
+    outFile << "#include \"lctrace.h\"\n";
+  if (cgmode)
+    outFile << "#include \"lccg.h\"\n";
+  if (brmode)
+    outFile << "#include \"lcbranch.h\"\n";
+  if (loopmode)
+    outFile << "#include \"lcloop.h\"\n";
+
+  char fc[256];
+  std::ifstream infile("/root/loopconvert.txt");
+  infile>>blockflag;
+  infile.close();
+  if (blockflag>=100000){
+  	outFile << "\nextern unsigned char blocks[100000];\n";
+  	infile.close();
+  }
+  else {
+  	outFile << "\nunsigned char blocks[100000]={0};\n";  // ids are pos%100000
+  	blockflag+=100000;
+  	std::ofstream outfile("/root/loopconvert.txt");
+      outfile<<blockflag<<" "<<block_gen;
+      outfile.close();
+  }
+  }
 
+  if (streammode && (layoutmode || soamode || !entry_funcs.empty())){
+    llvm::errs() << "-stream: -layout, -soa and -entry edit the file after the parse, writing it at the end\n";
+    streammode = 0;
+  }
+  if (editsmode){
+    // the untouched rope is one piece: the copy of the source that CollectEdits compares against
+    streammode = 0;
+    RewriteBuffer &RB = Rewrite.getEditBuffer(compiler.getSourceManager().getMainFileID());
+    edits_orig = RB.size() ? RB.begin().piece().data() : NULL;
+  }
+  stream_out = &outFile;
+  stream_done = 0;
+  stream_head = 0;
+
+  // Parse the AST
+  ParseAST(compiler.getPreprocessor(), &astConsumer, compiler.getASTContext());
+  compiler.getDiagnosticClient().EndSourceFile();
+  if (!pch.empty() && compiler.getDiagnostics().hasErrorOccurred())
+    llvm::errs() << "preamble: errors with " << pch << ", a header in the preamble without an include guard"
+                 << " is parsed twice; run without -preamble\n";
+
+
+
+  // Now output rewritten source code
+  const RewriteBuffer *RewriteBuf =
+    Rewrite.getRewriteBufferFor(compiler.getSourceManager().getMainFileID());
+  if (editsmode){
+    StringRef src = compiler.getSourceManager().getBufferData(compiler.getSourceManager().getMainFileID());
+    edits_split = outFile.tell();
+    edits_size = src.size();
+    edits_hash = Fnv1a(src);
+    CollectEdits(Rewrite);
+    EditsDeps(compiler.getSourceManager(), pch);
+  }
+  else if (streammode)
+    StreamFlush(Rewrite, compiler.getSourceManager().getBufferData(compiler.getSourceManager().getMainFileID()).size());
+  else if (RewriteBuf)
+    RewriteBuf->write(outFile);                                // straight from the rope, no copy
+  else // nothing was rewritten
+    outFile << compiler.getSourceManager().getBufferData(compiler.getSourceManager().getMainFileID());
+  if (profmode || cgmode)
+    EmitFuncNames(outFile);
+  if (cgmode)
+    EmitCallSites(outFile);
+}
 
-    // Output some #ifdefs and block information
-    outFile << "#define L_AND(a, b) a && b\n";
-    outFile << "#define L_OR(a, b) a || b\n";
-    outFile << "#ifndef STDIO_H\n";
-    outFile << "#define STDIO_H\n";
-    outFile << "#endif\n";
+// CcArg - value of -Ifoo or "-I foo", advancing i for the second form
+std::string CcArg(int argc, char **argv, int &i)
+{
+  if (argv[i][2]) return argv[i] + 2;
+  return i + 1 < argc ? argv[++i] : "";
+}
 
-    char fc[256];
-    std::ifstream infile("/root/loopconvert.txt");
-    infile>>blockflag;
-    infile.close();
-    if (blockflag>=100000){
-    	outFile << "\nextern unsigned char blocks[1000];\n";
-    	infile.close();
+// CcMain - lc-cc: takes the arguments of a compile command, instruments the source in memory and
+// compiles it in this process, so there is no <file>_out.c and no second frontend start.
+// Instrumentation options come from $LC_FLAGS. Anything but a single -c/-S compile of one source
+// (links, several files, -E) is handed unchanged to $LC_CC, clang by default.
+int CcMain(int argc, char **argv)
+{
+  std::vector<const char*> args;
+  std::vector<std::string> srcs;
+  bool compileOnly = false;
+  std::string self = llvm::sys::fs::getMainExecutable(argv[0], (void*)&CcMain);
+  args.push_back(self.c_str());                                // the driver finds the resource dir from it
+  for (int i = 1; i < argc; i++){
+    int first = i;
+    std::string a = argv[i];
+    bool keyed = true;
+    if (a == "-c" || a == "-S") compileOnly = true;
+    else if (a.compare(0, 2, "-I") == 0 || a.compare(0, 2, "-D") == 0 || a.compare(0, 2, "-U") == 0)
+      CcArg(argc, argv, i);
+    else if (a == "-o" || a == "-MF" || a == "-MT" || a == "-MQ"){
+      if (i + 1 < argc) i++;
+      keyed = false;
     }
-    else {
-    	outFile << "\nunsigned char blocks[1000]={0};\n";
-    	blockflag+=100000;
-    	std::ofstream outfile("/root/loopconvert.txt");
-        outfile<<blockflag;
-        outfile.close();
+    else if (a == "-x" || a == "-include" || a == "-isystem" || a == "-iquote" || a == "-idirafter"
+             || a == "-target" || a == "-isysroot" || a == "--sysroot"){
+      if (i + 1 < argc) i++;
     }
-	  
+    else if (a[0] != '-'){
+      std::string ext = a.substr(a.rfind('.') == std::string::npos ? a.size() : a.rfind('.'));
+      if (ext == ".c" || ext == ".cc" || ext == ".cpp" || ext == ".cxx") srcs.push_back(a);
+      keyed = false;
+    }
+    for (int k = first; k <= i; k++){
+      args.push_back(argv[k]);
+      if (keyed) cc_key += std::string("\0", 1) + argv[k];
+    }
+  }
+  if (!compileOnly || srcs.size() != 1){
+    const char *cc = getenv("LC_CC") ? getenv("LC_CC") : "clang";
+    argv[0] = (char*)cc;
+    execvp(cc, argv);
+    perror(cc);
+    return 127;
+  }
 
-    // Now output rewritten source code
-    const RewriteBuffer *RewriteBuf =
-      Rewrite.getRewriteBufferFor(compiler.getSourceManager().getMainFileID());
-    outFile << std::string(RewriteBuf->begin(), RewriteBuf->end());
+  struct stat sb;
+  if (stat(srcs[0].c_str(), &sb) == -1){
+    perror(srcs[0].c_str());
+    return 1;
   }
-  else
+
+  llvm::InitializeAllTargets();
+  llvm::InitializeAllTargetMCs();
+  llvm::InitializeAllAsmPrinters();
+  llvm::InitializeAllAsmParsers();
+  IntrusiveRefCntPtr<DiagnosticsEngine> diags = CompilerInstance::createDiagnostics(new DiagnosticOptions());
+  std::shared_ptr<CompilerInvocation> inv = createInvocationFromCommandLine(args, diags);
+  if (!inv){
+    llvm::errs() << "lc-cc: cannot make a compile job of the arguments\n";
+    return 1;
+  }
+
+  // the instrumentation parse sees the file exactly as the compile will
+  cc_inv = inv;
+  std::string code;
+  llvm::raw_string_ostream os(code);
+  editsmode = 0;                                               // the compile needs the whole text
+  RewriteFile(srcs[0], os);
+  os.flush();
+  // the instrumented text replaces the file in memory; #include "..." still searches its directory
+  inv->getPreprocessorOpts().addRemappedFile(srcs[0], llvm::MemoryBuffer::getMemBufferCopy(code, srcs[0]).release());
+  CompilerInstance ci;
+  ci.setInvocation(inv);
+  ci.createDiagnostics();
+  return ExecuteCompilerInvocation(&ci) ? 0 : 1;
+}
+
+// RunMain - one run of the tool, the whole process normally, one forked child in -server mode
+int RunMain(int argc, char **argv)
+{
+
+
+
+
+  struct stat sb;
+
+  if (argc < 2)
   {
-    llvm::errs() << "Cannot open " << outName << " for writing\n";
+     llvm::errs() << "Here is the Usage: CIrewriter <options> <filename>\n";
+     llvm::errs() << "               CIrewriter -server <socket> [warm.c...]\n";
+     return 1;
+  }
+
+  fs = rand();
+  // Get filename
+  std::string fileName(argv[argc - 1]);
+  const char *prog = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+  int ccmode = strcmp(prog, "lc-cc") == 0;
+
+  // Options before the filename, for lc-cc in $LC_FLAGS
+  if (ccmode){
+    std::istringstream flags(getenv("LC_FLAGS") ? getenv("LC_FLAGS") : "");
+    std::vector<std::string> words;
+    std::string w;
+    while (flags >> w) words.push_back(w);
+    std::vector<char*> fargv;
+    for (unsigned i = 0; i < words.size(); i++) fargv.push_back(&words[i][0]);
+    ParseOptions(0, fargv.size(), fargv.data());
+  }
+  else
+    ParseOptions(1, argc - 1, argv);
+  for (int i = 1; i < argc - 1; i++)
+    edits_opts += std::string(i > 1 ? " " : "") + argv[i];
+  // concurrent server requests must not hand out the same block/site ids
+  if (server_child && !rewriteonly){
+    int lock = open(SERVER_LOCK, O_CREAT | O_RDWR, 0644);
+    if (lock == -1 || flock(lock, LOCK_EX) == -1){
+      perror(SERVER_LOCK);
+      return 1;
+    }
   }
+  // opened per run, a server request must not write through the server's copy of an old file
+  out.open("/root/result.txt",std::ios::app);
+  func_blocks.open("/root/func_blocks.txt",std::ios::app);
+
+  // Function ids continue after the functions of earlier runs
+  func_gid_base = CountLines("/root/func_blocks.txt");
+  ReadCounter("loopconvert.txt", pos, pos_gen);
+  ReadCounter("/root/loopconvert.txt", blockflag, block_gen);
+  ReadCounter("/root/lccallsite.txt", cg_next, cg_gen);
+  ReadCounter("/root/lcbranch.txt", br_next, br_gen);
+  ReadCounter("/root/lcloop.txt", loop_next, loop_gen);
+
+  int rc = 0;
+  if (ccmode)
+    rc = CcMain(argc, argv);
+  else
+  {
+    // Make sure it exists
+    if (stat(fileName.c_str(), &sb) == -1)
+    {
+      perror(fileName.c_str());
+      exit(EXIT_FAILURE);
+    }
+
+    // Convert <file>.c to <file_out>.c
+    std::string outName (fileName);
+    size_t ext = outName.rfind(".");
+    if (ext == std::string::npos)
+       ext = outName.length();
+    outName.insert(ext, "_out");
+
+
+    if (editsmode && EditsKept(fileName, outName))
+      llvm::errs() << "edits: " << fileName << " unchanged, " << outName << ".edits kept with its ids\n";
+    else if (editsmode){
+      // only the script is written, EditApply touches outName when its content changes
+      std::string text;
+      llvm::raw_string_ostream os(text);
+      RewriteFile(fileName, os);
+      os.flush();
+      WriteEdits(fileName, outName, text);
+    }
+    else
+    {
+    llvm::errs() << "Output to: " << outName << "\n";
+    std::error_code OutErrorInfo;
+    std::error_code ok;
+    llvm::raw_fd_ostream outFile(llvm::StringRef(outName), OutErrorInfo, llvm::sys::fs::F_None);
+
+
+
+
+
+    //TODO
+
+    if (OutErrorInfo == ok)
+      RewriteFile(fileName, outFile);
+    else
+    {
+      llvm::errs() << "Cannot open " << outName << " for writing\n";
+    }
 
-  outFile.close();
+    outFile.close();
+    }
+  }
 
   //GetThinPath(0x1,715);
   //ResetFuncName();
@@ -1135,8 +3844,159 @@ int main(int argc, char **argv)
   // another output file, containing some information
   if (out.is_open()) out<< " \n";
   out.close();
-  func_blocks<<pos%100000<<"\n";
+  if (func_gid>=0) func_blocks<<pos%100000<<"\n";
   func_blocks.close();
-  return 0;
+  if (cgmode){
+    std::ofstream sitefile("/root/lccallsite.txt");
+    sitefile<<cg_next<<" "<<cg_gen;
+    sitefile.close();
+  }
+  if (brmode){
+    std::ofstream brfile("/root/lcbranch.txt");
+    brfile<<br_next<<" "<<br_gen;
+    brfile.close();
+    std::ofstream brsites("/root/lcbranch_sites.txt",std::ios::app);
+    for (unsigned i = 0; i < br_sites.size(); i++)
+      brsites<<br_sites[i].first<<" "<<br_sites[i].second<<"\n";
+    brsites.close();
+  }
+  if (loopmode){
+    std::ofstream loopfile("/root/lcloop.txt");
+    loopfile<<loop_next<<" "<<loop_gen;
+    loopfile.close();
+    std::ofstream loopsites("/root/lcloop_sites.txt",std::ios::app);
+    for (unsigned i = 0; i < loop_sites.size(); i++)
+      loopsites<<loop_sites[i].first<<" "<<loop_sites[i].second<<"\n";
+    loopsites.close();
+  }
+  if (brhint)
+    llvm::errs() << "branchopt: " << br_hints << " condition(s) annotated\n";
+  if (loophint)
+    llvm::errs() << "loopopt: " << loop_hints << " loop(s) annotated\n";
+  if (hoistmode)
+    llvm::errs() << "hoist: " << hoist_count << " call(s) moved out of loops\n";
+  if (layoutmode)
+    llvm::errs() << "layout: " << layout_records << " struct(s) with padding or cold fields, "
+                 << layout_applied << " rewritten\n";
+  if (soamode)
+    llvm::errs() << "soa: " << soa_converted << " array(s) converted\n";
+  if (ompmode)
+    llvm::errs() << "omp: " << omp_loops << " loop(s) parallelized, " << omp_rejected << " rejected\n";
+  return rc;
+}
+
+// WarmFiles - preprocess a file once in the server, so the FileManager has every header it
+// includes; give it a file that includes the common headers, not the sources being instrumented
+void WarmFiles(const std::string &fileName)
+{
+  CompilerInstance compiler;
+  SetupCompiler(compiler, fileName);
+  Preprocessor &PP = compiler.getPreprocessor();
+  PP.EnterMainSourceFile();
+  Token tok;
+  do
+    PP.Lex(tok);
+  while (tok.isNot(tok::eof));
+  compiler.getDiagnosticClient().EndSourceFile();
+}
+
+// WarmStale - the first file of the warm FileManager that changed since the server read it, ""
+// if none; the FileManager keeps the old size and time, so a changed header would be read stale
+std::string WarmStale()
+{
+  SmallVector<const FileEntry*, 256> files;
+  server_files->GetUniqueIDMapping(files);
+  for (unsigned i = 0; i < files.size(); i++){
+    struct stat sb;
+    if (files[i] && (stat(files[i]->getName().str().c_str(), &sb) == -1 ||
+                     sb.st_mtime != files[i]->getModificationTime() || sb.st_size != files[i]->getSize()))
+      return files[i]->getName().str();
+  }
+  return "";
 }
 
+// ServeRequest - request: cwd, then the arguments of a normal run, each NUL-terminated, and
+// an empty string; stdout and stderr go to the client, then "\0lc-status N\n"
+void ServeRequest(int c)
+{
+  std::string req;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(c, buf, sizeof(buf))) > 0){
+    req.append(buf, n);
+    if (req.size() >= 2 && req[req.size() - 1] == '\0' && req[req.size() - 2] == '\0') break;
+  }
+  std::vector<std::string> words;
+  for (size_t b = 0, e; b < req.size() && (e = req.find('\0', b)) != std::string::npos && e > b; b = e + 1)
+    words.push_back(req.substr(b, e - b));
+  std::string stale = WarmStale();                             // before chdir, the names are the server's
+  if (words.size() < 2 || chdir(words[0].c_str()) == -1){
+    dprintf(c, "bad request%c", 0);
+    _exit(1);
+  }
+  words[0] = "LoopConvert";
+  std::vector<char*> args;
+  for (unsigned i = 0; i < words.size(); i++) args.push_back(&words[i][0]);
+  args.push_back(NULL);
+  dup2(c, 1);
+  dup2(c, 2);
+  if (!stale.empty()){
+    llvm::errs() << "server: " << stale << " changed since it was warmed, parsing without the warm"
+                 << " headers; restart the server\n";
+    server_files = nullptr;
+  }
+  int rc = RunMain(words.size(), args.data());
+  llvm::outs().flush();
+  llvm::errs().flush();
+  fflush(stdout);
+  dprintf(c, "%clc-status %d\n", 0, rc);
+  _exit(0);
+}
+
+// ServerMain - -server sock [warm.c...]: accept requests on a Unix socket (lcclient sends them)
+// and run each in a forked child. The child starts from the server's state, so the global options
+// and counters are fresh and the warm FileManager is shared unless a warm file has changed since;
+// requests run concurrently, except that the ones that assign ids take SERVER_LOCK
+int ServerMain(int argc, char **argv)
+{
+  const char *path = argv[2];
+  server_files = new FileManager(FileSystemOptions());
+  for (int i = 3; i < argc; i++)
+    WarmFiles(argv[i]);
+
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+  if (s == -1 || bind(s, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(s, 64) == -1){
+    perror(path);
+    return 1;
+  }
+  signal(SIGCHLD, SIG_IGN);                                    // children are reaped by the kernel
+  llvm::errs() << "server: listening on " << path << ", " << argc - 3 << " warm file(s)\n";
+  for (;;){
+    int c = accept(s, NULL, NULL);
+    if (c == -1){
+      if (errno == EINTR) continue;
+      perror("accept");
+      return 1;
+    }
+    pid_t pid = fork();
+    if (pid == 0){
+      close(s);
+      server_child = 1;
+      ServeRequest(c);
+    }
+    if (pid == -1) perror("fork");
+    close(c);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  if (argc >= 3 && strcmp(argv[1], "-server") == 0)
+    return ServerMain(argc, argv);
+  return RunMain(argc, argv);
+}
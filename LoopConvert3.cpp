@@ -26,6 +26,8 @@
 #include "clang/Rewrite/Frontend/Rewriters.h"
 #include "clang/Rewrite/Core/Rewriter.h"
 #include "clang/AST/ASTContext.h"
+#include "clang/AST/ParentMap.h"
+#include "clang/Analysis/CFG.h"
 
 #include "clang-c/Index.h"
 #include <algorithm>
@@ -37,6 +39,7 @@
 
 // Declares clang::SyntaxOnlyAction.
 #include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/ASTUnit.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
 // Declares llvm::cl::extrahelp.
@@ -45,9 +48,15 @@
 #include "iostream"
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <algorithm>
 #include <vector>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include "llvm/ADT/Hashing.h"
 
 
 using namespace clang::tooling;
@@ -55,9 +64,6 @@ using namespace llvm;
 using namespace clang;
 using namespace clang::ast_matchers;
 
-const int BUFSIZE = 80;
-std::string checkDataFileName = "checkData1.txt";//存入遍历free时得到的信息
-
 typedef struct checkPoint{
     //std::string flagName;
     std::string name;//插入点的变量
@@ -65,15 +71,83 @@ typedef struct checkPoint{
     std::string declName;//原先定义的位置,先保留不用
     int declRow,declCol;   
 }checkPoint;
-std::vector<checkPoint> cpVec;//存malloc时得到的点
-std::vector<checkPoint> cpVecF;//存free时得到的点,临时使用
+
+//插装点的索引:文件ID+行号+变量名,查找是O(1)的,不用每次扫一遍vector
+struct siteKey{
+    unsigned fid;
+    int row;
+    std::string declName;
+    bool operator==(const siteKey &o) const {
+        return fid == o.fid && row == o.row && declName == o.declName;
+    }
+};
+struct siteKeyHash{
+    size_t operator()(const siteKey &k) const {
+        return llvm::hash_combine(k.fid,k.row,k.declName);
+    }
+};
+
+class siteStore{
+public:
+    //同一个key只留第一次的
+    void add(const siteKey &k,const checkPoint &cp){
+        if(index.insert(std::make_pair(k,(unsigned)sites.size())).second)
+            sites.push_back(cp);
+    }
+    const checkPoint *find(const siteKey &k) const {
+        std::unordered_map<siteKey,unsigned,siteKeyHash>::const_iterator it = index.find(k);
+        return it == index.end() ? NULL : &sites[it->second];
+    }
+    std::vector<checkPoint> sites;//按加入的顺序,写checkStruct.txt用
+private:
+    std::unordered_map<siteKey,unsigned,siteKeyHash> index;
+};
+
+siteStore cpVec;//存malloc时得到的点
+siteStore cpVecF;//存free时得到的点,临时使用
 
 Rewriter rewrite;
 
-//将loc的string信息变为row,col
-inline void loc_strToint(int & int_loc_row,int & int_loc_col,const char*str_loc){
-    char buf[BUFSIZE];
-    sscanf(str_loc,"%[^:]:%d:%d",buf,&int_loc_row,&int_loc_col);
+//逃逸分析证明成对的malloc/free,不用插装
+std::unordered_set<siteKey,siteKeyHash> elideMallocSet;
+std::unordered_set<siteKey,siteKeyHash> elideFreeSet;
+int probesRemoved = 0;
+
+//-reuse-alloc: 循环体里成对的malloc/free改成循环外的一块缓冲区
+bool reuseMode = false;
+int reuseNext = 0;
+std::set<unsigned> reuseCalls;//已经被-reuse-alloc改写的malloc/free调用位置
+
+//-pool: 选定的结构体类型的malloc(sizeof(T))/free改成lcpool.h的对象池
+std::set<std::string> poolTypes;//命令行给的类型名
+struct poolSite{
+    std::string tag;//池的名字,结构体名
+    SourceLocation callee;//malloc/free这个名字的位置
+    bool isFree;
+    int row;
+};
+std::vector<poolSite> poolSites;
+std::map<std::string,std::string> poolBad;//tag -> 不能用池的原因
+
+//直接从SourceManager取行号,列号,不再printToString再sscanf
+inline void loc_getRowCol(const SourceManager &SM,SourceLocation loc,int &row,int &col){
+    row = SM.getSpellingLineNumber(loc);
+    col = SM.getSpellingColumnNumber(loc);
+}
+inline unsigned loc_getFileID(const SourceManager &SM,SourceLocation loc){
+    return SM.getFileID(SM.getSpellingLoc(loc)).getHashValue();
+}
+//变量名:是DeclRefExpr就用它的声明,不然就用源码文本
+inline std::string exprVarName(const Expr *E,const std::string &text){
+    const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+    return DRE ? DRE->getDecl()->getNameAsString() : text;
+}
+inline siteKey makeSiteKey(const SourceManager &SM,SourceLocation loc,const std::string &declName){
+    siteKey k;
+    k.fid = loc_getFileID(SM,loc);
+    k.row = SM.getSpellingLineNumber(loc);
+    k.declName = declName;
+    return k;
 }
 
 
@@ -102,6 +176,10 @@ bool MyASTConsumer::HandleTopLevelDecl(DeclGroupRef d)
   typedef DeclGroupRef::iterator iter;
 
   for (iter b = d.begin(), e = d.end(); b != e; ++b){
+    //头文件里的声明不进去遍历
+    SourceManager &SM = rv.Rewrite.getSourceMgr();
+    if(!SM.isInMainFile(SM.getExpansionLoc((*b)->getLocation())))
+        continue;
     rv.TraverseDecl(*b);
   }
   return true; // keep going
@@ -110,8 +188,10 @@ bool MyASTConsumer::HandleTopLevelDecl(DeclGroupRef d)
 //---跟以前的一样
 
 
+//插装只输出主文件,头文件里的malloc/free不匹配(-pool的匹配除外,头文件里的调用也要看到)
 //匹配到malloc()里的变量
 StatementMatcher MallocVarMatcher =     declRefExpr(
+                                            isExpansionInMainFile(),
                                             hasParent(
                                                 binaryOperator(
                                                     hasOperatorName("="),
@@ -139,6 +219,7 @@ StatementMatcher MallocVarMatcher =     declRefExpr(
 
 //匹配到malloc()那个二元表达式
 StatementMatcher MallocMatcher =        binaryOperator(
+                                            isExpansionInMainFile(),
                                             hasOperatorName("="),
                                             //hasLHS(anything()),
                                             hasRHS(
@@ -162,6 +243,7 @@ StatementMatcher MallocMatcher =        binaryOperator(
 
 //匹配到free()的表达式                                                
 StatementMatcher FreeMatcher =  callExpr(
+                                    isExpansionInMainFile(),
                                     has(
                                         declRefExpr(
                                             to(
@@ -173,7 +255,7 @@ StatementMatcher FreeMatcher =  callExpr(
                                     )
                                 ).bind("free");
 //匹配到free()里的变量
-StatementMatcher FreeVarMatcher = declRefExpr(hasParent(implicitCastExpr(hasParent(implicitCastExpr(hasParent(callExpr(has(declRefExpr(to(functionDecl(hasName("free")))))))))))).bind("freeVar");                
+StatementMatcher FreeVarMatcher = declRefExpr(isExpansionInMainFile(),hasParent(implicitCastExpr(hasParent(implicitCastExpr(hasParent(callExpr(has(declRefExpr(to(functionDecl(hasName("free")))))))))))).bind("freeVar");                
 
 
 
@@ -194,29 +276,22 @@ public:
         checkPoint cp;
       
 	
+		//左子树得到的 = 的左边
+        Expr * lhs = BO->getLHS();
+        cp.name = rewrite.ConvertToString((Stmt*)lhs);
+
 		//得到插装位置,找到mallocVarMatcher之前对应匹配到的信息(其实可以不用MallocVarMatcher,MallocVarMatcher只能匹配到纯粹的指针(不带*的))
-        std::string str_locEnd = locEnd.printToString(*SM);
-        loc_strToint(cp.row,cp.col,str_locEnd.c_str());
-        bool findFlag = false;
-        int findI;
+        loc_getRowCol(*SM,locEnd,cp.row,cp.col);
+        siteKey key = makeSiteKey(*SM,lhs->getBeginLoc(),exprVarName(lhs,cp.name));
+        bool findFlag = cpVec.find(key) != NULL;
         
         #ifdef DEBUG
         llvm::errs() <<"binary loc:" <<"|"<<cp.row<<"|"<<cp.col<<"\n";
         #endif
-        
-        for(unsigned i=0;i<cpVec.size();++i){
-            if(cpVec[i].row == cp.row){
-                    findFlag = true;
-                    findI = i;
-                    break;
-                }
+        if(elideMallocSet.count(key)){
+            probesRemoved++;
+            return ;
         }
-		//左子树得到的 = 的左边
-        Expr * lhs = BO->getLHS();
-        cp.name = ConvertToString((Stmt*)lhs);
-        std::string SStr;
-        llvm::raw_string_ostream S(SStr);
-        lhs->printPretty
         
         QualType qt = lhs->getType();
         #ifdef DEBUG
@@ -231,8 +306,7 @@ public:
             std::string str_decl = ND->getNameAsString();
             cp.declName = str_decl;
             SourceLocation declLocStart = ND->getBeginLoc();
-            std::string str_declLocStart = declLocStart.printToString(*SM);
-            loc_strToint(cp.declRow,cp.declCol,str_declLocStart.c_str());
+            loc_getRowCol(*SM,declLocStart,cp.declRow,cp.declCol);
         
         }else{//没找到的话,添加进来
             cp.declName = cp.name;
@@ -247,30 +321,9 @@ public:
         sprintf(buf[2],"%d",cp.declRow);
         sprintf(buf[3],"%d",cp.declCol);  
                                      
-        //将程序运行时的指针值存下来 %x                                     
+        //把程序运行时的指针值写进共享内存环(allocring.h),由AllocCollector汇总,不再每次开文件写FIFO
         std::string str_insert = 
-        "\n{\n\tFILE *fp = fopen(\"" + checkDataFileName +"\",\"a\");\n"
-        "\tif(fp == NULL){\n" +
-        "\t\tprintf(\"fail to open file " + checkDataFileName + "!\\n\");\n" +
-        "\t\texit(-1);\n" + 
-        "\t}\n" + 
-        
-        //"\tfprintf(fp,\"m " + cp.name + " " + buf[0] + " " + buf[1] + " " + cp.declName + " " + buf[2] + " " + buf[3] + " %x \\n\"," + cp.name + ");\n" +
-        "\tfprintf(fp,\"m " + cp.name + " " + buf[0] + " " + buf[1] + " %x \\n\"," + cp.name + ");\n" +
-        "\tfclose(fp);\n\n" +
-        "\tint fd=open(FIFO_SERVER,O_WRONLY |O_NONBLOCK,0);\n" + 
-        "\tif(fd==-1){perror(\"open\");exit(1);}\n" + 
-        "\tchar w_buf[100];\n" + 
-        "\tsprintf(w_buf,\"m "+ cp.name + " " + buf[0] + " " + buf[1] + " %x \\n\"," + cp.name + ");\n" + 
-        "\tif(write(fd,w_buf,100)==-1){\n" + 
-        "\t\tif(errno==EAGAIN)\n" + 
-        "\t\t\tprintf(\"The FIFO has not been read yet.Please try later\\n\");\n" + 
-        "\t}\n" + 
-        "\telse\n" + 
-        "\t\tprintf(\"write %s to the FIFO\\n\",w_buf);\n" +
-        "\tsleep(1);\n" + 
-        "\tclose(fd);\n" + 
-        "}\n";
+        "\n__lc_alloc_event('m'," + std::string(buf[0]) + "," + buf[1] + ",(const void *)(" + cp.name + "));\n";
         
         
         
@@ -281,7 +334,7 @@ public:
         rewrite.InsertText(SL_locWithOffset,str_insert.c_str(),true,true); 
         
 		if(!findFlag){        
-            cpVec.push_back(cp);
+            cpVec.add(key,cp);
         }
 
         #ifdef DEBUG
@@ -309,24 +362,25 @@ public:
         cp.name = rewrite.ConvertToString((Stmt*)arg);
         
         SourceLocation locStart = CE->getBeginLoc();
-        std::string str_locStart = locStart.printToString(*SM);
-        loc_strToint(cp.row,cp.col,str_locStart.c_str());
+        loc_getRowCol(*SM,locStart,cp.row,cp.col);
+        siteKey key = makeSiteKey(*SM,arg->getBeginLoc(),exprVarName(arg,cp.name));
         
         #ifdef DEBUG
-        llvm::errs()<<"cp:"<<cp.row<<" "<<cp.col<<" " + str_locStart + "\n";
+        llvm::errs()<<"cp:"<<cp.row<<" "<<cp.col<<"\n";
         #endif
+        if(elideFreeSet.count(key)){
+            probesRemoved++;
+            return ;
+        }
         
         bool findFlag = false;
-        for(unsigned i=0;i<cpVecF.size();++i){
-            if(cp.name == cpVecF[i].name &&
-             cp.row == cpVecF[i].row){
-                findFlag = true;
-                cp.col = cpVecF[i].col;
-                cp.declName = cpVecF[i].declName;
-                cp.declRow = cpVecF[i].declRow;
-                cp.declCol = cpVecF[i].declCol;
-                break;
-            }
+        const checkPoint *found = cpVecF.find(key);
+        if(found){
+            findFlag = true;
+            cp.col = found->col;
+            cp.declName = found->declName;
+            cp.declRow = found->declRow;
+            cp.declCol = found->declCol;
         }
         if(!findFlag){
             cp.declName = cp.name;
@@ -339,29 +393,9 @@ public:
         sprintf(buf[1],"%d",cp.col);
         sprintf(buf[2],"%d",cp.declRow);
         sprintf(buf[3],"%d",cp.declCol);                        
-		//之后可以进行开文件的优化
+		//同malloc,写进共享内存环
         std::string str_insert = 
-        "\n{\n\tFILE *fp = fopen(\"" + checkDataFileName +"\",\"a\");\n"
-        "\tif(fp == NULL){\n" +
-        "\t\tprintf(\"fail to open file " + checkDataFileName + "!\\n\");\n" +
-        "\t\texit(-1);\n" + 
-        "\t}\n"  + 
-        //"\tfprintf(fp,\"f " + cp.name + " " + buf[0] + " " + buf[1] + " " + cp.declName + " " + buf[2] + " " + buf[3] + " %x \\n\"," + cp.name + ");\n" +
-        "\tfprintf(fp,\"f " + cp.name + " " + buf[0] + " " + buf[1] + " %x \\n\"," + cp.name + ");\n" +
-        "\tfclose(fp);\n" +
-        "\tint fd=open(FIFO_SERVER,O_WRONLY |O_NONBLOCK,0);\n" + 
-        "\tif(fd==-1){perror(\"open\");exit(1);}\n" + 
-        "\tchar w_buf[100];\n" + 
-        "\tsprintf(w_buf,\"f "+ cp.name + " " + buf[0] + " " + buf[1] + " %x \\n\"," + cp.name + ");\n" + 
-        "\tif(write(fd,w_buf,100)==-1){\n" + 
-        "\t\tif(errno==EAGAIN)\n" + 
-        "\t\t\tprintf(\"The FIFO has not been read yet.Please try later\\n\");\n" + 
-        "\t}\n" + 
-        "\telse\n" + 
-        "\t\tprintf(\"write %s to the FIFO\\n\",w_buf);\n" +
-        "\tsleep(1);\n" + 
-        "\tclose(fd);\n" + 
-        "}\n";
+        "\n__lc_alloc_event('f'," + std::string(buf[0]) + "," + buf[1] + ",(const void *)(" + cp.name + "));\n";
         
 
        // llvm::errs() << "-----\n"<<str_insert<<"\n----\n";
@@ -393,16 +427,14 @@ public:
         cp.declName = str_decl;
        
         SourceLocation declLocStart = ND->getBeginLoc();
-        std::string str_declLocStart = declLocStart.printToString(*SM);
-        loc_strToint(cp.declRow,cp.declCol,str_declLocStart.c_str());
+        loc_getRowCol(*SM,declLocStart,cp.declRow,cp.declCol);
 
         SourceLocation locStart = DRE->getBeginLoc();
-        std::string str_locStart = locStart.printToString(*SM);
-        loc_strToint(cp.row,cp.col,str_locStart.c_str());
+        loc_getRowCol(*SM,locStart,cp.row,cp.col);
 
 
         
-        cpVecF.push_back(cp);
+        cpVecF.add(makeSiteKey(*SM,locStart,cp.declName),cp);
     #ifdef DEBUG
     llvm::errs()<<"----DRE(freeVar) end----\n";
     #endif
@@ -422,10 +454,8 @@ public:
         const SourceManager *SM = Result.SourceManager;
         SourceLocation locStart = DRE->getBeginLoc();
         
-        std::string str_locStart = locStart.printToString(*SM);
-        
         checkPoint cp;
-        loc_strToint(cp.row,cp.col,str_locStart.c_str());
+        loc_getRowCol(*SM,locStart,cp.row,cp.col);
 
 
         cp.name = rewrite.ConvertToString((Stmt*)DRE);
@@ -436,8 +466,7 @@ public:
         cp.declName = ND->getNameAsString();
         
         SourceLocation declLocStart = ND->getBeginLoc();
-        std::string str_declLocStart = declLocStart.printToString(*SM);
-        loc_strToint(cp.declRow,cp.declCol,str_declLocStart.c_str());
+        loc_getRowCol(*SM,declLocStart,cp.declRow,cp.declCol);
         
         #ifdef DEBUG
         llvm::errs()<<"\ncp: "
@@ -445,7 +474,7 @@ public:
         #endif
 
         
-        cpVec.push_back(cp);
+        cpVec.add(makeSiteKey(*SM,locStart,cp.declName),cp);
         
         #ifdef DEBUG
         llvm::errs() << cp.name << "|\n" <<  cp.declName <<"|\n"
@@ -462,11 +491,467 @@ public:
 };
 
 
+//---逃逸分析: 局部指针只在本函数里malloc一次,没有逃出去,并且每条路径上都free了,就不用运行时跟踪
+
+//不会把指针存起来的库函数
+static const char *noCaptureFuncs[] = {
+    "strlen","strcmp","strncmp","memcmp","printf","fprintf","sprintf","snprintf",
+    "puts","fputs","fwrite","fread","sscanf","atoi","atol","atof","strtol","strtoul","strtod",NULL
+};
+//返回值就是参数指针的库函数,只有返回值没被用到的时候才算不逃逸
+static const char *retArgFuncs[] = {
+    "memset","memcpy","memmove","strcpy","strncpy","strcat","strncat","fgets",NULL
+};
+
+static bool inFuncList(const char **list,const std::string &name){
+    for(int i=0;list[i]!=NULL;++i){
+        if(name == list[i]) return true;
+    }
+    return false;
+}
+
+static bool isCallTo(const Stmt *S,const char *name){
+    const CallExpr *CE = dyn_cast_or_null<CallExpr>(S);
+    if(!CE) return false;
+    const FunctionDecl *FD = CE->getDirectCallee();
+    return FD && FD->getNameAsString() == name;
+}
+
+static bool refersTo(const Expr *E,const VarDecl *VD){
+    const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+    return DRE && DRE->getDecl() == VD;
+}
+
+//找到语句所在的函数
+static const FunctionDecl *getEnclosingFunction(const Stmt *S,ASTContext &Ctx){
+    ast_type_traits::DynTypedNode node = ast_type_traits::DynTypedNode::create(*S);
+    for(;;){
+        ASTContext::DynTypedNodeList parents = Ctx.getParents(node);
+        if(parents.empty()) return NULL;
+        node = parents[0];
+        if(const FunctionDecl *FD = node.get<FunctionDecl>()) return FD;
+    }
+}
+
+class VarUseCollector : public RecursiveASTVisitor<VarUseCollector>{
+public:
+    VarUseCollector(const VarDecl *V) : VD(V) { }
+    bool VisitDeclRefExpr(DeclRefExpr *DRE){
+        if(DRE->getDecl() == VD) uses.push_back(DRE);
+        return true;
+    }
+    const VarDecl *VD;
+    std::vector<DeclRefExpr*> uses;
+};
+
+//变量的每一次使用都是安全的才算不逃逸; BO必须是唯一一次malloc赋值, frees收集所有free(VD)
+static bool varNotEscaping(Stmt *body,const VarDecl *VD,const BinaryOperator *BO,
+                           std::vector<const CallExpr*> &frees){
+    VarUseCollector collector(VD);
+    collector.TraverseStmt(body);
+    ParentMap PM(body);
+
+    for(unsigned i=0;i<collector.uses.size();++i){
+        DeclRefExpr *DRE = collector.uses[i];
+        Stmt *P = PM.getParentIgnoreParenImpCasts(DRE);
+        if(!P) return false;
+
+        if(const BinaryOperator *B = dyn_cast<BinaryOperator>(P)){
+            if(B->isAssignmentOp() && refersTo(B->getLHS(),VD)){
+                //除了匹配到的malloc,任何赋值都不行:p = NULL之后free(p)释放的不是这块内存
+                if(B == BO) continue;
+                return false;
+            }
+            if(B->isComparisonOp()) continue;
+            return false;
+        }
+        if(const CallExpr *CE = dyn_cast<CallExpr>(P)){
+            if(CE->getCallee()->IgnoreParenImpCasts() == DRE) return false;
+            const FunctionDecl *FD = CE->getDirectCallee();
+            if(!FD) return false;
+            std::string fname = FD->getNameAsString();
+            if(fname == "free"){
+                frees.push_back(CE);
+                continue;
+            }
+            if(inFuncList(noCaptureFuncs,fname)) continue;
+            if(inFuncList(retArgFuncs,fname)){
+                Stmt *callParent = PM.getParent(const_cast<CallExpr*>(CE));
+                if(callParent && isa<CompoundStmt>(callParent)) continue;
+            }
+            return false;
+        }
+        if(const ArraySubscriptExpr *AS = dyn_cast<ArraySubscriptExpr>(P)){
+            if(refersTo(AS->getBase(),VD)) continue;
+            return false;
+        }
+        if(const MemberExpr *ME = dyn_cast<MemberExpr>(P)){
+            if(ME->isArrow()) continue;
+            return false;
+        }
+        if(const UnaryOperator *UO = dyn_cast<UnaryOperator>(P)){
+            if(UO->getOpcode() == UO_Deref || UO->getOpcode() == UO_LNot) continue;
+            return false;
+        }
+        if(const IfStmt *If = dyn_cast<IfStmt>(P)){
+            if(refersTo(If->getCond(),VD)) continue;
+            return false;
+        }
+        if(const WhileStmt *While = dyn_cast<WhileStmt>(P)){
+            if(refersTo(While->getCond(),VD)) continue;
+            return false;
+        }
+        //return, 给别的变量初始化, 取地址, 传给不认识的函数...都算逃逸
+        return false;
+    }
+    return true;
+}
+
+//在CFG上从malloc往后走,每条到出口的路径都要先碰到free;又绕回malloc所在的块也不行
+static bool freedOnAllPaths(const FunctionDecl *FD,ASTContext &Ctx,const BinaryOperator *BO,
+                            const std::vector<const CallExpr*> &frees){
+    std::unique_ptr<CFG> cfg = CFG::buildCFG(FD,FD->getBody(),&Ctx,CFG::BuildOptions());
+    if(!cfg) return false;
+
+    std::set<const Stmt*> freeStmts(frees.begin(),frees.end());
+    const CFGBlock *mallocBlock = NULL;
+    bool freedInBlock = false;
+    for(CFG::const_iterator I = cfg->begin(),E = cfg->end();I != E && !mallocBlock;++I){
+        const CFGBlock *B = *I;
+        bool seen = false;
+        for(CFGBlock::const_iterator EI = B->begin(),EE = B->end();EI != EE;++EI){
+            Optional<CFGStmt> CS = EI->getAs<CFGStmt>();
+            if(!CS) continue;
+            if(CS->getStmt() == BO) seen = true;
+            else if(seen && freeStmts.count(CS->getStmt())) freedInBlock = true;
+        }
+        if(seen) mallocBlock = B;
+    }
+    if(!mallocBlock) return false;
+    if(freedInBlock) return true;
+
+    std::vector<const CFGBlock*> work;
+    std::set<const CFGBlock*> visited;
+    for(CFGBlock::const_succ_iterator SI = mallocBlock->succ_begin();SI != mallocBlock->succ_end();++SI){
+        if(*SI) work.push_back(*SI);
+    }
+    while(!work.empty()){
+        const CFGBlock *B = work.back();
+        work.pop_back();
+        if(B == mallocBlock || B == &cfg->getExit()) return false;
+        if(!visited.insert(B).second) continue;
+
+        bool freed = false;
+        for(CFGBlock::const_iterator EI = B->begin(),EE = B->end();EI != EE && !freed;++EI){
+            Optional<CFGStmt> CS = EI->getAs<CFGStmt>();
+            if(CS && freeStmts.count(CS->getStmt())) freed = true;
+        }
+        if(freed) continue;
+        for(CFGBlock::const_succ_iterator SI = B->succ_begin();SI != B->succ_end();++SI){
+            if(*SI) work.push_back(*SI);
+        }
+    }
+    return true;
+}
+
+class EscapePrinter : public MatchFinder::MatchCallback{
+public:
+    virtual void run(const MatchFinder::MatchResult &Result){
+        const BinaryOperator* BO = Result.Nodes.getNodeAs<BinaryOperator>("malloc");
+        if(!BO)   return ;
+        const SourceManager *SM = Result.SourceManager;
+        ASTContext &Ctx = *Result.Context;
+
+        const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(BO->getLHS()->IgnoreParenImpCasts());
+        if(!DRE) return ;
+        const VarDecl *VD = dyn_cast<VarDecl>(DRE->getDecl());
+        if(!VD || !VD->hasLocalStorage()) return ;
+        const FunctionDecl *FD = getEnclosingFunction(BO,Ctx);
+        if(!FD || !FD->hasBody()) return ;
+
+        std::vector<const CallExpr*> frees;
+        if(!varNotEscaping(FD->getBody(),VD,BO,frees) || frees.empty()) return ;
+        if(!freedOnAllPaths(FD,Ctx,BO,frees)) return ;
+
+        std::string name = VD->getNameAsString();
+        elideMallocSet.insert(makeSiteKey(*SM,BO->getLHS()->getBeginLoc(),name));
+        for(unsigned i=0;i<frees.size();++i){
+            elideFreeSet.insert(makeSiteKey(*SM,frees[i]->getArg(0)->getBeginLoc(),name));
+        }
+        #ifdef DEBUG
+        llvm::errs()<<"escape: "<<VD->getNameAsString()<<" in "<<FD->getNameAsString()<<" needs no tracking\n";
+        #endif
+    }
+};
+
+
+//---循环里的malloc/free: 同一个循环体里先malloc再free,每一轮都重新分配,改成在循环外分配一次
+
+//语句的父节点,只看第一个
+static const Stmt *parentStmt(const Stmt *S,ASTContext &Ctx){
+    ASTContext::DynTypedNodeList parents = Ctx.getParents(*S);
+    return parents.empty() ? NULL : parents[0].get<Stmt>();
+}
+
+//循环里有return/goto的话,缓冲区就漏在循环外面了
+class JumpFinder : public RecursiveASTVisitor<JumpFinder>{
+public:
+    JumpFinder() : found(false) { }
+    bool VisitReturnStmt(ReturnStmt *){ found = true; return false; }
+    bool VisitGotoStmt(GotoStmt *){ found = true; return false; }
+    bool VisitIndirectGotoStmt(IndirectGotoStmt *){ found = true; return false; }
+    bool found;
+};
+
+class ReusePrinter : public MatchFinder::MatchCallback{
+public:
+    virtual void run(const MatchFinder::MatchResult &Result){
+        const BinaryOperator* BO = Result.Nodes.getNodeAs<BinaryOperator>("malloc");
+        if(!BO)   return ;
+        const SourceManager *SM = Result.SourceManager;
+        ASTContext &Ctx = *Result.Context;
+        if(BO->getBeginLoc().isMacroID() || BO->getEndLoc().isMacroID()) return ;
+
+        const DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(BO->getLHS()->IgnoreParenImpCasts());
+        if(!DRE) return ;
+        const VarDecl *VD = dyn_cast<VarDecl>(DRE->getDecl());
+        if(!VD) return ;
+        const CallExpr *CE = dyn_cast<CallExpr>(BO->getRHS()->IgnoreParenCasts());
+        if(!CE || CE->getNumArgs() != 1) return ;
+
+        //malloc赋值要直接是循环体里的一条语句
+        const CompoundStmt *body = dyn_cast_or_null<CompoundStmt>(parentStmt(BO,Ctx));
+        if(!body) return ;
+        const Stmt *loop = parentStmt(body,Ctx);
+        if(!loop) return ;
+        const char *loopKind;
+        if(const ForStmt *FS = dyn_cast<ForStmt>(loop)){
+            if(FS->getBody() != body) return ;
+            loopKind = "for";
+        }else if(const WhileStmt *WS = dyn_cast<WhileStmt>(loop)){
+            if(WS->getBody() != body) return ;
+            loopKind = "while";
+        }else return ;
+
+        //循环体里只有这一次malloc,没有逃逸,并且只有一个free,在malloc后面,也是循环体里的一条语句
+        std::vector<const CallExpr*> frees;
+        if(!varNotEscaping(const_cast<CompoundStmt*>(body),VD,BO,frees) || frees.size() != 1) return ;
+        const CallExpr *FCE = frees[0];
+        if(parentStmt(FCE,Ctx) != body || FCE->getBeginLoc().isMacroID()) return ;
+        bool afterMalloc = false,freeFound = false;
+        for(CompoundStmt::const_body_iterator I = body->body_begin();I != body->body_end();++I){
+            if(*I == BO) afterMalloc = true;
+            else if(*I == FCE){
+                freeFound = afterMalloc;
+                break;
+            }
+        }
+        if(!freeFound) return ;
+        JumpFinder jumps;
+        jumps.TraverseStmt(const_cast<CompoundStmt*>(body));
+        if(jumps.found) return ;
+
+        //大小是常量就在循环前按这个大小分配好,否则第一次用到的时候分配,不够大再换
+        const Expr *sizeArg = CE->getArg(0);
+        std::string sizeText = rewrite.ConvertToString((Stmt*)sizeArg);
+        Expr::EvalResult R;
+        bool constSize = sizeArg->EvaluateAsInt(R,Ctx);
+        char buf[64],cap[64];
+        int id = reuseNext++;
+        sprintf(buf,"__lc_buf%d",id);
+        sprintf(cap,"__lc_cap%d",id);
+
+        std::string str_before;
+        if(constSize){
+            std::string n = R.Val.getInt().toString(10,false);
+            str_before = "{void *" + std::string(buf) + " = malloc(" + n + "); size_t " + cap +
+                         " = " + buf + " != NULL ? " + n + " : 0;\n";
+        }else{
+            str_before = "{void *" + std::string(buf) + " = NULL; size_t " + cap + " = 0;\n";
+        }
+        SourceLocation loopEnd = Lexer::getLocForEndOfToken(loop->getEndLoc(),0,*SM,Ctx.getLangOpts());
+        rewrite.InsertText(loop->getBeginLoc(),str_before,true,true);
+        rewrite.InsertText(loopEnd,"\nfree(" + std::string(buf) + ");}",true,true);
+        rewrite.ReplaceText(SourceRange(CE->getBeginLoc(),CE->getEndLoc()),
+                            "__lc_reuse_buf(&" + std::string(buf) + ",&" + cap + ",(" + sizeText + "))");
+        rewrite.ReplaceText(SourceRange(FCE->getBeginLoc(),FCE->getEndLoc()),"(void)0");
+        reuseCalls.insert(CE->getBeginLoc().getRawEncoding());
+        reuseCalls.insert(FCE->getBeginLoc().getRawEncoding());
+
+        //这一对不再是一次分配一次释放,不插跟踪代码
+        std::string name = VD->getNameAsString();
+        elideMallocSet.insert(makeSiteKey(*SM,BO->getLHS()->getBeginLoc(),name));
+        elideFreeSet.insert(makeSiteKey(*SM,FCE->getArg(0)->getBeginLoc(),name));
+
+        llvm::errs() << "reuse-alloc: " << name << " at line " << SM->getSpellingLineNumber(BO->getBeginLoc())
+                     << " (free at line " << SM->getSpellingLineNumber(FCE->getBeginLoc()) << ") moved out of the "
+                     << loopKind << " loop at line " << SM->getSpellingLineNumber(loop->getBeginLoc())
+                     << (constSize ? ", allocated once before the loop\n" : ", grown on demand\n");
+    }
+};
+
+
+//---对象池: 指向选定结构体的指针,malloc(sizeof(T))换成池里取,free换成还给池
+
+//指针指向的结构体如果是选定的类型,返回池的名字(结构体名,匿名的用typedef名),否则返回空串
+static std::string poolTagOf(QualType qt){
+    const PointerType *PT = qt->getAs<PointerType>();
+    if(!PT) return "";
+    QualType pointee = PT->getPointeeType().getUnqualifiedType();
+    const RecordType *RT = pointee->getAs<RecordType>();
+    if(!RT) return "";
+    const RecordDecl *RD = RT->getDecl();
+    std::string tag = RD->getNameAsString();
+    if(tag.empty() && RD->getTypedefNameForAnonDecl())
+        tag = RD->getTypedefNameForAnonDecl()->getNameAsString();
+    if(tag.empty()) return "";
+    if(poolTypes.count(tag) || poolTypes.count(pointee.getAsString()) ||
+       poolTypes.count(pointee.getCanonicalType().getAsString()))
+        return tag;
+    return "";
+}
 
+//malloc/calloc/realloc的结果最后被转成什么类型:往上跳过括号和转换
+static QualType allocResultType(const CallExpr *CE,ASTContext &Ctx){
+    const Expr *E = CE;
+    for(;;){
+        const Stmt *P = parentStmt(E,Ctx);
+        if(!P || !(isa<ImplicitCastExpr>(P) || isa<CStyleCastExpr>(P) || isa<ParenExpr>(P))) break;
+        E = cast<Expr>(P);
+    }
+    return E->getType();
+}
+
+//指向选定类型的指针在malloc/free以外被转成void*或别的指针: 可能被别的代码free或者当成别的对象用,整个类型不换
+static void poolCast(const CastExpr *CA,const SourceManager *SM,ASTContext &Ctx){
+    std::string tag = poolTagOf(CA->getSubExpr()->getType());
+    if(tag.empty() || poolTagOf(CA->getType()) == tag) return ;
+    if(!CA->getType()->isPointerType() && CA->getCastKind() != CK_PointerToIntegral) return ;
+    //free(p)的实参转成void*是正常的
+    const Stmt *P = CA;
+    do P = parentStmt(P,Ctx);
+    while(P && (isa<ImplicitCastExpr>(P) || isa<CStyleCastExpr>(P) || isa<ParenExpr>(P)));
+    if(const CallExpr *CE = dyn_cast_or_null<CallExpr>(P))
+        if(const FunctionDecl *FD = CE->getDirectCallee())
+            if(FD->getNameAsString() == "free") return ;
+    char buf[32];
+    sprintf(buf,"%d",SM->getSpellingLineNumber(CA->getBeginLoc()));
+    poolBad.insert(std::make_pair(tag,"line " + std::string(buf) + " converts it to " + CA->getType().getAsString()));
+}
+
+//只有 malloc(sizeof(T)) 能换; 同一个类型有calloc/realloc/数组malloc的话整个类型都不换,
+//否则池里的对象和malloc的对象会混在一起被free
+class PoolPrinter : public MatchFinder::MatchCallback{
+public:
+    virtual void run(const MatchFinder::MatchResult &Result){
+        if(const CastExpr *CA = Result.Nodes.getNodeAs<CastExpr>("poolCast")){
+            poolCast(CA,Result.SourceManager,*Result.Context);
+            return ;
+        }
+        const CallExpr* CE = Result.Nodes.getNodeAs<CallExpr>("poolCall");
+        if(!CE || CE->getNumArgs() == 0)   return ;
+        const SourceManager *SM = Result.SourceManager;
+        ASTContext &Ctx = *Result.Context;
+        const FunctionDecl *FD = CE->getDirectCallee();
+        std::string fname = FD->getNameAsString();
+        int row = SM->getSpellingLineNumber(CE->getBeginLoc());
+        char buf[32];
+        sprintf(buf,"%d",row);
+
+        std::string tag;
+        if(fname == "free" || fname == "realloc")
+            tag = poolTagOf(CE->getArg(0)->IgnoreParenCasts()->getType());
+        if(tag.empty() && fname != "free")
+            tag = poolTagOf(allocResultType(CE,Ctx));
+        if(tag.empty()) return ;
+
+        if(fname == "calloc" || fname == "realloc"){
+            poolBad.insert(std::make_pair(tag,fname + " at line " + buf));
+            return ;
+        }
+        if(fname == "malloc"){
+            const UnaryExprOrTypeTraitExpr *SZ =
+                dyn_cast<UnaryExprOrTypeTraitExpr>(CE->getArg(0)->IgnoreParenImpCasts());
+            if(!SZ || SZ->getKind() != UETT_SizeOf || poolTagOf(Ctx.getPointerType(SZ->getTypeOfArgument())) != tag){
+                poolBad.insert(std::make_pair(tag,"malloc at line " + std::string(buf) + " is not malloc(sizeof(" + tag + "))"));
+                return ;
+            }
+        }
+        if(reuseCalls.count(CE->getBeginLoc().getRawEncoding())) return ;
+        const DeclRefExpr *callee = dyn_cast<DeclRefExpr>(CE->getCallee()->IgnoreParenImpCasts());
+        if(!callee || callee->getLocation().isMacroID()){
+            poolBad.insert(std::make_pair(tag,fname + " at line " + buf + " comes from a macro"));
+            return ;
+        }
+        poolSite ps;
+        ps.tag = tag;
+        ps.callee = callee->getLocation();
+        ps.isFree = fname == "free";
+        ps.row = row;
+        poolSites.push_back(ps);
+    }
+};
+
+//改写选定类型的调用,返回要在文件头声明的池
+static std::set<std::string> rewritePools(){
+    std::set<std::string> used;
+    std::map<std::string,int> allocs,frees;
+    for(unsigned i=0;i<poolSites.size();++i){
+        const poolSite &ps = poolSites[i];
+        if(poolBad.count(ps.tag)) continue;
+        std::string fn = (ps.isFree ? "__lc_pool_free_" : "__lc_pool_alloc_") + ps.tag;
+        rewrite.ReplaceText(ps.callee,ps.isFree ? 4 : 6,fn);
+        (ps.isFree ? frees : allocs)[ps.tag]++;
+        used.insert(ps.tag);
+        #ifdef DEBUG
+        llvm::errs()<<"pool: line "<<ps.row<<" -> "<<fn<<"\n";
+        #endif
+    }
+    for(std::set<std::string>::const_iterator I = used.begin();I != used.end();++I){
+        llvm::errs() << "pool: " << *I << ": " << allocs[*I] << " malloc(s), " << frees[*I] << " free(s) use the pool\n";
+    }
+    for(std::map<std::string,std::string>::const_iterator I = poolBad.begin();I != poolBad.end();++I){
+        llvm::errs() << "pool: " << I->first << " not pooled: " << I->second << "\n";
+    }
+    for(std::set<std::string>::const_iterator I = poolTypes.begin();I != poolTypes.end();++I){
+        bool seen = used.count(*I) || poolBad.count(*I);
+        for(unsigned i=0;i<poolSites.size() && !seen;++i) seen = poolSites[i].tag == *I;
+        if(!seen) llvm::errs() << "pool: no allocation of " << *I << " found\n";
+    }
+    return used;
+}
+
+
+//使用的格式:  ./checkMemory [-reuse-alloc] [-pool 类型名]... 被测试文件名 --
+//在buildASTs得到的每个AST上跑一遍finder
+static void matchASTs(MatchFinder &finder,std::vector<std::unique_ptr<ASTUnit>> &ASTs){
+    for(unsigned i = 0;i < ASTs.size();++i)
+        finder.matchAST(ASTs[i]->getASTContext());
+}
 
-//使用的格式:  ./checkMemory 被测试文件名 --
 int main(int argc,const char **argv) {
 
+    //自己的选项放在文件名前面,处理完从argv里去掉,后面的代码还是按argv[1]是文件名来用
+    int nopt = 0;
+    while(1 + nopt < argc && argv[1 + nopt][0] == '-' && strcmp(argv[1 + nopt],"--") != 0){
+        if(strcmp(argv[1 + nopt],"-reuse-alloc") == 0)
+            reuseMode = true;
+        else if(strcmp(argv[1 + nopt],"-pool") == 0 && 2 + nopt < argc)
+            poolTypes.insert(argv[++nopt]);
+        else{
+            llvm::errs() << "Unknown option " << argv[1 + nopt] << "\n";
+            exit(EXIT_FAILURE);
+        }
+        nopt++;
+    }
+    argv[nopt] = argv[0];
+    argv += nopt;
+    argc -= nopt;
+    if(argc < 2){
+        llvm::errs() << "usage: " << argv[0] << " [-reuse-alloc] [-pool type]... file --\n";
+        exit(EXIT_FAILURE);
+    }
+
 	//----此块基本一样    start----
     struct stat sb;             
 
@@ -562,27 +1047,57 @@ int main(int argc,const char **argv) {
         CommonOptionsParser OptionsParser(argc, argv);//, MyToolCategory);
         ClangTool Tool(OptionsParser.getCompilations(),
                  OptionsParser.getSourcePathList());
+        //只解析一次,所有pass都在同一份AST上匹配,不再每个Tool.run重新解析头文件
+        std::vector<std::unique_ptr<ASTUnit>> ASTs;
+        Tool.buildASTs(ASTs);
 		//开始匹配             
+
+        //先做逃逸分析,找出不用插装的malloc/free
+        EscapePrinter escapePrinter;
+        MatchFinder escapeFinder;
+        escapeFinder.addMatcher(MallocMatcher, &escapePrinter);
+        matchASTs(escapeFinder,ASTs);
+
+        //循环里的malloc/free对改成复用一块缓冲区,这些点也不插装
+        if(reuseMode){
+            ReusePrinter reusePrinter;
+            MatchFinder reuseFinder;
+            reuseFinder.addMatcher(MallocMatcher, &reusePrinter);
+            matchASTs(reuseFinder,ASTs);
+            llvm::errs() << "reuse-alloc: " << reuseNext << " allocation(s) moved out of loops\n";
+        }
+
+        //选定类型的malloc/free换成对象池,先全部找出来,有不能换的调用整个类型就不换
+        std::set<std::string> pools;
+        if(!poolTypes.empty()){
+            PoolPrinter poolPrinter;
+            MatchFinder poolFinder;
+            poolFinder.addMatcher(callExpr(callee(functionDecl(hasAnyName("malloc","calloc","realloc","free")))).bind("poolCall"), &poolPrinter);
+            poolFinder.addMatcher(castExpr(hasSourceExpression(expr(hasType(pointerType())))).bind("poolCast"), &poolPrinter);
+            matchASTs(poolFinder,ASTs);
+            pools = rewritePools();
+        }
         
         MallocVarPrinter mallocVarPrinter;
         MatchFinder mallocVarFinder;
         mallocVarFinder.addMatcher(MallocVarMatcher, &mallocVarPrinter);
-        Tool.run(newFrontendActionFactory(&mallocVarFinder));
+        matchASTs(mallocVarFinder,ASTs);
         
         MallocPrinter mallocPrinter;
         MatchFinder mallocFinder;
         mallocFinder.addMatcher(MallocMatcher, &mallocPrinter);
-        Tool.run(newFrontendActionFactory(&mallocFinder));
+        matchASTs(mallocFinder,ASTs);
         
         FreeVarPrinter freeVarPrinter;
         MatchFinder freeVarFinder;
         freeVarFinder.addMatcher(FreeVarMatcher, &freeVarPrinter);
-        Tool.run(newFrontendActionFactory(&freeVarFinder));
+        matchASTs(freeVarFinder,ASTs);
         
         FreePrinter freePrinter;
         MatchFinder freeFinder;
         freeFinder.addMatcher(FreeMatcher, &freePrinter);
-        Tool.run(newFrontendActionFactory(&freeFinder));
+        matchASTs(freeFinder,ASTs);
+        llvm::errs() << "escape analysis: " << probesRemoved << " probe(s) removed\n";
    
     
                   
@@ -594,6 +1109,12 @@ int main(int argc,const char **argv) {
 			//在文件头加上改头文件,防止没有 stdlib,stdio 而不能使用printf和exit函数
 		    #endif
 			outFile << "#include\"plugHead.h\"\n";
+			outFile << "#include\"allocring.h\"\n";
+            if(!pools.empty()){
+                outFile << "#include\"lcpool.h\"\n";
+                for(std::set<std::string>::const_iterator I = pools.begin();I != pools.end();++I)
+                    outFile << "LC_POOL_DECLARE(" << *I << ")\n";
+            }
             
             outFile << std::string(RewriteBuf->begin(), RewriteBuf->end());		
         }else{
@@ -602,6 +1123,7 @@ int main(int argc,const char **argv) {
 			#endif
 
         	outFile << "#include\"plugHead.h\"\n";
+        	outFile << "#include\"allocring.h\"\n";
             std::ifstream infile(fileName.c_str());
             if(!infile){
                 llvm::errs() << " fail to open the input file!\n";
@@ -622,13 +1144,15 @@ int main(int argc,const char **argv) {
         //新建输入到新文件的流,将已经找到的malloc过的结构体信息写入文件,供另一个处理程序读取
         llvm::raw_fd_ostream csFile(checkStructFileName.c_str(),checkStructErrorInfo);//,llvm::sys::fs::F_None);
         if (checkStructErrorInfo.empty()){
-      	    for(unsigned int i=0;i<cpVec.size();++i){            
-    	        csFile << cpVec[i].name << " " << cpVec[i].row << " " << cpVec[i].col << " " << cpVec[i].declName << " " << cpVec[i].declRow << " " << cpVec[i].declCol << "\n" ;
+      	    for(unsigned int i=0;i<cpVec.sites.size();++i){            
+                const checkPoint &cp = cpVec.sites[i];
+    	        csFile << cp.name << " " << cp.row << " " << cp.col << " " << cp.declName << " " << cp.declRow << " " << cp.declCol << "\n" ;
 	        }            
         }
 	    csFile.close();  
-        for(unsigned int i=0;i<cpVec.size();++i){
-	        llvm::errs()<<cpVec[i].name<<"|"<<cpVec[i].declName<<":"<<cpVec[i].declRow<<":"<<cpVec[i].declCol<<"\n";  
+        for(unsigned int i=0;i<cpVec.sites.size();++i){
+            const checkPoint &cp = cpVec.sites[i];
+	        llvm::errs()<<cp.name<<"|"<<cp.declName<<":"<<cp.declRow<<":"<<cp.declCol<<"\n";  
 	    }	
         #endif
 	    
@@ -0,0 +1,112 @@
+// TraceDecode - print a flight recorder dump (lctrace.<pid>.bin) written by lctrace.h
+// Function ids and block ids are mapped back to names with func_blocks.txt:
+// line k is "name lastblock", so function k owns the blocks after line k-1's lastblock.
+//
+// Usage: TraceDecode lctrace.<pid>.bin [func_blocks.txt]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "lctrace.h"
+
+struct funcInfo{
+  std::string name;
+  int lastBlock;
+};
+
+std::vector<funcInfo> funcs;
+
+void LoadFuncBlocks(const char *name)
+{
+  std::ifstream infile(name);
+  std::string line;
+  if (!infile){
+    fprintf(stderr, "cannot open %s, ids are printed without names\n", name);
+    return;
+  }
+  while (std::getline(infile, line)){
+    std::istringstream ss(line);
+    funcInfo fi;
+    fi.lastBlock = -1;
+    ss >> fi.name >> fi.lastBlock;
+    funcs.push_back(fi);
+  }
+}
+
+std::string FuncName(uint32_t id)
+{
+  if (id < funcs.size() && !funcs[id].name.empty()) return funcs[id].name;
+  char buf[32];
+  snprintf(buf, sizeof(buf), "func#%u", id);
+  return buf;
+}
+
+// BlockOwner - first function whose last block is >= id
+std::string BlockOwner(uint32_t id)
+{
+  int lo = 0, hi = (int)funcs.size();
+  while (lo < hi){
+    int mid = (lo + hi) / 2;
+    if (funcs[mid].lastBlock < (int)id) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo < (int)funcs.size() ? funcs[lo].name : "?";
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2){
+    fprintf(stderr, "Usage: %s lctrace.<pid>.bin [func_blocks.txt]\n", argv[0]);
+    return 1;
+  }
+  LoadFuncBlocks(argc > 2 ? argv[2] : "/root/func_blocks.txt");
+
+  FILE *fp = fopen(argv[1], "rb");
+  if (fp == NULL){
+    perror(argv[1]);
+    return 1;
+  }
+  struct __lc_trace_header h;
+  if (fread(&h, sizeof(h), 1, fp) != 1 || h.magic != LC_TRACE_MAGIC){
+    fprintf(stderr, "%s is not a trace dump\n", argv[1]);
+    return 1;
+  }
+  if (h.n != LC_TRACE_N){
+    fprintf(stderr, "dump has %u events per thread, rebuild TraceDecode with -DLC_TRACE_N=%u\n", h.n, h.n);
+    return 1;
+  }
+
+  printf("pid %u, %u thread(s)\n", h.pid, h.nthreads);
+  struct __lc_trace_buf *b = (struct __lc_trace_buf *)malloc(sizeof(*b));
+  for (uint32_t t = 0; t < h.nthreads; t++){
+    if (fread(b, sizeof(*b), 1, fp) != 1) break;
+    uint32_t count = b->pos < LC_TRACE_N ? b->pos : LC_TRACE_N;
+    printf("\n== thread %u: last %u of %u events ==\n", b->tid, count, b->pos);
+    int depth = 0;
+    for (uint32_t i = b->pos - count; i != b->pos; i++){
+      uint32_t ev = b->ev[i & (LC_TRACE_N - 1)];
+      uint32_t id = ev & LC_TR_ID_MASK;
+      switch (ev & ~LC_TR_ID_MASK){
+      case LC_TR_ENTER:
+        printf("%*senter %s\n", 2 * depth, "", FuncName(id).c_str());
+        depth++;
+        break;
+      case LC_TR_EXIT:
+        if (depth > 0) depth--;
+        printf("%*sexit  %s\n", 2 * depth, "", FuncName(id).c_str());
+        break;
+      case LC_TR_BLOCK:
+        printf("%*sblock %u (%s)\n", 2 * depth, "", id, BlockOwner(id).c_str());
+        break;
+      default:
+        printf("%*s?? %08x\n", 2 * depth, "", ev);
+      }
+    }
+  }
+  free(b);
+  fclose(fp);
+  return 0;
+}
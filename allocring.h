@@ -0,0 +1,118 @@
+#ifndef ALLOCRING_H
+#define ALLOCRING_H
+/*
+ * 插装程序(LoopConvert3 生成的 _out 文件)和 AllocCollector 之间的共享内存环形缓冲区.
+ * 每个进程一个 /dev/shm/lc_alloc.<pid>, 生产者只做原子操作和内存写, 不做系统调用;
+ * 缓冲区满了就丢事件并计数, 内存是固定大小的.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LC_RING_MAGIC   0x4c43524eu        /* "LCRN" */
+#define LC_RING_SLOTS   65536              /* 必须是2的幂 */
+#define LC_RING_PREFIX  "lc_alloc."
+
+struct lc_event{
+    uint64_t seq;           /* 槽位序号+1, 写完后才置上, 消费者靠它判断是否可读 */
+    uint64_t addr;          /* malloc返回值 / free的参数 */
+    uint32_t row;           /* 插装点行号 */
+    uint16_t col;           /* 插装点列号 */
+    char     kind;          /* 'm' 或 'f' */
+    char     pad;
+};
+
+struct lc_ring{
+    uint32_t magic;
+    int32_t  pid;
+    uint32_t slots;
+    uint32_t pad;
+    uint64_t dropped;                               /* 满了丢掉的事件数 */
+    char     pad1[40];
+    uint64_t head;                                  /* 生产者写位置 */
+    char     pad2[56];
+    uint64_t tail;                                  /* 消费者读位置 */
+    char     pad3[56];
+    struct lc_event ev[LC_RING_SLOTS];
+};
+
+__attribute__((weak)) struct lc_ring *__lc_ring;
+
+__attribute__((weak)) void __lc_ring_atfork(void){
+    /* 子进程不能往父进程的环里写, 下一次事件时重新建一个 */
+    __lc_ring = NULL;
+}
+
+__attribute__((weak)) struct lc_ring *__lc_ring_attach(void){
+    static int atfork_done = 0;
+    char name[64];
+    struct lc_ring *r;
+    int fd;
+
+    snprintf(name, sizeof(name), "/" LC_RING_PREFIX "%d", (int)getpid());
+    fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+    if (fd == -1)
+        return NULL;
+    if (ftruncate(fd, sizeof(struct lc_ring)) == -1){
+        close(fd);
+        return NULL;
+    }
+    r = (struct lc_ring *)mmap(NULL, sizeof(struct lc_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r == MAP_FAILED)
+        return NULL;
+    r->pid = (int32_t)getpid();
+    r->slots = LC_RING_SLOTS;
+    __atomic_store_n(&r->magic, LC_RING_MAGIC, __ATOMIC_RELEASE);
+    if (!atfork_done){
+        atfork_done = 1;
+        pthread_atfork(NULL, NULL, __lc_ring_atfork);
+    }
+    __lc_ring = r;
+    return r;
+}
+
+/* 插装代码调用的入口, 多线程安全 */
+__attribute__((weak)) void __lc_alloc_event(int kind, int row, int col, const void *p){
+    struct lc_ring *r = __lc_ring;
+    struct lc_event *e;
+    uint64_t h;
+
+    if (r == NULL && (r = __lc_ring_attach()) == NULL)
+        return;
+    h = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    do{
+        if (h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LC_RING_SLOTS){
+            __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }while (!__atomic_compare_exchange_n(&r->head, &h, h + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    e = &r->ev[h & (LC_RING_SLOTS - 1)];
+    e->addr = (uint64_t)(uintptr_t)p;
+    e->row = (uint32_t)row;
+    e->col = (uint16_t)col;
+    e->kind = (char)kind;
+    __atomic_store_n(&e->seq, h + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * LoopConvert3 -reuse-alloc: 循环里成对的 malloc/free 改成循环外的一块缓冲区.
+ * 不够大才重新分配; 上一轮的内容已经被 free 掉了, 所以不用 realloc 拷贝.
+ */
+static inline void *__lc_reuse_buf(void **buf, size_t *cap, size_t n){
+    if (*buf == NULL || n > *cap){
+        free(*buf);
+        *buf = malloc(n);
+        *cap = *buf != NULL ? n : 0;
+    }
+    return *buf;
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef LCBRANCH_H
+#define LCBRANCH_H
+/*
+ * Branch direction counters for LoopConvert -branchprof.
+ * Every if/while/for/do condition is rewritten to __lc_br(id,(cond)), which
+ * counts taken and not taken and passes the value through. At exit the counts
+ * are added to lcbranch.out ("id not_taken taken"), so several runs of the
+ * training workload accumulate. LoopConvert -branchopt lcbranch.out then puts
+ * __builtin_expect on the conditions that are strongly biased.
+ * The counters are plain increments like blocks[]: a race can lose a count,
+ * which does not matter for a bias estimate.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifndef LC_BR_SITES
+#define LC_BR_SITES 65536
+#endif
+#ifndef LC_BR_FILE
+#define LC_BR_FILE "lcbranch.out"
+#endif
+
+__attribute__((weak)) uint64_t __lc_br_count[LC_BR_SITES][2];   /* [0] not taken, [1] taken */
+__attribute__((weak)) int __lc_br_registered;
+
+__attribute__((weak)) void __lc_br_dump(void)
+{
+  FILE *fp = fopen(LC_BR_FILE, "r");
+  unsigned long long no, yes;
+  unsigned id, i;
+
+  if (fp != NULL) {
+    while (fscanf(fp, "%u %llu %llu", &id, &no, &yes) == 3)
+      if (id < LC_BR_SITES) {
+        __lc_br_count[id][0] += no;
+        __lc_br_count[id][1] += yes;
+      }
+    fclose(fp);
+  }
+  fp = fopen(LC_BR_FILE, "w");
+  if (fp == NULL)
+    return;
+  for (i = 0; i < LC_BR_SITES; i++)
+    if (__lc_br_count[i][0] || __lc_br_count[i][1])
+      fprintf(fp, "%u %llu %llu\n", i, (unsigned long long)__lc_br_count[i][0],
+              (unsigned long long)__lc_br_count[i][1]);
+  fclose(fp);
+}
+
+static void __attribute__((constructor)) __lc_br_init(void)
+{
+  if (!__lc_br_registered) {
+    __lc_br_registered = 1;
+    atexit(__lc_br_dump);
+  }
+}
+
+static inline int __lc_br_hit(unsigned id, int c)
+{
+  if (id < LC_BR_SITES)
+    __lc_br_count[id][c]++;
+  return c;
+}
+
+#define __lc_br(id, c) __lc_br_hit((id), !!(c))
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef LCCG_H
+#define LCCG_H
+/*
+ * Dynamic call graph runtime for LoopConvert -callgraph.
+ * Every call site gets a global id; __lc_cg_edge(site) counts it in a small
+ * per-thread open-addressing table. Each TU registers site -> (caller id,
+ * callee name) from a constructor. At exit the per-site counts are summed and
+ * folded into caller -> callee edges in the function id space of
+ * func_blocks.txt/result.txt, written to lccg.out as
+ *   caller_id callee_id count caller_name callee_name
+ * callee_id is -1 when the callee is not instrumented (libc, other libraries).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "lcfuncs.h"
+
+#ifndef LC_CG_SITES
+#define LC_CG_SITES 65536               /* max global call site id */
+#endif
+#ifndef LC_CG_SLOTS
+#define LC_CG_SLOTS 4096                /* per-thread table, power of 2 */
+#endif
+#ifndef LC_CG_FILE
+#define LC_CG_FILE "lccg.out"
+#endif
+
+struct __lc_cg_thread {
+  struct __lc_cg_thread *next;
+  uint32_t used, overflow;
+  uint32_t key[LC_CG_SLOTS];            /* site + 1, 0 = empty */
+  uint64_t cnt[LC_CG_SLOTS];
+};
+
+__attribute__((weak)) int32_t __lc_cg_caller[LC_CG_SITES];
+__attribute__((weak)) const char *__lc_cg_callee[LC_CG_SITES];
+__attribute__((weak)) struct __lc_cg_thread *__lc_cg_threads;
+__attribute__((weak)) pthread_mutex_t __lc_cg_lock = PTHREAD_MUTEX_INITIALIZER;
+__attribute__((weak)) __thread struct __lc_cg_thread *__lc_cg_self;
+
+static inline void __lc_cg_site(unsigned site, int caller, const char *callee)
+{
+  if (site < LC_CG_SITES) {
+    __lc_cg_caller[site] = caller;
+    __lc_cg_callee[site] = callee;
+  }
+}
+
+struct __lc_cg_edge_out {
+  int caller, callee;
+  const char *callee_name;
+  uint64_t count;
+};
+
+static int __lc_cg_cmp(const void *a, const void *b)
+{
+  const struct __lc_cg_edge_out *x = (const struct __lc_cg_edge_out *)a;
+  const struct __lc_cg_edge_out *y = (const struct __lc_cg_edge_out *)b;
+  return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static int __lc_cg_lookup(const char *name)
+{
+  unsigned i;
+  for (i = 0; i < LC_MAX_FUNCS; i++)
+    if (__lc_func_names[i] && strcmp(__lc_func_names[i], name) == 0)
+      return (int)i;
+  return -1;
+}
+
+__attribute__((weak)) void __lc_cg_dump(void)
+{
+  static uint64_t per_site[LC_CG_SITES];
+  struct __lc_cg_edge_out *edges;
+  struct __lc_cg_thread *t;
+  unsigned i, j, n = 0;
+  uint64_t overflow = 0;
+  FILE *fp;
+
+  pthread_mutex_lock(&__lc_cg_lock);
+  for (t = __lc_cg_threads; t; t = t->next) {
+    for (i = 0; i < LC_CG_SLOTS; i++)
+      if (t->key[i] && t->key[i] - 1 < LC_CG_SITES)
+        per_site[t->key[i] - 1] += t->cnt[i];
+    overflow += t->overflow;
+  }
+  pthread_mutex_unlock(&__lc_cg_lock);
+
+  edges = (struct __lc_cg_edge_out *)calloc(LC_CG_SITES, sizeof(*edges));
+  if (edges == NULL)
+    return;
+  /* several sites can be the same edge; merge them */
+  for (i = 0; i < LC_CG_SITES; i++) {
+    const char *callee;
+    int caller;
+    if (!per_site[i])
+      continue;
+    caller = __lc_cg_caller[i];
+    callee = __lc_cg_callee[i] ? __lc_cg_callee[i] : "?";
+    for (j = 0; j < n; j++)
+      if (edges[j].caller == caller && strcmp(edges[j].callee_name, callee) == 0)
+        break;
+    if (j == n) {
+      edges[n].caller = caller;
+      edges[n].callee_name = callee;
+      edges[n].callee = __lc_cg_lookup(callee);
+      n++;
+    }
+    edges[j].count += per_site[i];
+  }
+  qsort(edges, n, sizeof(edges[0]), __lc_cg_cmp);
+
+  fp = fopen(LC_CG_FILE, "w");
+  if (fp != NULL) {
+    fprintf(fp, "# caller callee count caller_name callee_name\n");
+    for (i = 0; i < n; i++)
+      fprintf(fp, "%d %d %llu %s %s\n", edges[i].caller, edges[i].callee,
+              (unsigned long long)edges[i].count,
+              __lc_func_name_of((unsigned)edges[i].caller), edges[i].callee_name);
+    if (overflow)
+      fprintf(fp, "# %llu call(s) not counted, per-thread table full\n", (unsigned long long)overflow);
+    fclose(fp);
+  }
+  free(edges);
+}
+
+__attribute__((weak)) struct __lc_cg_thread *__lc_cg_attach(void)
+{
+  static int registered = 0;
+  struct __lc_cg_thread *t = (struct __lc_cg_thread *)calloc(1, sizeof(*t));
+
+  if (t == NULL)
+    return NULL;
+  pthread_mutex_lock(&__lc_cg_lock);
+  t->next = __lc_cg_threads;
+  __lc_cg_threads = t;
+  if (!registered) {
+    registered = 1;
+    atexit(__lc_cg_dump);
+  }
+  pthread_mutex_unlock(&__lc_cg_lock);
+  __lc_cg_self = t;
+  return t;
+}
+
+static inline void __lc_cg_edge(uint32_t site)
+{
+  struct __lc_cg_thread *t = __lc_cg_self;
+  uint32_t k = site + 1;
+  uint32_t i = (k * 2654435761u) & (LC_CG_SLOTS - 1);
+
+  if (__builtin_expect(t == NULL, 0) && (t = __lc_cg_attach()) == NULL)
+    return;
+  for (;;) {
+    if (t->key[i] == k) {
+      t->cnt[i]++;
+      return;
+    }
+    if (t->key[i] == 0) {
+      if (t->used * 4 >= LC_CG_SLOTS * 3) {
+        t->overflow++;
+        return;
+      }
+      t->key[i] = k;
+      t->cnt[i] = 1;
+      t->used++;
+      return;
+    }
+    i = (i + 1) & (LC_CG_SLOTS - 1);
+  }
+}
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * lcclient - send one LoopConvert run to a LoopConvert -server and wait for it.
+ * The arguments are those of LoopConvert itself; the run happens in the current
+ * directory (loopconvert.txt and <file>_out are relative to it). The server's
+ * output is printed on stderr and its exit status is returned.
+ *
+ * Usage: lcclient [-s socket] <LoopConvert options> <filename>
+ *        socket defaults to $LC_SERVER, then /tmp/lcserver.sock
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define STATUS_MARK "lc-status "
+
+static int send_all(int s, const char *p, size_t n)
+{
+  while (n > 0) {
+    ssize_t k = write(s, p, n);
+    if (k <= 0)
+      return -1;
+    p += k;
+    n -= k;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = getenv("LC_SERVER");
+  struct sockaddr_un addr;
+  char cwd[4096], buf[4096];
+  char *out = NULL;
+  size_t len = 0, i;
+  ssize_t n;
+  int s, first = 1, status = 1;
+
+  if (path == NULL)
+    path = "/tmp/lcserver.sock";
+  if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+    path = argv[2];
+    first = 3;
+  }
+  if (first >= argc) {
+    fprintf(stderr, "Usage: %s [-s socket] <LoopConvert options> <filename>\n", argv[0]);
+    return 1;
+  }
+  if (getcwd(cwd, sizeof(cwd)) == NULL) {
+    perror("getcwd");
+    return 1;
+  }
+
+  s = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (s == -1 || connect(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    perror(path);
+    return 1;
+  }
+
+  /* cwd, the arguments, an empty string; all NUL-terminated */
+  if (send_all(s, cwd, strlen(cwd) + 1) == -1)
+    goto fail;
+  for (i = first; i < (size_t)argc; i++)
+    if (send_all(s, argv[i], strlen(argv[i]) + 1) == -1)
+      goto fail;
+  if (send_all(s, "", 1) == -1)
+    goto fail;
+  shutdown(s, SHUT_WR);
+
+  while ((n = read(s, buf, sizeof(buf))) > 0) {
+    out = (char *)realloc(out, len + n);
+    memcpy(out + len, buf, n);
+    len += n;
+  }
+  close(s);
+
+  /* the output ends with "\0lc-status N\n"; without it the run died */
+  for (i = len; i > 0; i--)
+    if (out[i - 1] == '\0') {
+      if (len - i > strlen(STATUS_MARK) && strncmp(out + i, STATUS_MARK, strlen(STATUS_MARK)) == 0) {
+        status = atoi(out + i + strlen(STATUS_MARK));
+        len = i - 1;
+      }
+      break;
+    }
+  fwrite(out, 1, len, stderr);
+  free(out);
+  return status;
+
+fail:
+  perror(path);
+  close(s);
+  return 1;
+}
@@ -0,0 +1,29 @@
+#ifndef LCFUNCS_H
+#define LCFUNCS_H
+/*
+ * Function id -> name table shared by the runtime probes (lcprof.h, lccg.h).
+ * Ids are the global function ids LoopConvert assigns: the line number of the
+ * function in /root/func_blocks.txt. Every instrumented TU registers its own
+ * functions from a constructor, so no probe has to carry a string.
+ */
+
+#ifndef LC_MAX_FUNCS
+#define LC_MAX_FUNCS 16384
+#endif
+
+__attribute__((weak)) const char *__lc_func_names[LC_MAX_FUNCS];
+
+static inline void __lc_func_name(unsigned id, const char *name)
+{
+  if (id < LC_MAX_FUNCS)
+    __lc_func_names[id] = name;
+}
+
+static inline const char *__lc_func_name_of(unsigned id)
+{
+  if (id < LC_MAX_FUNCS && __lc_func_names[id])
+    return __lc_func_names[id];
+  return "?";
+}
+
+#endif
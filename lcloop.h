@@ -0,0 +1,89 @@
+#ifndef LCLOOP_H
+#define LCLOOP_H
+/*
+ * Loop trip count histograms for LoopConvert -loopprof.
+ * Every instrumented for/while loop counts its iterations in a local
+ * __lc_tripN and reports it with __lc_loop_done(id, trips) when the loop is
+ * left normally (break included, return/goto out of the loop is not seen).
+ * Trip counts go into log2 buckets: 0, 1, 2-3, 4-7, ... At exit the
+ * histograms are added to lcloop.out ("id entries trips hist[0..32]"), which
+ * LoopConvert -loopopt reads to put #pragma clang loop on hot, stable loops.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifndef LC_LOOP_SITES
+#define LC_LOOP_SITES 16384
+#endif
+#define LC_LOOP_BUCKETS 33
+#ifndef LC_LOOP_FILE
+#define LC_LOOP_FILE "lcloop.out"
+#endif
+
+struct __lc_loop_stat {
+  uint64_t entries, trips;
+  uint64_t hist[LC_LOOP_BUCKETS];
+};
+
+__attribute__((weak)) struct __lc_loop_stat __lc_loop_stats[LC_LOOP_SITES];
+__attribute__((weak)) int __lc_loop_registered;
+
+__attribute__((weak)) void __lc_loop_dump(void)
+{
+  FILE *fp = fopen(LC_LOOP_FILE, "r");
+  unsigned long long v;
+  unsigned id, i, b;
+
+  if (fp != NULL) {
+    while (fscanf(fp, "%u", &id) == 1) {
+      struct __lc_loop_stat dummy = {0}, *s = id < LC_LOOP_SITES ? &__lc_loop_stats[id] : &dummy;
+      if (fscanf(fp, "%llu", &v) != 1) break;
+      s->entries += v;
+      if (fscanf(fp, "%llu", &v) != 1) break;
+      s->trips += v;
+      for (b = 0; b < LC_LOOP_BUCKETS && fscanf(fp, "%llu", &v) == 1; b++)
+        s->hist[b] += v;
+    }
+    fclose(fp);
+  }
+  fp = fopen(LC_LOOP_FILE, "w");
+  if (fp == NULL)
+    return;
+  for (i = 0; i < LC_LOOP_SITES; i++) {
+    struct __lc_loop_stat *s = &__lc_loop_stats[i];
+    if (!s->entries)
+      continue;
+    fprintf(fp, "%u %llu %llu", i, (unsigned long long)s->entries, (unsigned long long)s->trips);
+    for (b = 0; b < LC_LOOP_BUCKETS; b++)
+      fprintf(fp, " %llu", (unsigned long long)s->hist[b]);
+    fputc('\n', fp);
+  }
+  fclose(fp);
+}
+
+static void __attribute__((constructor)) __lc_loop_init(void)
+{
+  if (!__lc_loop_registered) {
+    __lc_loop_registered = 1;
+    atexit(__lc_loop_dump);
+  }
+}
+
+static inline void __lc_loop_done(unsigned id, unsigned long trips)
+{
+  unsigned b;
+  struct __lc_loop_stat *s;
+
+  if (id >= LC_LOOP_SITES)
+    return;
+  b = trips ? 64 - __builtin_clzll(trips) : 0;
+  if (b >= LC_LOOP_BUCKETS)
+    b = LC_LOOP_BUCKETS - 1;
+  s = &__lc_loop_stats[id];
+  s->entries++;
+  s->trips += trips;
+  s->hist[b]++;
+}
+
+#endif
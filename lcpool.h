@@ -0,0 +1,179 @@
+#ifndef LCPOOL_H
+#define LCPOOL_H
+/*
+ * Fixed-size object pools for LoopConvert3 -pool.
+ * LC_POOL_DECLARE(tag) gives a pool for one struct type and the two functions
+ * the rewritten code calls instead of malloc/free:
+ *   (struct tag *)__lc_pool_alloc_tag(sizeof(struct tag))
+ *   __lc_pool_free_tag(p)
+ * Every thread keeps its own free list; it takes LC_POOL_BATCH objects from the
+ * pool's global list when it runs dry and gives LC_POOL_BATCH back when it holds
+ * twice that many, so the lock is taken once per batch. The global list is
+ * refilled from slabs of LC_POOL_SLAB objects. Slabs are never returned to malloc.
+ * The pool and the thread caches are weak, so all files that declare the same tag
+ * share them and an object may be freed in a different file than it was allocated.
+ * When a thread exits its cached objects go back to the global lists.
+ * LoopConvert3 only sees the file it rewrites. Every file that frees objects of a
+ * pooled type must be rewritten with the same -pool option; a plain free() of a
+ * pool object elsewhere corrupts the heap. The same holds for library code that
+ * frees objects it is handed, which is why a type whose pointer is converted to
+ * void * or another pointer type is not pooled.
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#ifndef LC_POOL_BATCH
+#define LC_POOL_BATCH 64
+#endif
+#ifndef LC_POOL_SLAB
+#define LC_POOL_SLAB 256
+#endif
+
+struct __lc_pool_obj {
+  struct __lc_pool_obj *next;
+};
+
+struct __lc_pool {
+  pthread_mutex_t lock;
+  struct __lc_pool_obj *free;
+  size_t size;                          /* object stride, set by the first refill */
+  unsigned long slabs;
+};
+
+struct __lc_pool_cache {
+  struct __lc_pool_obj *free;
+  unsigned n;
+  struct __lc_pool *pool;               /* NULL until the thread first uses it */
+  struct __lc_pool_cache *next;         /* other caches of the same thread */
+};
+
+#define LC_POOL_INIT { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 }
+
+__attribute__((weak)) pthread_key_t __lc_pool_key;
+__attribute__((weak)) pthread_once_t __lc_pool_once = PTHREAD_ONCE_INIT;
+__attribute__((weak)) __thread struct __lc_pool_cache *__lc_pool_caches;
+
+/* give n objects (all if n is 0) of a thread cache back to its pool */
+__attribute__((weak)) void __lc_pool_drain(struct __lc_pool_cache *c, unsigned n)
+{
+  struct __lc_pool_obj *first = c->free, *last = c->free;
+  unsigned k = 1;
+
+  if (first == NULL)
+    return;
+  if (n == 0 || n > c->n)
+    n = c->n;
+  while (k < n && last->next != NULL) {
+    last = last->next;
+    k++;
+  }
+  c->free = last->next;
+  c->n -= k;
+  pthread_mutex_lock(&c->pool->lock);
+  last->next = c->pool->free;
+  c->pool->free = first;
+  pthread_mutex_unlock(&c->pool->lock);
+}
+
+__attribute__((weak)) void __lc_pool_thread_exit(void *head)
+{
+  struct __lc_pool_cache *c;
+
+  for (c = (struct __lc_pool_cache *)head; c != NULL; c = c->next)
+    __lc_pool_drain(c, 0);
+}
+
+__attribute__((weak)) void __lc_pool_key_init(void)
+{
+  pthread_key_create(&__lc_pool_key, __lc_pool_thread_exit);
+}
+
+__attribute__((weak)) void __lc_pool_register(struct __lc_pool *p, struct __lc_pool_cache *c)
+{
+  pthread_once(&__lc_pool_once, __lc_pool_key_init);
+  c->pool = p;
+  c->next = __lc_pool_caches;
+  __lc_pool_caches = c;
+  pthread_setspecific(__lc_pool_key, c);
+}
+
+/* move a batch from the global list to the thread, cutting a new slab if it is empty */
+__attribute__((weak)) void __lc_pool_refill(struct __lc_pool_cache *c, size_t size)
+{
+  struct __lc_pool *p = c->pool;
+  struct __lc_pool_obj *o;
+  unsigned k;
+
+  pthread_mutex_lock(&p->lock);
+  if (p->size == 0) {
+    /* keep the next pointer aligned; sizeof(T) is already a multiple of T's alignment */
+    if (size < sizeof(struct __lc_pool_obj))
+      size = sizeof(struct __lc_pool_obj);
+    p->size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  }
+  if (p->free == NULL) {
+    char *slab = (char *)malloc(p->size * LC_POOL_SLAB);
+    if (slab != NULL) {
+      for (k = 0; k < LC_POOL_SLAB; k++) {
+        o = (struct __lc_pool_obj *)(slab + k * p->size);
+        o->next = k + 1 < LC_POOL_SLAB ? (struct __lc_pool_obj *)(slab + (k + 1) * p->size) : NULL;
+      }
+      p->free = (struct __lc_pool_obj *)slab;
+      p->slabs++;
+    }
+  }
+  for (k = 0; k < LC_POOL_BATCH && p->free != NULL; k++) {
+    o = p->free;
+    p->free = o->next;
+    o->next = c->free;
+    c->free = o;
+    c->n++;
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+static inline void *__lc_pool_alloc(struct __lc_pool *p, struct __lc_pool_cache *c, size_t size)
+{
+  struct __lc_pool_obj *o;
+
+  if (c->free == NULL) {
+    if (c->pool == NULL)
+      __lc_pool_register(p, c);
+    __lc_pool_refill(c, size);
+    if (c->free == NULL)
+      return NULL;
+  }
+  o = c->free;
+  c->free = o->next;
+  c->n--;
+  return o;
+}
+
+static inline void __lc_pool_free(struct __lc_pool *p, struct __lc_pool_cache *c, void *ptr)
+{
+  struct __lc_pool_obj *o = (struct __lc_pool_obj *)ptr;
+
+  if (o == NULL)
+    return;
+  if (c->pool == NULL)
+    __lc_pool_register(p, c);
+  o->next = c->free;
+  c->free = o;
+  if (++c->n >= 2 * LC_POOL_BATCH)
+    __lc_pool_drain(c, LC_POOL_BATCH);
+}
+
+#define LC_POOL_DECLARE(tag)                                                     \
+  __attribute__((weak)) struct __lc_pool __lc_pool_##tag = LC_POOL_INIT;         \
+  __attribute__((weak)) __thread struct __lc_pool_cache __lc_pool_cache_##tag;   \
+  static inline void *__lc_pool_alloc_##tag(size_t size)                         \
+  {                                                                              \
+    return __lc_pool_alloc(&__lc_pool_##tag, &__lc_pool_cache_##tag, size);      \
+  }                                                                              \
+  static inline void __lc_pool_free_##tag(void *p)                               \
+  {                                                                              \
+    __lc_pool_free(&__lc_pool_##tag, &__lc_pool_cache_##tag, p);                 \
+  }
+
+#endif
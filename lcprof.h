@@ -0,0 +1,179 @@
+#ifndef LCPROF_H
+#define LCPROF_H
+/*
+ * Function profiler runtime for LoopConvert -profile.
+ * __lc_prof_enter/__lc_prof_exit read the cycle counter and keep a per-thread
+ * shadow stack; inclusive/exclusive cycles and call counts are accumulated in
+ * a per-thread table indexed by function id. At exit all thread tables are
+ * summed and written to lcprof.out sorted by exclusive time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "lcfuncs.h"
+
+#ifndef LC_PROF_DEPTH
+#define LC_PROF_DEPTH 512
+#endif
+#ifndef LC_PROF_FILE
+#define LC_PROF_FILE "lcprof.out"
+#endif
+
+struct __lc_prof_ent {
+  uint64_t calls, incl, excl;
+};
+
+struct __lc_prof_frame {
+  uint32_t id;
+  uint64_t start, child;
+};
+
+struct __lc_prof_thread {
+  struct __lc_prof_thread *next;
+  int depth;
+  struct __lc_prof_frame stack[LC_PROF_DEPTH];
+  struct __lc_prof_ent tab[LC_MAX_FUNCS];
+};
+
+__attribute__((weak)) struct __lc_prof_thread *__lc_prof_threads;
+__attribute__((weak)) pthread_mutex_t __lc_prof_lock = PTHREAD_MUTEX_INITIALIZER;
+__attribute__((weak)) __thread struct __lc_prof_thread *__lc_prof_self;
+
+static inline uint64_t __lc_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+  uint64_t v;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(v));
+  return v;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static int __lc_prof_cmp(const void *a, const void *b)
+{
+  const struct __lc_prof_ent *x = *(const struct __lc_prof_ent * const *)a;
+  const struct __lc_prof_ent *y = *(const struct __lc_prof_ent * const *)b;
+  return x->excl < y->excl ? 1 : x->excl > y->excl ? -1 : 0;
+}
+
+__attribute__((weak)) void __lc_prof_dump(void)
+{
+  static struct __lc_prof_ent sum[LC_MAX_FUNCS];
+  static struct __lc_prof_ent *order[LC_MAX_FUNCS];
+  struct __lc_prof_thread *t;
+  uint64_t total = 0;
+  unsigned i, n = 0;
+  FILE *fp;
+
+  pthread_mutex_lock(&__lc_prof_lock);
+  for (t = __lc_prof_threads; t; t = t->next) {
+    for (i = 0; i < LC_MAX_FUNCS; i++) {
+      sum[i].calls += t->tab[i].calls;
+      sum[i].incl += t->tab[i].incl;
+      sum[i].excl += t->tab[i].excl;
+    }
+  }
+  pthread_mutex_unlock(&__lc_prof_lock);
+
+  for (i = 0; i < LC_MAX_FUNCS; i++) {
+    if (sum[i].calls) {
+      order[n++] = &sum[i];
+      total += sum[i].excl;
+    }
+  }
+  qsort(order, n, sizeof(order[0]), __lc_prof_cmp);
+
+  fp = fopen(LC_PROF_FILE, "w");
+  if (fp == NULL)
+    return;
+  fprintf(fp, "#   %%self       self cycles      total cycles       calls   id  name\n");
+  for (i = 0; i < n; i++) {
+    unsigned id = (unsigned)(order[i] - sum);
+    fprintf(fp, "%8.2f %17llu %17llu %11llu %4u  %s\n",
+            total ? 100.0 * order[i]->excl / total : 0.0,
+            (unsigned long long)order[i]->excl, (unsigned long long)order[i]->incl,
+            (unsigned long long)order[i]->calls, id, __lc_func_name_of(id));
+  }
+  fclose(fp);
+}
+
+__attribute__((weak)) struct __lc_prof_thread *__lc_prof_attach(void)
+{
+  static int registered = 0;
+  struct __lc_prof_thread *t = (struct __lc_prof_thread *)calloc(1, sizeof(*t));
+
+  if (t == NULL)
+    return NULL;
+  pthread_mutex_lock(&__lc_prof_lock);
+  t->next = __lc_prof_threads;
+  __lc_prof_threads = t;
+  if (!registered) {
+    registered = 1;
+    atexit(__lc_prof_dump);
+  }
+  pthread_mutex_unlock(&__lc_prof_lock);
+  __lc_prof_self = t;
+  return t;
+}
+
+static inline void __lc_prof_enter(uint32_t id)
+{
+  struct __lc_prof_thread *t = __lc_prof_self;
+  struct __lc_prof_frame *f;
+
+  if (__builtin_expect(t == NULL, 0) && (t = __lc_prof_attach()) == NULL)
+    return;
+  if (t->depth >= LC_PROF_DEPTH) {
+    t->depth++;   /* too deep, only keep the balance */
+    return;
+  }
+  f = &t->stack[t->depth++];
+  f->id = id;
+  f->child = 0;
+  f->start = __lc_cycles();
+}
+
+static inline void __lc_prof_exit(uint32_t id)
+{
+  struct __lc_prof_thread *t = __lc_prof_self;
+  uint64_t now = __lc_cycles();
+
+  if (t == NULL)
+    return;
+  if (t->depth > LC_PROF_DEPTH) {
+    t->depth--;
+    return;
+  }
+  if (t->depth == 0 || t->stack[t->depth - 1].id != id) {
+    /* frames left behind by longjmp are closed together with their caller */
+    int d = t->depth - 1;
+    while (d >= 0 && t->stack[d].id != id)
+      d--;
+    if (d < 0)
+      return;
+  }
+  while (t->depth > 0) {
+    struct __lc_prof_frame *f = &t->stack[--t->depth];
+    uint64_t incl = now - f->start;
+    if (f->id < LC_MAX_FUNCS) {
+      struct __lc_prof_ent *e = &t->tab[f->id];
+      e->calls++;
+      e->incl += incl;
+      e->excl += incl - (f->child < incl ? f->child : incl);
+    }
+    if (t->depth > 0)
+      t->stack[t->depth - 1].child += incl;
+    if (f->id == id)
+      break;
+  }
+}
+
+#endif
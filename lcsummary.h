@@ -0,0 +1,39 @@
+#ifndef LCSUMMARY_H
+#define LCSUMMARY_H
+/*
+ * Per-TU call graph summary written by LoopConvert -summary, merged by CGMerge.
+ * Functions are keyed by their clang USR, so the same function seen from
+ * different files (a declaration here, the definition there) is one node
+ * after the merge; static functions have the file in their USR.
+ *
+ * layout: header
+ *         uint32_t off[nstrings]      offsets into the string pool
+ *         char     pool[strbytes]     NUL-terminated strings, each stored once,
+ *                                     NUL-padded to a multiple of 4 so funcs are aligned
+ *         struct lc_sg_func  funcs[nfuncs]
+ *         struct lc_sg_edge  edges[nedges]
+ */
+#include <stdint.h>
+
+#define LC_SG_MAGIC    0x47534c4cu      /* "LLSG" */
+#define LC_SG_VERSION  2               /* 2: padded string pool */
+
+#define LC_SG_DEFINED  1u               /* this file has the body */
+#define LC_SG_EXTERN   2u               /* external linkage */
+
+struct lc_sg_header {
+  uint32_t magic, version;
+  uint32_t nstrings, strbytes;
+  uint32_t nfuncs, nedges;
+};
+
+struct lc_sg_func {
+  uint32_t usr, name;                   /* string indexes */
+  uint32_t flags;
+};
+
+struct lc_sg_edge {
+  uint32_t from, to;                    /* function indexes */
+};
+
+#endif
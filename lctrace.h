@@ -0,0 +1,165 @@
+#ifndef LCTRACE_H
+#define LCTRACE_H
+/*
+ * Flight recorder runtime for LoopConvert -trace.
+ * Every thread keeps the last LC_TRACE_N function enter/exit and block events
+ * in a thread-local ring; recording one event is a store and an increment.
+ * The rings are written to lctrace.<pid>.bin from a SIGSEGV/SIGBUS/SIGFPE/
+ * SIGILL/SIGABRT handler, on SIGUSR2, or by calling __lc_trace_dump().
+ * TraceDecode turns the file back into function names using func_blocks.txt.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifndef LC_TRACE_N
+#define LC_TRACE_N 4096                 /* events per thread, power of 2 */
+#endif
+#ifndef LC_TRACE_THREADS
+#define LC_TRACE_THREADS 256
+#endif
+#define LC_TRACE_MAGIC   0x5254434cu    /* "LCTR" */
+
+/* event = kind in the top 2 bits, function or block id below */
+#define LC_TR_ENTER      0x00000000u
+#define LC_TR_EXIT       0x40000000u
+#define LC_TR_BLOCK      0x80000000u
+#define LC_TR_ID_MASK    0x3fffffffu
+
+struct __lc_trace_buf {
+  uint32_t pos;                 /* events ever written, slot = pos & (N-1) */
+  uint32_t tid;                 /* 0 until the thread registered */
+  uint32_t ev[LC_TRACE_N];
+};
+
+/* file layout: header, then nthreads copies of struct __lc_trace_buf */
+struct __lc_trace_header {
+  uint32_t magic, n, nthreads, pid;
+};
+
+__attribute__((weak)) __thread struct __lc_trace_buf __lc_trace_tls;
+__attribute__((weak)) struct __lc_trace_buf *__lc_trace_bufs[LC_TRACE_THREADS];
+__attribute__((weak)) uint32_t __lc_trace_next_tid;
+__attribute__((weak)) pthread_key_t __lc_trace_key;
+
+/* async-signal-safe: only open/write/close */
+__attribute__((weak)) void __lc_trace_dump(void)
+{
+  char path[64] = "lctrace.";
+  char digits[16];
+  struct __lc_trace_header h;
+  int i, n = 0, fd;
+  unsigned pid = (unsigned)getpid();
+
+  do {
+    digits[n++] = '0' + pid % 10;
+    pid /= 10;
+  } while (pid);
+  for (i = 0; i < n; i++)
+    path[8 + i] = digits[n - 1 - i];
+  memcpy(path + 8 + n, ".bin", 5);
+
+  fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  if (fd == -1)
+    return;
+  h.magic = LC_TRACE_MAGIC;
+  h.n = LC_TRACE_N;
+  h.nthreads = 0;
+  h.pid = (uint32_t)getpid();
+  for (i = 0; i < LC_TRACE_THREADS; i++)
+    if (__lc_trace_bufs[i])
+      h.nthreads++;
+  if (write(fd, &h, sizeof(h)) != (ssize_t)sizeof(h)) {
+    close(fd);
+    return;
+  }
+  for (i = 0; i < LC_TRACE_THREADS; i++) {
+    struct __lc_trace_buf *b = __lc_trace_bufs[i];
+    if (b && write(fd, b, sizeof(*b)) != (ssize_t)sizeof(*b))
+      break;
+  }
+  close(fd);
+}
+
+__attribute__((weak)) void __lc_trace_signal(int sig)
+{
+  __lc_trace_dump();
+  if (sig == SIGUSR2)
+    return;
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+__attribute__((weak)) void __lc_trace_unregister(void *p)
+{
+  int i;
+  for (i = 0; i < LC_TRACE_THREADS; i++)
+    if (__lc_trace_bufs[i] == p)
+      __atomic_store_n(&__lc_trace_bufs[i], (struct __lc_trace_buf *)0, __ATOMIC_RELEASE);
+}
+
+__attribute__((weak)) void __lc_trace_install(void)
+{
+  static const int sigs[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGUSR2 };
+  struct sigaction sa;
+  unsigned i;
+
+  pthread_key_create(&__lc_trace_key, __lc_trace_unregister);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = __lc_trace_signal;
+  sa.sa_flags = SA_ONSTACK | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  for (i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++)
+    sigaction(sigs[i], &sa, NULL);
+}
+
+__attribute__((weak)) void __lc_trace_register(void)
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  struct __lc_trace_buf *b = &__lc_trace_tls;
+  stack_t ss;
+  int i;
+
+  pthread_once(&once, __lc_trace_install);
+  b->tid = __atomic_add_fetch(&__lc_trace_next_tid, 1, __ATOMIC_RELAXED);
+  for (i = 0; i < LC_TRACE_THREADS; i++) {
+    struct __lc_trace_buf *expect = 0;
+    if (__atomic_compare_exchange_n(&__lc_trace_bufs[i], &expect, b, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      break;
+  }
+  pthread_setspecific(__lc_trace_key, b);
+
+  /* the handler has to run on a stack overflow too */
+  ss.ss_sp = malloc(SIGSTKSZ);
+  ss.ss_size = SIGSTKSZ;
+  ss.ss_flags = 0;
+  if (ss.ss_sp)
+    sigaltstack(&ss, NULL);
+}
+
+#define __lc_trace_event(v) \
+  (__lc_trace_tls.ev[__lc_trace_tls.pos++ & (LC_TRACE_N - 1)] = (v))
+
+static inline void __lc_trace_enter(uint32_t id)
+{
+  if (__builtin_expect(__lc_trace_tls.tid == 0, 0))
+    __lc_trace_register();
+  __lc_trace_event(LC_TR_ENTER | (id & LC_TR_ID_MASK));
+}
+
+static inline void __lc_trace_exit(uint32_t id)
+{
+  __lc_trace_event(LC_TR_EXIT | (id & LC_TR_ID_MASK));
+}
+
+static inline void __lc_trace_block(uint32_t id)
+{
+  __lc_trace_event(LC_TR_BLOCK | (id & LC_TR_ID_MASK));
+}
+
+#endif